@@ -0,0 +1,553 @@
+/*
+ * cl_batch.c - Runs a manifest of commands in one process
+ *
+ * Each manifest line is
+ *
+ *    command start end source output [options...]
+ *
+ * where source is dump_file:mem_base or - for /dev/mem, and output is a file
+ * or - for stdout.  Blank lines and lines starting with # are skipped.
+ *
+ * Every source is opened (and dump files mapped) once up front.  Entries
+ * writing the same output run in manifest order in one worker, workers for
+ * different outputs run in parallel.  Commands print to stdout and keep their
+ * state in globals, so workers are forked processes rather than threads;
+ * they inherit the open sources and mapping windows.  A timing summary is
+ * printed once everything is done.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "cl_dump.h"
+
+#define MAX_LINE_LEN 1024
+#define MAX_ENTRY_ARGS 16
+
+//Manifest fields before any options
+#define ENTRY_FIELDS 5
+
+#define STATUS_NOT_RUN -1
+
+//Ends a group's list of entries
+#define NO_ENTRY 0xffffffffu
+
+typedef int (*range_cmd_fn)(char* start_addr_str, char* end_addr_str);
+typedef int (*argv_cmd_fn)(int argc, char* argv[]);
+
+//One of the two functions is set depending on how the command takes its
+//arguments
+typedef struct {
+   const char*  name;
+   range_cmd_fn range_fn;
+   argv_cmd_fn  argv_fn;
+} read_cmd_t;
+
+static const read_cmd_t read_cmds[NUM_READ_CMDS] = {
+   { "dis",       do_dis,       0 },
+   { "redundant", do_redundant, 0 },
+   { "pairs",     do_pairs,     0 },
+   { "draws",     do_draws,     0 },
+   { "textures",  do_textures,  0 },
+   { "hazards",   do_hazards,   0 },
+   { "sim",       0,            do_sim },
+   { "footprint", 0,            do_footprint },
+   { "cfg",       0,            do_cfg },
+   { "scan",      0,            do_scan },
+};
+
+typedef struct {
+   uint32_t           line;
+   int                cmd;
+   char*              source;   //0 for /dev/mem
+   uint32_t           base;
+   char*              output;
+   int                argc;     //start, end and options
+   char*              argv[MAX_ENTRY_ARGS];
+   uint32_t           group;
+   uint32_t           next;     //Next entry in the group, NO_ENTRY for the last
+} batch_entry_t;
+
+//Filled in by whichever process runs the entry, so lives in shared memory
+typedef struct {
+   int    status;
+   double seconds;
+} batch_result_t;
+
+typedef struct {
+   char*     output;
+   uint32_t  first;
+   uint32_t  last;
+} batch_group_t;
+
+typedef struct {
+   batch_entry_t*  entries;
+   uint32_t        num_entries;
+   uint32_t        max_entries;
+   batch_group_t*  groups;
+   uint32_t        num_groups;
+   batch_result_t* results;
+} batch_t;
+
+static double now(void) {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int find_read_cmd(const char* name) {
+   int i;
+
+   for(i = 0;i < NUM_READ_CMDS; ++i) {
+      if(strcmp(read_cmds[i].name, name) == 0)
+         return i;
+   }
+
+   return -1;
+}
+
+const char* read_cmd_name(int cmd) {
+   return read_cmds[cmd].name;
+}
+
+int run_read_cmd(int cmd, int argc, char* argv[]) {
+   if(argc < 2) {
+      fprintf(stderr, "%s needs start and end addresses\n", read_cmds[cmd].name);
+      return 1;
+   }
+
+   if(read_cmds[cmd].range_fn) {
+      if(argc != 2) {
+         fprintf(stderr, "%s takes no options\n", read_cmds[cmd].name);
+         return 1;
+      }
+
+      return read_cmds[cmd].range_fn(argv[0], argv[1]);
+   }
+
+   return read_cmds[cmd].argv_fn(argc, argv);
+}
+
+int parse_source_spec(char* spec, char** mem_file, uint32_t* base) {
+   char* colon;
+
+   if(strcmp(spec, "-") == 0 || strcmp(spec, "/dev/mem") == 0) {
+      *mem_file = 0;
+      *base     = 0;
+      return 0;
+   }
+
+   colon = strrchr(spec, ':');
+   if(!colon || sscanf(colon + 1, "0x%x", base) != 1)
+      return 1;
+
+   *colon    = 0;
+   *mem_file = spec;
+
+   return 0;
+}
+
+static int parse_line(batch_t* batch, char* line, uint32_t line_num, const char* manifest) {
+   batch_entry_t* entry;
+   char*          fields[ENTRY_FIELDS + MAX_ENTRY_ARGS];
+   uint32_t       num_fields = 0;
+   char*          field;
+   char*          source;
+   uint32_t       i;
+
+   for(field = strtok(line, " \t\r\n");field; field = strtok(0, " \t\r\n")) {
+      if(num_fields == ENTRY_FIELDS + MAX_ENTRY_ARGS - 2) {
+         fprintf(stderr, "%s:%u: too many options\n", manifest, line_num);
+         return 1;
+      }
+
+      fields[num_fields++] = field;
+   }
+
+   if(num_fields == 0 || fields[0][0] == '#')
+      return 0;
+
+   if(num_fields < ENTRY_FIELDS) {
+      fprintf(stderr, "%s:%u: expected command start end source output\n", manifest, line_num);
+      return 1;
+   }
+
+   if(batch->num_entries == batch->max_entries) {
+      batch_entry_t* grown;
+
+      batch->max_entries = batch->max_entries ? batch->max_entries * 2 : 64;
+      grown = realloc(batch->entries, batch->max_entries * sizeof(batch_entry_t));
+      if(!grown) {
+         fprintf(stderr, "Out of memory\n");
+         return 1;
+      }
+      batch->entries = grown;
+   }
+
+   entry = &batch->entries[batch->num_entries];
+   memset(entry, 0, sizeof(batch_entry_t));
+   entry->line = line_num;
+
+   entry->cmd = find_read_cmd(fields[0]);
+   if(entry->cmd < 0) {
+      fprintf(stderr, "%s:%u: %s can't be batched\n", manifest, line_num, fields[0]);
+      return 1;
+   }
+
+   if(read_cmds[entry->cmd].range_fn && num_fields != ENTRY_FIELDS) {
+      fprintf(stderr, "%s:%u: %s takes no options\n", manifest, line_num, fields[0]);
+      return 1;
+   }
+
+   //The entry keeps the source path, so it parses a copy
+   source = strdup(fields[3]);
+   if(!source) {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+   }
+
+   if(parse_source_spec(source, &entry->source, &entry->base)) {
+      fprintf(stderr, "%s:%u: source must be dump_file:0x1234abcd or -\n", manifest, line_num);
+      return 1;
+   }
+
+   entry->output  = strdup(fields[4]);
+   entry->argv[0] = strdup(fields[1]);
+   entry->argv[1] = strdup(fields[2]);
+   entry->argc    = 2;
+
+   for(i = ENTRY_FIELDS;i < num_fields; ++i) {
+      entry->argv[entry->argc++] = strdup(fields[i]);
+   }
+
+   for(i = 0;i < entry->argc; ++i) {
+      if(!entry->argv[i])
+         break;
+   }
+
+   if(!entry->output || i < entry->argc) {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+   }
+
+   batch->num_entries++;
+
+   return 0;
+}
+
+static int read_manifest(batch_t* batch, const char* manifest) {
+   FILE*    f;
+   char     line[MAX_LINE_LEN];
+   uint32_t line_num = 0;
+   int      ret = 0;
+
+   f = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+   if(!f) {
+      fprintf(stderr, "Couldn't open manifest %s: %s\n", manifest, strerror(errno));
+      return 1;
+   }
+
+   while(!ret && fgets(line, sizeof(line), f)) {
+      //fgets splits a longer line, and the rest would parse as another entry
+      if(!strchr(line, '\n') && !feof(f)) {
+         fprintf(stderr, "%s:%u: line longer than %d characters\n", manifest, ++line_num, MAX_LINE_LEN - 2);
+         ret = 1;
+         break;
+      }
+
+      ret = parse_line(batch, line, ++line_num, manifest);
+   }
+
+   if(f != stdin)
+      fclose(f);
+
+   return ret;
+}
+
+typedef struct {
+   const char* output;
+   uint32_t    entry;
+} output_ref_t;
+
+static int compare_output_refs(const void* a, const void* b) {
+   const output_ref_t* ref_a = a;
+   const output_ref_t* ref_b = b;
+   int                 cmp = strcmp(ref_a->output, ref_b->output);
+
+   if(cmp)
+      return cmp;
+
+   return ref_a->entry < ref_b->entry ? -1 : ref_a->entry > ref_b->entry;
+}
+
+//Entries sharing an output go in one group, in manifest order.  Sorting by
+//output finds each entry's first sharer, which then leads the group.
+static int make_groups(batch_t* batch) {
+   output_ref_t* refs;
+   uint32_t*     leaders;
+   uint32_t      i;
+
+   batch->groups = malloc(batch->num_entries * sizeof(batch_group_t));
+   refs          = malloc(batch->num_entries * sizeof(output_ref_t));
+   leaders       = malloc(batch->num_entries * sizeof(uint32_t));
+   if(!batch->groups || !refs || !leaders) {
+      free(refs);
+      free(leaders);
+      return 1;
+   }
+
+   for(i = 0;i < batch->num_entries; ++i) {
+      refs[i].output = batch->entries[i].output;
+      refs[i].entry  = i;
+   }
+
+   qsort(refs, batch->num_entries, sizeof(output_ref_t), compare_output_refs);
+
+   for(i = 0;i < batch->num_entries; ++i) {
+      if(i && strcmp(refs[i].output, refs[i - 1].output) == 0)
+         leaders[refs[i].entry] = leaders[refs[i - 1].entry];
+      else
+         leaders[refs[i].entry] = refs[i].entry;
+   }
+
+   for(i = 0;i < batch->num_entries; ++i) {
+      batch_entry_t* entry = &batch->entries[i];
+      batch_group_t* group;
+
+      if(leaders[i] == i) {
+         entry->group  = batch->num_groups++;
+         group         = &batch->groups[entry->group];
+         group->output = entry->output;
+         group->first  = i;
+      } else {
+         entry->group = batch->entries[leaders[i]].group;
+         group        = &batch->groups[entry->group];
+         batch->entries[group->last].next = i;
+      }
+
+      entry->next = NO_ENTRY;
+      group->last = i;
+   }
+
+   free(refs);
+   free(leaders);
+
+   return 0;
+}
+
+static int run_entry(batch_entry_t* entry) {
+   if(select_source(entry->source, entry->base))
+      return 1;
+
+   return run_read_cmd(entry->cmd, entry->argc, entry->argv);
+}
+
+//Runs a group's entries with stdout sent to its output
+static void run_group(batch_t* batch, batch_group_t* group) {
+   int      saved_stdout = -1;
+   uint32_t i;
+
+   fflush(stdout);
+
+   if(strcmp(group->output, "-") != 0) {
+      int fd = open(group->output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+      if(fd < 0) {
+         fprintf(stderr, "Couldn't open output %s: %s\n", group->output, strerror(errno));
+         for(i = group->first;i != NO_ENTRY; i = batch->entries[i].next) {
+            batch->results[i].status = 1;
+         }
+         return;
+      }
+
+      saved_stdout = dup(STDOUT_FILENO);
+      dup2(fd, STDOUT_FILENO);
+      close(fd);
+   }
+
+   for(i = group->first;i != NO_ENTRY; i = batch->entries[i].next) {
+      batch_result_t* result = &batch->results[i];
+      double          start = now();
+
+      result->status  = run_entry(&batch->entries[i]);
+      fflush(stdout);
+      result->seconds = now() - start;
+   }
+
+   if(saved_stdout >= 0) {
+      dup2(saved_stdout, STDOUT_FILENO);
+      close(saved_stdout);
+   }
+}
+
+static int run_groups(batch_t* batch, uint32_t jobs) {
+   uint32_t next = 0;
+   uint32_t running = 0;
+
+   //Nothing to gain from forking, and the decode caches stay warm across groups
+   if(jobs <= 1 || batch->num_groups == 1) {
+      for(next = 0;next < batch->num_groups; ++next) {
+         run_group(batch, &batch->groups[next]);
+      }
+
+      return 0;
+   }
+
+   fflush(stdout);
+   fflush(stderr);
+
+   while(next < batch->num_groups || running) {
+      pid_t pid;
+
+      if(next < batch->num_groups && running < jobs) {
+         pid = fork();
+         if(pid < 0) {
+            fprintf(stderr, "fork failed: %s\n", strerror(errno));
+            if(!running)
+               return 1;
+         } else if(pid == 0) {
+            run_group(batch, &batch->groups[next]);
+            fflush(stdout);
+            _exit(0);
+         } else {
+            next++;
+            running++;
+            continue;
+         }
+      }
+
+      if(wait(0) > 0)
+         running--;
+   }
+
+   return 0;
+}
+
+static void print_summary(batch_t* batch, double wall) {
+   double   busy = 0;
+   uint32_t failed = 0;
+   uint32_t c;
+   uint32_t i;
+
+   printf("Batch summary\n");
+   printf("-------------\n");
+   printf("%-10s %7s %7s %10s %10s %10s\n", "command", "entries", "failed", "total s", "mean ms", "max ms");
+
+   for(c = 0;c < NUM_READ_CMDS; ++c) {
+      uint32_t count = 0;
+      uint32_t cmd_failed = 0;
+      double   total = 0;
+      double   max = 0;
+
+      for(i = 0;i < batch->num_entries; ++i) {
+         batch_result_t* result = &batch->results[i];
+
+         if(batch->entries[i].cmd != c)
+            continue;
+
+         count++;
+         cmd_failed += result->status != 0;
+         total      += result->seconds;
+         if(result->seconds > max)
+            max = result->seconds;
+      }
+
+      if(!count)
+         continue;
+
+      printf("%-10s %7u %7u %10.3f %10.3f %10.3f\n", read_cmds[c].name, count, cmd_failed, total,
+         1000 * total / count, 1000 * max);
+
+      busy   += total;
+      failed += cmd_failed;
+   }
+
+   for(i = 0;i < batch->num_entries; ++i) {
+      if(batch->results[i].status == STATUS_NOT_RUN)
+         printf("line %u: not run\n", batch->entries[i].line);
+      else if(batch->results[i].status)
+         printf("line %u: %s failed\n", batch->entries[i].line, read_cmds[batch->entries[i].cmd].name);
+   }
+
+   printf("%u entries in %u outputs, %u failed, %.3f s wall, %.3f s in commands (%.1fx parallel)\n",
+      batch->num_entries, batch->num_groups, failed, wall, busy, wall > 0 ? busy / wall : 0.0);
+}
+
+int do_batch(int argc, char* argv[]) {
+   batch_t  batch;
+   uint32_t jobs = sysconf(_SC_NPROCESSORS_ONLN);
+   double   start;
+   uint32_t i;
+   int      ret = 0;
+
+   if(argc < 1)
+      return 1;
+
+   for(i = 1;i < argc; ++i) {
+      if(strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+         jobs = atoi(argv[++i]);
+      } else {
+         fprintf(stderr, "Unknown batch option %s\n", argv[i]);
+         return 1;
+      }
+   }
+
+   start = now();
+
+   memset(&batch, 0, sizeof(batch));
+
+   if(read_manifest(&batch, argv[0]))
+      return 1;
+
+   if(!batch.num_entries) {
+      fprintf(stderr, "No entries in %s\n", argv[0]);
+      return 1;
+   }
+
+   if(make_groups(&batch)) {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+   }
+
+   batch.results = mmap(0, batch.num_entries * sizeof(batch_result_t), PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if(batch.results == MAP_FAILED) {
+      fprintf(stderr, "Couldn't allocate batch results: %s\n", strerror(errno));
+      return 1;
+   }
+
+   for(i = 0;i < batch.num_entries; ++i) {
+      batch.results[i].status = STATUS_NOT_RUN;
+   }
+
+   //Open every source before forking so the workers share them, entries on a
+   //source that won't open fail when they run
+   for(i = 0;i < batch.num_entries; ++i) {
+      select_source(batch.entries[i].source, batch.entries[i].base);
+   }
+
+   ret = run_groups(&batch, jobs);
+
+   print_summary(&batch, now() - start);
+
+   for(i = 0;i < batch.num_entries; ++i) {
+      if(batch.results[i].status)
+         ret = 1;
+   }
+
+   munmap(batch.results, batch.num_entries * sizeof(batch_result_t));
+
+   return ret;
+}
@@ -19,6 +19,7 @@
 #include "v3d_cl_instr_autogen.h"
 #include "cl_dump.h"
 #include "qpudis.h"
+#include "cl_stats.h"
 
 //When disassembling a CL if we don't have an end address we disassemble
 //til we hit a BRANCH (not sub-list branch) or RETURN.  If we've got a 
@@ -26,6 +27,11 @@
 //on how large we let a CL get before giving up.
 #define MAX_CL_SIZE 512 * 1024 //512 kb
 
+//Limits on how far walk_cl follows branches so a corrupt CL that branches to
+//itself doesn't loop forever.
+#define MAX_CL_DEPTH    8
+#define MAX_CL_BRANCHES 4096
+
 typedef struct {
    uint32_t start_address;
    uint32_t end_address;
@@ -61,7 +67,17 @@ static int is_cl_end(uint8_t* ins);
 static void add_buf_references(void* ins, uint32_t end_address);
 static int dis_cl(uint32_t start_address, uint32_t end_address);
 static int dis_shader_rec(uint32_t start_address, uint32_t end_address);
-static int dis_qpu_prog(uint32_t start_address, uint32_t end_address);
+static int walk_cl_buf(uint32_t start_address, uint32_t end_address, cl_walk_fn fn, void* ctx, 
+   int depth, uint32_t* branches);
+
+int parse_cl_range(char* start_addr_str, char* end_addr_str, uint32_t* start_addr, uint32_t* end_addr) {
+   if(sscanf(start_addr_str, "0x%x", start_addr) != 1 || sscanf(end_addr_str, "0x%x", end_addr) != 1) {
+      fprintf(stderr, "Addresses must be of form 0x1234ABCD\n");
+      return 1;
+   }
+
+   return 0;
+}
 
 //TODO: if end address is actually inside an instruction this may cause a segmentation error
 int do_dis(char* start_addr_str, char* end_addr_str) {
@@ -85,16 +101,19 @@ int do_dis(char* start_addr_str, char* end_addr_str) {
    while(v3d_bufs) {
       switch(v3d_bufs->buf_type) {
          case BUF_TYPE_CL:
+            STATS_COUNT(STATS_CL_BUFS, 1);
             if(dis_cl(v3d_bufs->buf_start, v3d_bufs->buf_end)) {
                fprintf(stderr, "Failed to disassemble CL buf start: %08x end: %08x\n", v3d_bufs->buf_start, v3d_bufs->buf_end);
             }
             break;
          case BUF_TYPE_SHADER_REC:
+            STATS_COUNT(STATS_SHADER_RECS, 1);
             if(dis_shader_rec(v3d_bufs->buf_start, v3d_bufs->buf_end)) {
                fprintf(stderr, "Failed to disassemble shader rec buf start: %08x end: %08x\n", v3d_bufs->buf_start, v3d_bufs->buf_end);
             }
             break;
          case BUF_TYPE_QPU_PROG:
+            STATS_COUNT(STATS_QPU_PROGS, 1);
             if(dis_qpu_prog(v3d_bufs->buf_start, v3d_bufs->buf_end)) {
                fprintf(stderr, "Failed to disassemble QPU buf start: %08x, end: %08x\n", v3d_bufs->buf_start, v3d_bufs->buf_end);
             }
@@ -157,6 +176,10 @@ static void init_dis_state(dis_state_t* state, uint32_t start_address, uint32_t
 
 static int increase_dis_area(dis_state_t* state) {
    uint32_t cur_ins_offset;
+   uint32_t old_area_size;
+   uint32_t area_start;
+   uint32_t area_end;
+   STATS_BEGIN(STATS_DIS_AREA);
 
    cur_ins_offset = state->cur_ins - state->cl_start;
 
@@ -164,14 +187,30 @@ static int increase_dis_area(dis_state_t* state) {
       unmap_area(state->cl_start, state->current_area_size);
    }
    
+   old_area_size = state->cl_start ? state->current_area_size : 0;
    state->current_area_size *= 2;
 
+   //Grow no further than the end of a dump file, stopping once it's reached
+   area_start = state->start_address;
+   area_end   = state->start_address + state->current_area_size;
+   if(!clip_to_mem(&area_start, &area_end) && area_start == state->start_address &&
+      area_end - area_start < state->current_area_size) {
+      if(area_end - area_start <= old_area_size) {
+         fprintf(stderr, "Disassembly reached the end of the dump file\n");
+         STATS_END(STATS_DIS_AREA);
+         return 1;
+      }
+
+      state->current_area_size = area_end - area_start;
+   }
+
 #ifdef CL_DUMP_DEBUG
    printf("Expanding diassembly memory area to size %d cur_ins: %p\n", state->current_area_size, state->cur_ins);
 #endif
 
    if(state->current_area_size > MAX_CL_SIZE) {
       fprintf(stderr, "Runaway disassembly memory area\n");
+      STATS_END(STATS_DIS_AREA);
       return 2;
    }
 
@@ -179,6 +218,7 @@ static int increase_dis_area(dis_state_t* state) {
    
    if(!state->cl_start) {
       fprintf(stderr, "Failed to map CL memory\n");
+      STATS_END(STATS_DIS_AREA);
       return 1;
    }
 
@@ -194,6 +234,8 @@ static int increase_dis_area(dis_state_t* state) {
    printf("New cur_ins: %p\n", state->cur_ins);
 #endif
 
+   STATS_END(STATS_DIS_AREA);
+
    return 0;
 }
 
@@ -211,43 +253,58 @@ static int is_cl_end(uint8_t* ins) {
    return 0;
 }
 
-static void add_buf_references(void* ins, uint32_t end_address) {
-   uint8_t* opcode = ins;
-   switch(*opcode) {
-      case V3D_HW_INSTR_BRANCH_SUB: {
-         instr_BRANCH_SUB_t* branch_ins = ins;
-         add_v3d_buf(BUF_TYPE_CL, branch_ins->branch_addr, 0);
-         break;
-      }
-      case V3D_HW_INSTR_BRANCH: {
-         instr_BRANCH_t* branch_ins = ins;
-         //A BRANCH is effectively continuing the CL elsewhere (we cannot RETURN).
-         //So inherit the end_address so we know when we've hit the end in the new
-         //CL buffer.
-         add_v3d_buf(BUF_TYPE_CL, branch_ins->branch_addr, end_address);
-         break;
-      }
-      case V3D_HW_INSTR_GL_SHADER: {
-         instr_GL_SHADER_t* glshader_ins = ins;
-
-         uint32_t shader_record_addr = glshader_ins->shader_record_addr << 4;
-         uint32_t buf_type;
-         uint32_t buf_size;
-
-
-         buf_size = sizeof(instr_SHADER_RECORD_t) 
-            + sizeof(instr_ATTR_ARRAY_RECORD_t) * glshader_ins->num_attr_arrays;
-         
-         if(glshader_ins->extended_record) {
-            buf_type = BUF_TYPE_SHADER_REC_EXT;
-            //TODO: workout what to do with buf_size
-         } else {
-            buf_type = BUF_TYPE_SHADER_REC;
-         }
+static int buf_ref_BRANCH_SUB(void* ctx, instr_BRANCH_SUB_t* ins, uint32_t branch_addr) {
+   add_v3d_buf(BUF_TYPE_CL, branch_addr, 0);
+   return 0;
+}
 
-         add_v3d_buf(buf_type, shader_record_addr, shader_record_addr + buf_size);
-      }
+static int buf_ref_BRANCH(void* ctx, instr_BRANCH_t* ins, uint32_t branch_addr) {
+   uint32_t* end_address = ctx;
+
+   //A BRANCH is effectively continuing the CL elsewhere (we cannot RETURN).
+   //So inherit the end_address so we know when we've hit the end in the new
+   //CL buffer.
+   add_v3d_buf(BUF_TYPE_CL, branch_addr, *end_address);
+   return 0;
+}
+
+uint32_t gl_shader_attr_arrays(uint8_t num_attr_arrays) {
+   //The 3 bit field can't hold 8, 0 means 8 arrays
+   return num_attr_arrays ? num_attr_arrays : 8;
+}
+
+uint32_t gl_shader_rec_size(uint8_t num_attr_arrays) {
+   return sizeof(instr_SHADER_RECORD_t) + sizeof(instr_ATTR_ARRAY_RECORD_t) * gl_shader_attr_arrays(num_attr_arrays);
+}
+
+static int buf_ref_GL_SHADER(void* ctx, instr_GL_SHADER_t* ins, uint8_t num_attr_arrays,
+   uint8_t extended_record, uint32_t shader_record_addr) {
+   uint32_t buf_type;
+   uint32_t buf_size;
+
+   shader_record_addr <<= 4;
+
+   buf_size = gl_shader_rec_size(num_attr_arrays);
+   
+   if(extended_record) {
+      buf_type = BUF_TYPE_SHADER_REC_EXT;
+      //TODO: workout what to do with buf_size
+   } else {
+      buf_type = BUF_TYPE_SHADER_REC;
    }
+
+   add_v3d_buf(buf_type, shader_record_addr, shader_record_addr + buf_size);
+   return 0;
+}
+
+static const v3d_cl_visitor_t buf_ref_visitor = {
+   .visit_BRANCH_SUB = buf_ref_BRANCH_SUB,
+   .visit_BRANCH     = buf_ref_BRANCH,
+   .visit_GL_SHADER  = buf_ref_GL_SHADER
+};
+
+static void add_buf_references(void* ins, uint32_t end_address) {
+   visit_instr(&buf_ref_visitor, &end_address, ins);
 }
 
 static int dis_cl(uint32_t start_address, uint32_t end_address) {
@@ -258,12 +315,16 @@ static int dis_cl(uint32_t start_address, uint32_t end_address) {
    printf("CL buffer addr: %08x\n", start_address);
    printf("------------------------\n");
 
-   increase_dis_area(&state);
+   if(increase_dis_area(&state))
+      return 1;
 
    while((!state.cl_end || (state.cur_ins < state.cl_end))) {
       void* next_ins;
+      STATS_BEGIN(STATS_CL_DECODE);
 
       next_ins = calc_next_ins(state.cur_ins);
+      STATS_END(STATS_CL_DECODE);
+      STATS_COUNT(STATS_CL_INSTS, 1);
       if(next_ins == 0) { //Invalid opcode
          next_ins = state.cur_ins + 1; 
       }
@@ -281,9 +342,11 @@ static int dis_cl(uint32_t start_address, uint32_t end_address) {
       }
 
       printf("%08x: ", virt_to_dis_addr(state.cur_ins, &state));
+      STATS_BEGIN(STATS_CL_FORMAT);
       if(disassemble_instr(state.cur_ins, stdout)) {
          printf("INVALID OPCODE (%d)\n", (uint32_t)(*(uint8_t*)state.cur_ins));
       }
+      STATS_END(STATS_CL_FORMAT);
 
       add_buf_references(state.cur_ins, state.end_address);
 
@@ -309,6 +372,99 @@ static int dis_cl(uint32_t start_address, uint32_t end_address) {
    return 0;
 }
 
+int walk_cl(uint32_t start_address, uint32_t end_address, cl_walk_fn fn, void* ctx) {
+   uint32_t branches = 0;
+
+   return walk_cl_buf(start_address, end_address, fn, ctx, 0, &branches);
+}
+
+//Walks one CL buffer, recursing for sub-lists.  A BRANCH continues the walk at
+//its target with the same end address, as add_buf_references does for dis.
+static int walk_cl_buf(uint32_t start_address, uint32_t end_address, cl_walk_fn fn, void* ctx, 
+   int depth, uint32_t* branches) {
+   dis_state_t state;
+   int         ret = 0;
+
+   if(depth > MAX_CL_DEPTH) {
+      fprintf(stderr, "Sub-list nesting too deep at %08x\n", start_address);
+      return 1;
+   }
+
+restart:
+   init_dis_state(&state, start_address, end_address);
+
+   if(increase_dis_area(&state)) {
+      fprintf(stderr, "Failed to map CL memory at %08x\n", start_address);
+      return 1;
+   }
+
+   while(!state.cl_end || (state.cur_ins < state.cl_end)) {
+      void*    next_ins;
+      uint8_t  opcode;
+      uint32_t addr;
+      STATS_BEGIN(STATS_CL_DECODE);
+
+      next_ins = calc_next_ins(state.cur_ins);
+      STATS_END(STATS_CL_DECODE);
+      STATS_COUNT(STATS_CL_INSTS, 1);
+
+      if(next_ins && next_ins > state.cl_start + state.current_area_size) {
+         //increase_dis_area has already unmapped the old area on failure
+         if(increase_dis_area(&state))
+            return 1;
+
+         next_ins = calc_next_ins(state.cur_ins);
+      }
+
+      addr   = virt_to_dis_addr(state.cur_ins, &state);
+      opcode = *(uint8_t*)state.cur_ins;
+
+      if(next_ins == 0) {
+         fprintf(stderr, "Invalid opcode %d at %08x, stopping walk\n", (uint32_t)opcode, addr);
+         ret = 1;
+         break;
+      }
+
+      ret = fn(ctx, state.cur_ins, addr);
+      if(ret == CL_WALK_NO_FOLLOW) {
+         ret = 0;
+
+         if(is_cl_end(state.cur_ins))
+            break;
+      } else if(ret) {
+         break;
+      } else if(opcode == V3D_HW_INSTR_BRANCH_SUB) {
+         ret = walk_cl_buf(((instr_BRANCH_SUB_t*)state.cur_ins)->branch_addr, 0, fn, ctx, depth + 1, branches);
+         if(ret)
+            break;
+      } else if(opcode == V3D_HW_INSTR_BRANCH) {
+         if(++*branches > MAX_CL_BRANCHES) {
+            fprintf(stderr, "Too many branches, stopping walk at %08x\n", addr);
+            ret = 1;
+            break;
+         }
+
+         start_address = ((instr_BRANCH_t*)state.cur_ins)->branch_addr;
+         unmap_area(state.cl_start, state.current_area_size);
+         goto restart;
+      } else if(is_cl_end(state.cur_ins)) {
+         break;
+      }
+
+      state.cur_ins = next_ins;
+
+      if(state.cur_ins >= state.cl_start + state.current_area_size) {
+         //increase_dis_area has already unmapped the old area on failure
+         if(increase_dis_area(&state))
+            return 1;
+      }
+   }
+
+   unmap_area(state.cl_start, state.current_area_size);
+
+   return ret;
+}
+
 static int dis_shader_rec(uint32_t start_address, uint32_t end_address) {
    instr_SHADER_RECORD_t* shader_rec;
    instr_ATTR_ARRAY_RECORD_t* cur_attr_array;
@@ -351,8 +507,109 @@ static int dis_shader_rec(uint32_t start_address, uint32_t end_address) {
 }
 
 #define INITIAL_QPU_BUF_SIZE 4096
+#define MAX_QPU_PROG_SIZE    256 * 1024 //256 kb
+
+//Programs found by searching for their end, direct mapped on address.  Saves
+//repeating the search for programs used by many draws (and batch entries).
+#define QPU_PROG_CACHE_SIZE 256
+
+typedef struct {
+   uint32_t start_address; //0 for an empty slot
+   uint32_t num_insts;
+   uint32_t search_area_size;
+} qpu_prog_cache_t;
+
+static qpu_prog_cache_t qpu_prog_cache[QPU_PROG_CACHE_SIZE];
+static int              qpu_prog_cache_enabled = 1;
+
+void reset_qpu_prog_cache(int enabled) {
+   memset(qpu_prog_cache, 0, sizeof(qpu_prog_cache));
+   qpu_prog_cache_enabled = enabled;
+}
+
+void* map_qpu_prog(uint32_t start_address, uint32_t end_address, uint32_t* num_insts, uint32_t* mapped_size) {
+   void*             qpu_prog;
+   uint32_t          search_area_size = INITIAL_QPU_BUF_SIZE;
+   uint64_t*         current_instruction;
+   uint32_t          prog_size; //Measured in instructions
+   qpu_prog_cache_t* cached = &qpu_prog_cache[(start_address >> 3) % QPU_PROG_CACHE_SIZE];
+
+   if(!end_address && start_address && cached->start_address == start_address) {
+      qpu_prog = map_area(start_address, cached->search_area_size);
+      if(qpu_prog) {
+         *num_insts   = cached->num_insts;
+         *mapped_size = cached->search_area_size;
+      }
+
+      return qpu_prog;
+   }
+
+   if(end_address) {
+      *num_insts   = (end_address - start_address) / 8;
+      *mapped_size = *num_insts * 8;
+
+      qpu_prog = map_area(start_address, *mapped_size);
+      if(!qpu_prog)
+         fprintf(stderr, "Failed to map QPU program memory at %08x\n", start_address);
+
+      return qpu_prog;
+   }
 
-static int dis_qpu_prog(uint32_t start_address, uint32_t end_address) {
+   while(search_area_size <= MAX_QPU_PROG_SIZE) {
+      uint32_t area_start = start_address;
+      uint32_t area_end   = start_address + search_area_size;
+      int      at_mem_end = 0;
+
+      //Search no further than the end of a dump file
+      if(!clip_to_mem(&area_start, &area_end) && area_start == start_address &&
+         area_end - area_start < search_area_size) {
+         search_area_size = area_end - area_start;
+         at_mem_end       = 1;
+      }
+
+      //Need to search for the program end, this occurs two instructions after we see a program end signal
+      qpu_prog = map_area(start_address, search_area_size);
+      if(!qpu_prog) {
+         fprintf(stderr, "Failed to map QPU program memory with size %d\n", search_area_size);
+         return 0;
+      }
+
+      current_instruction = qpu_prog;
+      prog_size           = 0;
+
+      //Stop early enough that the two delay slots are mapped too
+      while(((void*)(current_instruction + 3) - qpu_prog) <= search_area_size) {
+         ++prog_size;
+         //Signalling field is bits 63-60 of instruction
+         //4'd3 == program end
+         if(((*current_instruction) >> 60) == 0x3) {
+            *num_insts   = prog_size + 2;
+            *mapped_size = search_area_size;
+
+            if(qpu_prog_cache_enabled) {
+               cached->start_address    = start_address;
+               cached->num_insts        = *num_insts;
+               cached->search_area_size = search_area_size;
+            }
+
+            return qpu_prog;
+         }
+
+         ++current_instruction;
+      }
+
+      unmap_area(qpu_prog, search_area_size);
+      if(at_mem_end)
+         break;
+
+      search_area_size *= 2;
+   }
+
+   fprintf(stderr, "No program end found in QPU program at %08x\n", start_address);
+   return 0;
+}
+
+int dis_qpu_prog(uint32_t start_address, uint32_t end_address) {
    void* qpu_prog;
    uint32_t prog_size; //Measured in instructions
    uint32_t mapped_area_size; //Measured in bytes
@@ -360,55 +617,116 @@ static int dis_qpu_prog(uint32_t start_address, uint32_t end_address) {
    printf("QPU Program Addr: %08x\n", start_address);
    printf("--------------------------\n");
 
-   if(end_address == 0) { 
-      uint32_t  search_area_size = INITIAL_QPU_BUF_SIZE;
-      uint64_t* current_instruction;
-      uint32_t  found_end;
-
-      while(1) {
-         //Need to search for the program end, this occurs two instructions after we see a program end signal
-         qpu_prog = map_area(start_address, search_area_size);
-         if(!qpu_prog) {
-            fprintf(stderr, "Failed to map QPU program memory with size %d\n", search_area_size);
-            return 1;
-         }
+   qpu_prog = map_qpu_prog(start_address, end_address, &prog_size, &mapped_area_size);
+   if(!qpu_prog)
+      return 1;
 
-         current_instruction = qpu_prog;
-         prog_size           = 0;
-         found_end           = 0;
-
-         while(((void*)current_instruction - qpu_prog) < search_area_size) {
-            ++prog_size;
-            //Signalling field is bits 63-60 of instruction
-            //4'd3 == program end
-            if(((*current_instruction) >> 60) == 0x3) {
-               prog_size += 2;
-               found_end = 1;
-               break;
-            }
+   show_qpu_fragment(qpu_prog, prog_size*2);
 
-            ++current_instruction;
-         }
+   unmap_area(qpu_prog, mapped_area_size);
 
-         if(found_end) {
-            mapped_area_size = search_area_size;
-            break;
-         }
+   return 0;
+}
 
-         unmap_area(qpu_prog, search_area_size);
-         search_area_size *= 2;
+typedef struct {
+   qpu_prog_t* progs;
+   uint32_t    num_progs;
+   uint32_t    max_progs;
+   int         per_uniforms;
+} qpu_prog_list_t;
+
+static void add_qpu_prog(qpu_prog_list_t* list, uint32_t type, uint32_t shader_rec_addr, uint32_t code_addr,
+   uint32_t uniforms_addr, uint32_t num_uniforms) {
+   qpu_prog_t* prog;
+   uint32_t    i;
+
+   for(i = 0;i < list->num_progs; ++i) {
+      if(list->progs[i].addr == code_addr &&
+         (!list->per_uniforms || list->progs[i].uniforms_addr == uniforms_addr)) {
+         list->progs[i].num_uses++;
+         return;
       }
-   } else {
-      prog_size = (end_address - start_address) / 8;
-      mapped_area_size = prog_size * 8;
+   }
 
-      qpu_prog = map_area(start_address, mapped_area_size);
+   if(list->num_progs == list->max_progs) {
+      list->max_progs = list->max_progs ? list->max_progs * 2 : 16;
+      list->progs = realloc(list->progs, list->max_progs * sizeof(qpu_prog_t));
+      assert(list->progs);
    }
 
-   show_qpu_fragment(qpu_prog, prog_size*2);
+   prog = &list->progs[list->num_progs++];
+   memset(prog, 0, sizeof(qpu_prog_t));
 
-   unmap_area(qpu_prog, mapped_area_size);
+   prog->type            = type;
+   prog->addr            = code_addr;
+   prog->shader_rec_addr = shader_rec_addr;
+   prog->uniforms_addr   = uniforms_addr;
+   prog->num_uniforms    = num_uniforms;
+   prog->num_uses        = 1;
+}
+
+static int qpu_prog_walk_fn(void* ctx, void* ins, uint32_t addr) {
+   qpu_prog_list_t*       list = ctx;
+   instr_SHADER_RECORD_t* rec;
+   uint32_t               rec_addr;
+
+   //NV and VG shader records have different layouts and aren't followed
+   if(*(uint8_t*)ins != V3D_HW_INSTR_GL_SHADER)
+      return 0;
+
+   rec_addr = ((instr_GL_SHADER_t*)ins)->shader_record_addr << 4;
+
+   rec = map_area(rec_addr, sizeof(instr_SHADER_RECORD_t));
+   if(!rec) {
+      fprintf(stderr, "Failed to map shader record at %08x\n", rec_addr);
+      return 1;
+   }
+
+   add_qpu_prog(list, QPU_PROG_FS, rec_addr, rec->fs_code_addr, rec->fs_uniforms_addr, rec->fs_num_uniforms);
+   add_qpu_prog(list, QPU_PROG_VS, rec_addr, rec->vs_code_addr, rec->vs_uniforms_addr, rec->vs_num_uniforms);
+   add_qpu_prog(list, QPU_PROG_CS, rec_addr, rec->cs_code_addr, rec->cs_uniforms_addr, rec->cs_num_uniforms);
+
+   unmap_area(rec, sizeof(instr_SHADER_RECORD_t));
 
    return 0;
 }
 
+const char* qpu_prog_type_name(uint32_t type) {
+   switch(type) {
+      case QPU_PROG_FS: return "fragment";
+      case QPU_PROG_VS: return "vertex";
+      case QPU_PROG_CS: return "coordinate";
+      default:          return "unknown";
+   }
+}
+
+int for_each_qpu_prog(uint32_t cl_start, uint32_t cl_end, int per_uniforms, qpu_prog_fn fn, void* ctx) {
+   qpu_prog_list_t list;
+   uint32_t        i;
+   int             ret;
+
+   memset(&list, 0, sizeof(list));
+   list.per_uniforms = per_uniforms;
+
+   ret = walk_cl(cl_start, cl_end, qpu_prog_walk_fn, &list);
+
+   for(i = 0;i < list.num_progs && !ret; ++i) {
+      qpu_prog_t* prog = &list.progs[i];
+      uint32_t    mapped_size;
+
+      prog->insts = map_qpu_prog(prog->addr, 0, &prog->num_insts, &mapped_size);
+      if(!prog->insts) {
+         ret = 1;
+         break;
+      }
+
+      ret = fn(ctx, prog);
+
+      unmap_area(prog->insts, mapped_size);
+      prog->insts = 0;
+   }
+
+   free(list.progs);
+
+   return ret;
+}
@@ -0,0 +1,418 @@
+/*
+ * cl_draws.c - Per-draw state tracking for binning CLs
+ *
+ * Walks the CL (following sub-lists and branches) keeping the state that is in
+ * effect and produces a record for every primitive list packet.  The draws
+ * command prints the records and ranks them by an estimate of the QPU cycles
+ * they cost from the static length of their shaders.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "v3d_cl_instr_autogen.h"
+#include "cl_dump.h"
+#include "cl_draws.h"
+
+//QPUs shade 16 vertices or fragments at a time
+#define QPU_BATCH_SIZE 16
+
+typedef struct {
+   cl_draw_t  cur;
+   uint32_t   cur_addr;
+   uint32_t   num_draws;
+   cl_draw_fn fn;
+   void*      ctx;
+} draw_walk_t;
+
+static const char* prim_mode_names[] = {
+   "points", "lines", "line_loop", "line_strip", "triangles", "triangle_strip", "triangle_fan"
+};
+
+const char* prim_mode_name(uint32_t prim_mode) {
+   if(prim_mode < sizeof(prim_mode_names) / sizeof(prim_mode_names[0]))
+      return prim_mode_names[prim_mode];
+
+   return "unknown";
+}
+
+uint32_t prim_count(uint32_t prim_mode, uint32_t length) {
+   switch(prim_mode) {
+      case 0: return length;                      //points
+      case 1: return length / 2;                  //lines
+      case 2: return length > 1 ? length : 0;     //line loop
+      case 3: return length > 1 ? length - 1 : 0; //line strip
+      case 4: return length / 3;                  //triangles
+      case 5:                                     //triangle strip
+      case 6: return length > 2 ? length - 2 : 0; //triangle fan
+      default: return 0;
+   }
+}
+
+static int draw_GL_SHADER(void* ctx, instr_GL_SHADER_t* ins, uint8_t num_attr_arrays, uint8_t extended_record,
+   uint32_t shader_record_addr) {
+   draw_walk_t* walk = ctx;
+   uint32_t     rec_size;
+   void*        rec;
+
+   shader_record_addr <<= 4;
+
+   num_attr_arrays = gl_shader_attr_arrays(num_attr_arrays);
+   rec_size        = gl_shader_rec_size(num_attr_arrays);
+
+   rec = map_area(shader_record_addr, rec_size);
+   if(!rec) {
+      fprintf(stderr, "Failed to map shader record at %08x\n", shader_record_addr);
+      return 1;
+   }
+
+   walk->cur.shader_rec_addr = shader_record_addr;
+   walk->cur.num_attr_arrays = num_attr_arrays;
+   memcpy(&walk->cur.shader_rec, rec, sizeof(instr_SHADER_RECORD_t));
+   memcpy(walk->cur.attr_arrays, rec + sizeof(instr_SHADER_RECORD_t),
+      sizeof(instr_ATTR_ARRAY_RECORD_t) * num_attr_arrays);
+
+   unmap_area(rec, rec_size);
+
+   return 0;
+}
+
+static int draw_STATE_CFG(void* ctx, instr_STATE_CFG_t* ins, uint8_t enable_forward_face, uint8_t enable_rear_face,
+   uint8_t clockwise_prims, uint8_t enable_depth_offset, uint8_t aa_lines, uint8_t cov_read_type,
+   uint8_t rast_oversample_mode, uint8_t cov_pipe_select, uint8_t cov_update_mode, uint8_t cov_read_mode,
+   uint8_t depth_test_func, uint8_t z_update_enable, uint8_t early_z_enable, uint8_t early_z_update_enable,
+   uint8_t UNUSED) {
+   draw_walk_t* walk = ctx;
+
+   walk->cur.cfg_addr = walk->cur_addr;
+   walk->cur.cfg      = *ins;
+
+   return 0;
+}
+
+static int draw_STATE_CLIP_WINDOW(void* ctx, instr_STATE_CLIP_WINDOW_t* ins, uint16_t left, uint16_t bottom,
+   uint16_t width, uint16_t height) {
+   draw_walk_t* walk = ctx;
+
+   walk->cur.clip_addr = walk->cur_addr;
+   walk->cur.clip      = *ins;
+
+   return 0;
+}
+
+static int draw_STATE_TILE_BINNING_MODE(void* ctx, instr_STATE_TILE_BINNING_MODE_t* ins, uint32_t tile_mem_addr,
+   uint32_t tile_mem_size, uint32_t tile_state_addr, uint8_t w_in_tiles, uint8_t h_in_tiles, uint8_t multisample,
+   uint8_t colour_64, uint8_t auto_init_tile_state, uint8_t tile_initial_block_size, uint8_t tile_block_size,
+   uint8_t double_buffer) {
+   draw_walk_t* walk = ctx;
+
+   walk->cur.binning_addr = walk->cur_addr;
+   walk->cur.binning      = *ins;
+
+   return 0;
+}
+
+static int emit_draw(draw_walk_t* walk) {
+   walk->cur.index     = walk->num_draws++;
+   walk->cur.addr      = walk->cur_addr;
+   walk->cur.num_prims = prim_count(walk->cur.prim_mode, walk->cur.length);
+
+   return walk->fn(walk->ctx, &walk->cur);
+}
+
+static int draw_VERTEX_PRIM_LIST(void* ctx, instr_VERTEX_PRIM_LIST_t* ins, uint8_t prim_mode, uint32_t length,
+   uint32_t vertices_addr) {
+   draw_walk_t* walk = ctx;
+
+   walk->cur.opcode       = V3D_HW_INSTR_VERTEX_PRIM_LIST;
+   walk->cur.prim_mode    = prim_mode;
+   walk->cur.length       = length;
+   walk->cur.first_vertex = vertices_addr;
+   walk->cur.index_type   = 0;
+   walk->cur.indices_addr = 0;
+   walk->cur.max_index    = 0;
+
+   return emit_draw(walk);
+}
+
+static int draw_INDEXED_PRIM_LIST(void* ctx, instr_INDEXED_PRIM_LIST_t* ins, uint8_t prim_mode, uint8_t index_type,
+   uint32_t length, uint32_t indices_addr, uint32_t maximum_index) {
+   draw_walk_t* walk = ctx;
+
+   walk->cur.opcode       = V3D_HW_INSTR_INDEXED_PRIM_LIST;
+   walk->cur.prim_mode    = prim_mode;
+   walk->cur.length       = length;
+   walk->cur.first_vertex = 0;
+   walk->cur.index_type   = index_type;
+   walk->cur.indices_addr = indices_addr;
+   walk->cur.max_index    = maximum_index;
+
+   return emit_draw(walk);
+}
+
+static const v3d_cl_visitor_t draw_visitor = {
+   .visit_GL_SHADER               = draw_GL_SHADER,
+   .visit_STATE_CFG               = draw_STATE_CFG,
+   .visit_STATE_CLIP_WINDOW       = draw_STATE_CLIP_WINDOW,
+   .visit_STATE_TILE_BINNING_MODE = draw_STATE_TILE_BINNING_MODE,
+   .visit_VERTEX_PRIM_LIST        = draw_VERTEX_PRIM_LIST,
+   .visit_INDEXED_PRIM_LIST       = draw_INDEXED_PRIM_LIST
+};
+
+static int draw_walk_fn(void* ctx, void* ins, uint32_t addr) {
+   draw_walk_t* walk = ctx;
+
+   walk->cur_addr = addr;
+
+   return visit_instr(&draw_visitor, walk, ins);
+}
+
+int walk_draws(uint32_t cl_start, uint32_t cl_end, cl_draw_fn fn, void* ctx) {
+   draw_walk_t* walk;
+   int          ret;
+
+   walk = calloc(1, sizeof(draw_walk_t));
+   if(!walk) {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+   }
+
+   walk->fn  = fn;
+   walk->ctx = ctx;
+
+   ret = walk_cl(cl_start, cl_end, draw_walk_fn, walk);
+
+   free(walk);
+
+   return ret;
+}
+
+//draws command
+
+typedef struct {
+   uint32_t addr;
+   uint32_t num_insts; //0 if the program couldn't be mapped
+} prog_len_t;
+
+typedef struct {
+   uint32_t index;
+   uint32_t addr;
+   uint32_t num_prims;
+   uint32_t num_verts;
+   uint32_t vs_insts;
+   uint32_t fs_insts;
+   uint64_t vertex_cycles;
+   uint64_t fragment_cycles;
+} draw_cost_t;
+
+typedef struct {
+   prog_len_t*  progs;
+   uint32_t     num_progs;
+   uint32_t     max_progs;
+
+   draw_cost_t* costs;
+   uint32_t     num_costs;
+   uint32_t     max_costs;
+} draws_state_t;
+
+static uint32_t prog_length(draws_state_t* ds, uint32_t addr) {
+   prog_len_t* prog;
+   void*       insts;
+   uint32_t    mapped_size;
+   uint32_t    i;
+
+   if(addr == 0)
+      return 0;
+
+   for(i = 0;i < ds->num_progs; ++i) {
+      if(ds->progs[i].addr == addr)
+         return ds->progs[i].num_insts;
+   }
+
+   if(ds->num_progs == ds->max_progs) {
+      ds->max_progs = ds->max_progs ? ds->max_progs * 2 : 16;
+      ds->progs = realloc(ds->progs, ds->max_progs * sizeof(prog_len_t));
+      assert(ds->progs);
+   }
+
+   prog = &ds->progs[ds->num_progs++];
+   prog->addr      = addr;
+   prog->num_insts = 0;
+
+   insts = map_qpu_prog(addr, 0, &prog->num_insts, &mapped_size);
+   if(insts)
+      unmap_area(insts, mapped_size);
+
+   return prog->num_insts;
+}
+
+//Vertices shaded, for indexed draws every index up to the maximum is assumed
+//to be used once
+static uint32_t draw_vertices(cl_draw_t* draw) {
+   if(draw->opcode == V3D_HW_INSTR_INDEXED_PRIM_LIST)
+      return draw->max_index + 1 < draw->length ? draw->max_index + 1 : draw->length;
+
+   return draw->length;
+}
+
+static void print_draw(cl_draw_t* draw, draws_state_t* ds) {
+   instr_SHADER_RECORD_t* rec = &draw->shader_rec;
+
+   printf("Draw %u at %08x: %s %s, %u %s, %u primitives\n", draw->index, draw->addr,
+      v3d_instr_name(draw->opcode), prim_mode_name(draw->prim_mode), draw->length,
+      draw->opcode == V3D_HW_INSTR_INDEXED_PRIM_LIST ? "indices" : "vertices", draw->num_prims);
+
+   if(draw->opcode == V3D_HW_INSTR_INDEXED_PRIM_LIST) {
+      printf("\tindices: %08x (%s), maximum index %u\n", draw->indices_addr,
+         draw->index_type ? "16 bit" : "8 bit", draw->max_index);
+   }
+
+   if(draw->shader_rec_addr) {
+      printf("\tshader record: %08x, %u attribute arrays\n", draw->shader_rec_addr, draw->num_attr_arrays);
+      printf("\tfs: %08x (%u instructions), %u uniforms at %08x\n", rec->fs_code_addr,
+         prog_length(ds, rec->fs_code_addr), rec->fs_num_uniforms, rec->fs_uniforms_addr);
+      printf("\tvs: %08x (%u instructions), %u uniforms at %08x\n", rec->vs_code_addr,
+         prog_length(ds, rec->vs_code_addr), rec->vs_num_uniforms, rec->vs_uniforms_addr);
+      printf("\tcs: %08x (%u instructions), %u uniforms at %08x\n", rec->cs_code_addr,
+         prog_length(ds, rec->cs_code_addr), rec->cs_num_uniforms, rec->cs_uniforms_addr);
+   } else {
+      printf("\tshader record: none\n");
+   }
+
+   if(draw->cfg_addr) {
+      printf("\tcfg (%08x): forward_face %u rear_face %u clockwise %u depth_offset %u depth_test_func %u "
+         "z_update %u early_z %u\n", draw->cfg_addr, draw->cfg.enable_forward_face, draw->cfg.enable_rear_face,
+         draw->cfg.clockwise_prims, draw->cfg.enable_depth_offset, draw->cfg.depth_test_func,
+         draw->cfg.z_update_enable, draw->cfg.early_z_enable);
+   } else {
+      printf("\tcfg: not set\n");
+   }
+
+   if(draw->clip_addr) {
+      printf("\tclip window (%08x): %u,%u %ux%u\n", draw->clip_addr, draw->clip.left, draw->clip.bottom,
+         draw->clip.width, draw->clip.height);
+   } else {
+      printf("\tclip window: not set\n");
+   }
+}
+
+static int draws_fn(void* ctx, cl_draw_t* draw) {
+   draws_state_t* ds = ctx;
+   draw_cost_t*   cost;
+   uint32_t       vs_insts = 0;
+   uint32_t       cs_insts = 0;
+   uint32_t       num_verts;
+   uint64_t       clip_area;
+
+   print_draw(draw, ds);
+
+   if(ds->num_costs == ds->max_costs) {
+      ds->max_costs = ds->max_costs ? ds->max_costs * 2 : 64;
+      ds->costs = realloc(ds->costs, ds->max_costs * sizeof(draw_cost_t));
+      assert(ds->costs);
+   }
+
+   cost = &ds->costs[ds->num_costs++];
+   memset(cost, 0, sizeof(draw_cost_t));
+
+   num_verts = draw_vertices(draw);
+
+   cost->index     = draw->index;
+   cost->addr      = draw->addr;
+   cost->num_prims = draw->num_prims;
+   cost->num_verts = num_verts;
+
+   if(draw->shader_rec_addr) {
+      vs_insts       = prog_length(ds, draw->shader_rec.vs_code_addr);
+      cs_insts       = prog_length(ds, draw->shader_rec.cs_code_addr);
+      cost->fs_insts = prog_length(ds, draw->shader_rec.fs_code_addr);
+   }
+
+   cost->vs_insts = vs_insts + cs_insts;
+
+   //Coordinate shaders run during binning and vertex shaders during rendering,
+   //both over every vertex
+   cost->vertex_cycles = (uint64_t)(vs_insts + cs_insts) *
+      ((num_verts + QPU_BATCH_SIZE - 1) / QPU_BATCH_SIZE) * QPU_CYCLES_PER_INSTR;
+
+   //Fragment count isn't known without rasterising, the clip window with no
+   //overdraw gives an upper bound for a draw covering it
+   clip_area = draw->clip_addr ? (uint64_t)draw->clip.width * draw->clip.height : 0;
+   if(draw->num_prims == 0)
+      clip_area = 0;
+
+   cost->fragment_cycles = (uint64_t)cost->fs_insts *
+      ((clip_area + QPU_BATCH_SIZE - 1) / QPU_BATCH_SIZE) * QPU_CYCLES_PER_INSTR;
+
+   printf("\testimated cycles: %llu vertex, %llu fragment (clip window bound)\n\n",
+      (unsigned long long)cost->vertex_cycles, (unsigned long long)cost->fragment_cycles);
+
+   return 0;
+}
+
+static int cmp_draw_cost(const void* a, const void* b) {
+   const draw_cost_t* ca = a;
+   const draw_cost_t* cb = b;
+   uint64_t total_a = ca->vertex_cycles + ca->fragment_cycles;
+   uint64_t total_b = cb->vertex_cycles + cb->fragment_cycles;
+
+   if(total_a != total_b)
+      return total_a < total_b ? 1 : -1;
+
+   return ca->index < cb->index ? -1 : ca->index > cb->index;
+}
+
+static void print_ranked(draws_state_t* ds) {
+   uint64_t total = 0;
+   uint32_t i;
+
+   for(i = 0;i < ds->num_costs; ++i) {
+      total += ds->costs[i].vertex_cycles + ds->costs[i].fragment_cycles;
+   }
+
+   qsort(ds->costs, ds->num_costs, sizeof(draw_cost_t), cmp_draw_cost);
+
+   printf("Draws ranked by estimated QPU cycles\n");
+   printf("------------------------------------\n");
+   printf("%4s %5s %8s %8s %8s %8s %8s %12s %12s %12s %6s\n", "rank", "draw", "addr", "prims", "verts",
+      "vs+cs", "fs", "vertex", "fragment", "total", "share");
+
+   for(i = 0;i < ds->num_costs; ++i) {
+      draw_cost_t* cost = &ds->costs[i];
+      uint64_t     draw_total = cost->vertex_cycles + cost->fragment_cycles;
+
+      printf("%4u %5u %08x %8u %8u %8u %8u %12llu %12llu %12llu %5.1f%%\n", i + 1, cost->index, cost->addr,
+         cost->num_prims, cost->num_verts, cost->vs_insts, cost->fs_insts,
+         (unsigned long long)cost->vertex_cycles, (unsigned long long)cost->fragment_cycles,
+         (unsigned long long)draw_total, total ? 100.0 * draw_total / total : 0.0);
+   }
+
+   printf("%u draws, %llu estimated QPU cycles\n", ds->num_costs, (unsigned long long)total);
+}
+
+int do_draws(char* start_addr_str, char* end_addr_str) {
+   draws_state_t ds;
+   uint32_t start_addr;
+   uint32_t end_addr;
+   int      ret;
+
+   if(parse_cl_range(start_addr_str, end_addr_str, &start_addr, &end_addr))
+      return 1;
+
+   memset(&ds, 0, sizeof(ds));
+
+   printf("Draws in CL start: %08x end: %08x\n", start_addr, end_addr);
+   printf("---------------------------------------\n");
+
+   ret = walk_draws(start_addr, end_addr, draws_fn, &ds);
+
+   print_ranked(&ds);
+
+   free(ds.progs);
+   free(ds.costs);
+
+   return ret;
+}
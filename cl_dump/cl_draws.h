@@ -0,0 +1,48 @@
+#ifndef __CL_DRAWS_H__
+#define __CL_DRAWS_H__
+
+#include <stdint.h>
+
+#include "v3d_cl_instr_autogen.h"
+
+//Attribute arrays a GL shader record can have
+#define MAX_ATTR_ARRAYS 8
+
+//The state in effect for one VERTEX_PRIM_LIST or INDEXED_PRIM_LIST.  The
+//*_addr fields give where each piece of state was set, 0 if it never was.
+typedef struct {
+   uint32_t index;
+   uint32_t addr;
+   uint8_t  opcode;
+
+   uint32_t prim_mode;
+   uint32_t length;        //Vertices or indices
+   uint32_t num_prims;
+   uint32_t index_type;    //INDEXED_PRIM_LIST only
+   uint32_t indices_addr;  //INDEXED_PRIM_LIST only
+   uint32_t max_index;     //INDEXED_PRIM_LIST only
+   uint32_t first_vertex;  //VERTEX_PRIM_LIST only
+
+   uint32_t                  shader_rec_addr;
+   uint32_t                  num_attr_arrays;
+   instr_SHADER_RECORD_t     shader_rec;
+   instr_ATTR_ARRAY_RECORD_t attr_arrays[MAX_ATTR_ARRAYS];
+
+   uint32_t          cfg_addr;
+   instr_STATE_CFG_t cfg;
+
+   uint32_t                  clip_addr;
+   instr_STATE_CLIP_WINDOW_t clip;
+
+   uint32_t                      binning_addr;
+   instr_STATE_TILE_BINNING_MODE_t binning;
+} cl_draw_t;
+
+//Called for each draw in CL order, returning non-zero stops the walk
+typedef int (*cl_draw_fn)(void* ctx, cl_draw_t* draw);
+
+int walk_draws(uint32_t cl_start, uint32_t cl_end, cl_draw_fn fn, void* ctx);
+uint32_t prim_count(uint32_t prim_mode, uint32_t length);
+const char* prim_mode_name(uint32_t prim_mode);
+
+#endif
@@ -5,7 +5,10 @@
  * Written by Greg Chadwick (mail@gregchadwick.co.uk)
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -15,11 +18,37 @@
 #include <string.h>
 
 #include "cl_dump.h"
+#include "cl_stats.h"
 
 static FILE* fd_mem;
 static uint32_t mem_offset;
-
-static int startup(char* mem_file, uint32_t base) {
+static int mem_prot;
+static off_t mem_file_size; //0 for /dev/mem
+//Read only dump files are mapped whole, map_area hands out pointers into this
+//rather than making a mapping per call
+static void* mem_window;
+
+//Sources batch entries select between, kept open (and mapped) so entries
+//sharing a source don't reopen it
+#define MAX_SOURCES 16
+
+typedef struct {
+   char*    path; //0 for /dev/mem
+   uint32_t base;
+   FILE*    fd;
+   off_t    size;
+   void*    window;
+   uint32_t last_used;
+} mem_source_t;
+
+static mem_source_t sources[MAX_SOURCES];
+static uint32_t num_sources;
+static uint32_t source_clock;
+static mem_source_t* cur_source; //Last one select_source selected
+
+//writable is needed when poking registers (e.g. the performance counters)
+//rather than just reading memory
+static int startup(char* mem_file, uint32_t base, int writable) {
    if(!mem_file) {
       mem_offset = 0;
       mem_file = "/dev/mem";
@@ -27,7 +56,8 @@ static int startup(char* mem_file, uint32_t base) {
       mem_offset = base;
    }
    
-   fd_mem = fopen(mem_file, "r");
+   fd_mem = fopen(mem_file, writable ? "r+" : "r");
+   mem_prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
 
    mem_offset = base;
 
@@ -36,6 +66,107 @@ static int startup(char* mem_file, uint32_t base) {
       return 1;
    }
 
+   mem_file_size = 0;
+   mem_window = 0;
+   if(strcmp(mem_file, "/dev/mem") != 0) {
+      struct stat st;
+
+      if(fstat(fileno(fd_mem), &st) == 0)
+         mem_file_size = st.st_size;
+   }
+
+   //Falls back to mapping per call if the address space can't take it
+   if(mem_file_size && !writable && (uint64_t)mem_file_size <= 0xffffffffu) {
+      mem_window = mmap(0, mem_file_size, PROT_READ, MAP_SHARED, fileno(fd_mem), 0);
+      if(mem_window == MAP_FAILED)
+         mem_window = 0;
+   }
+
+   //Programs in /dev/mem change from frame to frame, so their lengths can't be kept
+   reset_qpu_prog_cache(mem_file_size != 0);
+
+   return 0;
+}
+
+static int same_source(mem_source_t* source, char* mem_file, uint32_t base) {
+   if(!source->path || !mem_file)
+      return !source->path && !mem_file;
+
+   return strcmp(source->path, mem_file) == 0 && source->base == base;
+}
+
+static void use_source(mem_source_t* source) {
+   fd_mem        = source->fd;
+   mem_offset    = source->base;
+   mem_prot      = PROT_READ;
+   mem_file_size = source->size;
+   mem_window    = source->window;
+}
+
+//Makes the dump file (or /dev/mem when mem_file is 0) the one map_area reads,
+//opening it unless it's already open
+int select_source(char* mem_file, uint32_t base) {
+   mem_source_t* source = 0;
+   uint32_t      i;
+
+   for(i = 0;i < num_sources; ++i) {
+      if(same_source(&sources[i], mem_file, base)) {
+         source = &sources[i];
+         break;
+      }
+   }
+
+   if(!source) {
+      if(num_sources < MAX_SOURCES) {
+         source = &sources[num_sources++];
+      } else {
+         source = &sources[0];
+         for(i = 1;i < MAX_SOURCES; ++i) {
+            if(sources[i].last_used < source->last_used)
+               source = &sources[i];
+         }
+
+         fclose(source->fd);
+         if(source->window)
+            munmap(source->window, source->size);
+         free(source->path);
+
+         if(source == cur_source)
+            cur_source = 0;
+      }
+
+      memset(source, 0, sizeof(mem_source_t));
+
+      //Fill the slot from the end of the table if the source won't open, and
+      //go back to the previous source which startup has replaced
+      if(startup(mem_file, mem_file ? base : 0, 0)) {
+         *source = sources[--num_sources];
+         if(cur_source == &sources[num_sources])
+            cur_source = source;
+
+         if(cur_source) {
+            use_source(cur_source);
+            reset_qpu_prog_cache(cur_source->path != 0);
+         }
+
+         return 1;
+      }
+
+      source->path   = mem_file ? strdup(mem_file) : 0;
+      source->base   = mem_offset;
+      source->fd     = fd_mem;
+      source->size   = mem_file_size;
+      source->window = mem_window;
+   }
+
+   //Program lengths found in one source don't hold in another
+   if(source != cur_source)
+      reset_qpu_prog_cache(source->path != 0);
+
+   use_source(source);
+   cur_source        = source;
+   source->last_used = ++source_clock;
+
    return 0;
 }
 
@@ -52,27 +183,69 @@ void* map_area(uint32_t addr, uint32_t size) {
    printf("Mapping area: %08x of size %d bytes, page addr: %08x modified size: %d\n", addr, size, page_addr, size + page_offset);
 #endif
 
-   va = mmap(0, size + page_offset, PROT_READ, MAP_SHARED, fileno(fd_mem), page_addr - mem_offset);
-   if(va == -1) {
+   //Touching a mapping past the end of a dump file raises SIGBUS rather than
+   //failing the mmap, so catch references outside the dump here
+   if(mem_file_size && (addr < mem_offset || addr - mem_offset >= mem_file_size)) {
+      fprintf(stderr, "Area %08x is outside of the dump file\n", addr);
+      return 0;
+   }
+
+   if(mem_file_size && (uint64_t)(addr - mem_offset) + size > (uint64_t)mem_file_size) {
+      fprintf(stderr, "Area %08x of size %u runs past the end of the dump file\n", addr, size);
+      return 0;
+   }
+
+   if(mem_window && (uint64_t)(addr - mem_offset) + size <= (uint64_t)mem_file_size) {
+      STATS_COUNT(STATS_WINDOW_MAPS, 1);
+      return mem_window + (addr - mem_offset);
+   }
+
+   STATS_BEGIN(STATS_MAP);
+   va = mmap(0, size + page_offset, mem_prot, MAP_SHARED, fileno(fd_mem), page_addr - mem_offset);
+   STATS_END(STATS_MAP);
+   STATS_COUNT(STATS_MMAPS, 1);
+   if(va == MAP_FAILED) {
       fprintf(stderr, "Mapping of V3D physical memory to virtual failed!\nReported: %s\n", strerror(errno));
       return 0;
    }
 
+   STATS_COUNT(STATS_BYTES_MAPPED, size + page_offset);
+
    return va + page_offset;
 }
 
+//Shrinks [*start, *end) to the part backed by the dump file, returns non-zero
+//if nothing is left.  /dev/mem ranges are left alone.
+int clip_to_mem(uint32_t* start, uint32_t* end) {
+   if(!mem_file_size)
+      return 0;
+
+   if(*start < mem_offset)
+      *start = mem_offset;
+   if((off_t)(*end - mem_offset) > mem_file_size || *end < mem_offset)
+      *end = mem_offset + mem_file_size;
+
+   return *end <= *start;
+}
+
 void unmap_area(void* addr, uint32_t size) {
    uint32_t page_offset;
    void*    page_addr;
 
-   page_addr = (void*)((intptr_t)addr & 0xFFFFF000);
+   if(mem_window && addr >= mem_window && addr < mem_window + mem_file_size)
+      return;
+
+   page_addr = (void*)((intptr_t)addr & ~(intptr_t)0xFFF);
    page_offset = addr - page_addr;
 
 #ifdef CL_DUMP_DEBUG
    printf("Unmapping area: %p of size %d bytes, page addr: %p modified size: %d\n", addr, size, page_addr, size + page_offset);
 #endif
 
+   STATS_BEGIN(STATS_UNMAP);
    munmap(page_addr, size + page_offset);
+   STATS_END(STATS_UNMAP);
+   STATS_COUNT(STATS_MUNMAPS, 1);
 }
 
 int do_dump(char* out_filename, char* addr_str, char* size_str) {
@@ -126,22 +299,91 @@ void print_usage(char* argv0) {
    printf("Usage %s cmd\n"
    "cmd one of:\n"
    "\tdump phys_addr size out_file - Dumps raw memory to out_file\n"
-   "\tdis cl_start cl_end [--file dump_file mem_base] - Disassembles CL bytes betweeen given addresses\n", argv0);
+   "\tdis cl_start cl_end [--file dump_file mem_base] - Disassembles CL bytes betweeen given addresses\n"
+   "\tcounters interval_ms num_samples [--counters src,src,...] [--format csv|jsonl] [--frame] [--regs regs_base] [--file regs_file regs_base]\n"
+   "\t\t- Samples V3D performance counter deltas every interval_ms (or every rendered frame with --frame),\n"
+   "\t\t  num_samples of 0 samples until interrupted\n"
+   "\tredundant cl_start cl_end [--file dump_file mem_base] - Reports state packets that don't change state\n"
+   "\tpairs cl_start cl_end [--file dump_file mem_base] - Reports QPU instructions that could be dual-issued and\n"
+   "\t\tnops that could be filled in the shaders used by the CL\n"
+   "\tdraws cl_start cl_end [--file dump_file mem_base] - Lists the state of every draw in a binning CL ranked by\n"
+   "\t\testimated QPU cost\n"
+   "\tsim cl_start cl_end [--max-insts n] [--file dump_file mem_base] - Simulates the shaders used by the CL with\n"
+   "\t\ttheir uniforms, reporting executed instruction counts, branch divergence and hot instructions\n"
+   "\tfootprint cl_start cl_end [rcl_start rcl_end] [--format json|dot] [--file dump_file mem_base]\n"
+   "\t\t- Graphs the buffers referenced by a binning CL (and render CL) with bytes per category\n"
+   "\ttextures cl_start cl_end [--file dump_file mem_base] - Decodes the texture config in the uniform streams of\n"
+   "\t\tevery draw, reporting the texture memory each touches and the bytes per texel fetch\n"
+   "\tcfg cl_start cl_end [--format text|dot] [--loop-iters n] [--file dump_file mem_base]\n"
+   "\t\t- Builds the control flow graphs of the CL's shaders with per-block cycles, loops and the longest path\n"
+   "\thazards cl_start cl_end [--file dump_file mem_base] - Reports pipeline hazards in the CL's shaders and the\n"
+   "\t\tstall cycles they cost\n"
+   "\tscan start end [--threads n] [--top n] [--min-packets n] [--file dump_file mem_base]\n"
+   "\t\t- Searches memory for control lists and QPU programs, ranked by confidence\n"
+   "\tbatch manifest [--jobs n] - Runs each line of manifest (command start end source output [options]), source\n"
+   "\t\tis dump_file:mem_base or - for /dev/mem, output a file or - for stdout, then summarises timings\n"
+   "\tserve socket_path [--file dump_file mem_base] - Serves requests for the commands above (except dump,\n"
+   "\t\tcounters and batch) over a UNIX socket, see cl_serve.c for the protocol\n"
+#ifdef CL_DUMP_STATS
+   "any cmd also takes [--stats] [--stats-trace trace_file] - Prints where the time went to stderr at exit,\n"
+   "\toptionally writing a Chrome trace event timeline to trace_file\n"
+#endif
+   , argv0);
+}
+
+//Removes --file dump_file mem_base from the arguments if present
+static int parse_file_opt(int* argc, char* argv[], char** mem_file, uint32_t* mem_base) {
+   int i;
+
+   for(i = 2;i < *argc; ++i) {
+      if(strcmp(argv[i], "--file") == 0) {
+         if(i + 2 >= *argc) {
+            fprintf(stderr, "--file needs dump_file and mem_base\n");
+            return 1;
+         }
+
+         *mem_file = argv[i + 1];
+         if(sscanf(argv[i + 2], "0x%x", mem_base) != 1) {
+            fprintf(stderr, "mem_base must be of the form 0x1234abcd\n");
+            return 1;
+         }
+
+         memmove(&argv[i], &argv[i + 3], (*argc - i - 3) * sizeof(char*));
+         *argc -= 3;
+
+         return 0;
+      }
+   }
+
+   return 0;
 }
 
 int main(int argc, char* argv[]) {
-   if(argc > 7 || argc < 4) {
+   char*    mem_file = 0;
+   uint32_t mem_base = 0;
+
+   if(argc < 2) {
+      print_usage(argv[0]);
+      return 1;
+   }
+
+   if(parse_file_opt(&argc, argv, &mem_file, &mem_base)) {
       print_usage(argv[0]);
       return 1;
    }
 
+#ifdef CL_DUMP_STATS
+   if(parse_stats_opt(&argc, argv))
+      return 1;
+#endif
+
    if(strcmp(argv[1], "dump") == 0) {
-      if(argc != 5) {
+      if(argc != 5 || mem_file) {
          print_usage(argv[0]);
          return 1;
       }
 
-      if(startup(0, 0))
+      if(startup(0, 0, 0))
          return 1;
 
       if(do_dump(argv[4], argv[2], argv[3]))
@@ -149,31 +391,171 @@ int main(int argc, char* argv[]) {
 
       return 0;
    } else if(strcmp(argv[1], "dis") == 0) {
-      char*    mem_file = 0;
-      uint32_t mem_offset;
-
-      if(argc == 7) {
-         if(strcmp(argv[4], "--file") == 0) {
-            mem_file = argv[5];
-            if(sscanf(argv[6], "0x%x", &mem_offset) != 1) {
-               fprintf(stderr, "mem_base must be of the form 0x1234abcd\n");
-               return 1;
-            }
-         } else {
-            print_usage(argv[0]);
-            return 1;
-         }
-      } else if(argc != 4) {
+      if(argc != 4) {
          print_usage(argv[0]);
          return 1;
       }
 
-      if(startup(mem_file, mem_offset))
+      if(startup(mem_file, mem_base, 0))
          return 1;
 
       if(do_dis(argv[2], argv[3]))
          return 1;
 
+      return 0;
+   } else if(strcmp(argv[1], "counters") == 0) {
+      if(argc < 4) {
+         print_usage(argv[0]);
+         return 1;
+      }
+
+      if(startup(mem_file, mem_base, 1))
+         return 1;
+
+      if(do_counters(argc - 2, &argv[2]))
+         return 1;
+
+      return 0;
+   } else if(strcmp(argv[1], "redundant") == 0) {
+      if(argc != 4) {
+         print_usage(argv[0]);
+         return 1;
+      }
+
+      if(startup(mem_file, mem_base, 0))
+         return 1;
+
+      if(do_redundant(argv[2], argv[3]))
+         return 1;
+
+      return 0;
+   } else if(strcmp(argv[1], "pairs") == 0) {
+      if(argc != 4) {
+         print_usage(argv[0]);
+         return 1;
+      }
+
+      if(startup(mem_file, mem_base, 0))
+         return 1;
+
+      if(do_pairs(argv[2], argv[3]))
+         return 1;
+
+      return 0;
+   } else if(strcmp(argv[1], "draws") == 0) {
+      if(argc != 4) {
+         print_usage(argv[0]);
+         return 1;
+      }
+
+      if(startup(mem_file, mem_base, 0))
+         return 1;
+
+      if(do_draws(argv[2], argv[3]))
+         return 1;
+
+      return 0;
+   } else if(strcmp(argv[1], "sim") == 0) {
+      if(argc < 4) {
+         print_usage(argv[0]);
+         return 1;
+      }
+
+      if(startup(mem_file, mem_base, 0))
+         return 1;
+
+      if(do_sim(argc - 2, &argv[2]))
+         return 1;
+
+      return 0;
+   } else if(strcmp(argv[1], "footprint") == 0) {
+      if(argc < 4) {
+         print_usage(argv[0]);
+         return 1;
+      }
+
+      if(startup(mem_file, mem_base, 0))
+         return 1;
+
+      if(do_footprint(argc - 2, &argv[2]))
+         return 1;
+
+      return 0;
+   } else if(strcmp(argv[1], "textures") == 0) {
+      if(argc < 4) {
+         print_usage(argv[0]);
+         return 1;
+      }
+
+      if(startup(mem_file, mem_base, 0))
+         return 1;
+
+      if(do_textures(argv[2], argv[3]))
+         return 1;
+
+      return 0;
+   } else if(strcmp(argv[1], "cfg") == 0) {
+      if(argc < 4) {
+         print_usage(argv[0]);
+         return 1;
+      }
+
+      if(startup(mem_file, mem_base, 0))
+         return 1;
+
+      if(do_cfg(argc - 2, &argv[2]))
+         return 1;
+
+      return 0;
+   } else if(strcmp(argv[1], "hazards") == 0) {
+      if(argc < 4) {
+         print_usage(argv[0]);
+         return 1;
+      }
+
+      if(startup(mem_file, mem_base, 0))
+         return 1;
+
+      if(do_hazards(argv[2], argv[3]))
+         return 1;
+
+      return 0;
+   } else if(strcmp(argv[1], "scan") == 0) {
+      if(argc < 4) {
+         print_usage(argv[0]);
+         return 1;
+      }
+
+      if(startup(mem_file, mem_base, 0))
+         return 1;
+
+      if(do_scan(argc - 2, &argv[2]))
+         return 1;
+
+      return 0;
+   } else if(strcmp(argv[1], "batch") == 0) {
+      if(argc < 3) {
+         print_usage(argv[0]);
+         return 1;
+      }
+
+      //Each entry names its own source
+      if(do_batch(argc - 2, &argv[2]))
+         return 1;
+
+      return 0;
+   } else if(strcmp(argv[1], "serve") == 0) {
+      if(argc < 3) {
+         print_usage(argv[0]);
+         return 1;
+      }
+
+      if(select_source(mem_file, mem_base))
+         return 1;
+
+      if(do_serve(argc - 2, &argv[2]))
+         return 1;
+
       return 0;
    } else {
       fprintf(stderr, "Invalid command %s\n", argv[1]);
@@ -182,4 +564,3 @@ int main(int argc, char* argv[]) {
 
    return 0;
 }
-
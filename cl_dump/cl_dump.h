@@ -5,9 +5,85 @@
 
 #include <stdint.h>
 
+//Called for each instruction walk_cl reaches with its address, returning
+//non-zero stops the walk (and is returned by walk_cl).  Returning
+//CL_WALK_NO_FOLLOW for a BRANCH_SUB or BRANCH carries on without following it.
+typedef int (*cl_walk_fn)(void* ctx, void* ins, uint32_t addr);
+
+#define CL_WALK_NO_FOLLOW -1
+
+int parse_cl_range(char* start_addr_str, char* end_addr_str, uint32_t* start_addr, uint32_t* end_addr);
+int walk_cl(uint32_t start_address, uint32_t end_address, cl_walk_fn fn, void* ctx);
+
+#define QPU_PROG_FS 0
+#define QPU_PROG_VS 1
+#define QPU_PROG_CS 2
+
+//A QPU program referenced from a shader record, insts is only mapped for the
+//duration of the qpu_prog_fn call
+typedef struct {
+   uint32_t  type;
+   uint32_t  addr;
+   uint32_t* insts;
+   uint32_t  num_insts;
+   uint32_t  shader_rec_addr; //First shader record seen using the program
+   uint32_t  uniforms_addr;
+   uint32_t  num_uniforms;
+   uint32_t  num_uses;        //Number of shader records referencing it
+} qpu_prog_t;
+
+typedef int (*qpu_prog_fn)(void* ctx, qpu_prog_t* prog);
+
+//A QPU runs its 16 SIMD elements through each instruction 4 at a time
+#define QPU_CYCLES_PER_INSTR 4
+
+//Maps a QPU program, searching for the program end when end_address is 0.
+//Returns 0 on failure, otherwise unmap with unmap_area(prog, *mapped_size).
+void* map_qpu_prog(uint32_t start_address, uint32_t end_address, uint32_t* num_insts, uint32_t* mapped_size);
+//Forgets the program lengths map_qpu_prog found, for when the source changes,
+//only caching new ones if enabled (not for memory that changes underneath)
+void reset_qpu_prog_cache(int enabled);
+const char* qpu_prog_type_name(uint32_t type);
+//Decodes a GL_SHADER packet's num_attr_arrays field, and the size of the
+//shader record it points at
+uint32_t gl_shader_attr_arrays(uint8_t num_attr_arrays);
+uint32_t gl_shader_rec_size(uint8_t num_attr_arrays);
+//Calls fn once for every distinct QPU program used by GL shader records in the
+//CL, distinct by code and uniforms address when per_uniforms is set
+int for_each_qpu_prog(uint32_t cl_start, uint32_t cl_end, int per_uniforms, qpu_prog_fn fn, void* ctx);
+
+int do_dump(char* out_filename, char* addr_str, char* size_str);
 int do_dis(char* start_addr_str, char* end_addr_str);
+int do_counters(int argc, char* argv[]);
+int do_redundant(char* start_addr_str, char* end_addr_str);
+int do_pairs(char* start_addr_str, char* end_addr_str);
+int do_draws(char* start_addr_str, char* end_addr_str);
+int do_sim(int argc, char* argv[]);
+int do_footprint(int argc, char* argv[]);
+int do_scan(int argc, char* argv[]);
+int do_textures(char* start_addr_str, char* end_addr_str);
+int do_cfg(int argc, char* argv[]);
+int do_hazards(char* start_addr_str, char* end_addr_str);
 void* map_area(uint32_t addr, uint32_t size);
 void unmap_area(void* addr, uint32_t size);
+int clip_to_mem(uint32_t* start, uint32_t* end);
+int select_source(char* mem_file, uint32_t base);
+int do_batch(int argc, char* argv[]);
+int do_serve(int argc, char* argv[]);
+
+//Commands that only read memory, which batch and serve run against the
+//selected source.  argv is start, end and then the command's options.
+#define NUM_READ_CMDS 10
+
+//Returns -1 if name isn't a read command
+int find_read_cmd(const char* name);
+const char* read_cmd_name(int cmd);
+int run_read_cmd(int cmd, int argc, char* argv[]);
+//Splits dump_file:0x1234abcd in place, - or /dev/mem give a mem_file of 0
+int parse_source_spec(char* spec, char** mem_file, uint32_t* base);
+//Prints the listing of one QPU program, searching for its end when
+//end_address is 0
+int dis_qpu_prog(uint32_t start_address, uint32_t end_address);
 
 #endif
 
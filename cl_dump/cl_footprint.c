@@ -0,0 +1,593 @@
+/*
+ * cl_footprint.c - Builds the graph of GPU buffers a frame references
+ *
+ * Walks the binning CL (and optionally the render CL) recording every buffer
+ * reached along with what references it: CLs and sub-lists, shader records,
+ * QPU programs, uniform streams, textures (from the config parameters in the
+ * uniform streams), attribute arrays, index buffers, tile memory and state,
+ * and the framebuffer.  Buffers with more than one referrer are
+ * shared, the rest exclusive.  Output is JSON (the graph plus per-category
+ * byte counts) or a DOT graph.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "v3d_cl_instr_autogen.h"
+#include "cl_dump.h"
+#include "cl_draws.h"
+#include "cl_textures.h"
+
+#define FP_CL             0
+#define FP_DRAW           1
+#define FP_SHADER_REC     2
+#define FP_QPU_PROG       3
+#define FP_UNIFORMS       4
+#define FP_ATTR_ARRAY     5
+#define FP_INDEX_BUF      6
+#define FP_TILE_MEM       7
+#define FP_TILE_STATE     8
+#define FP_FRAMEBUFFER    9
+#define FP_TEXTURE        10
+#define FP_NUM_CATEGORIES 11
+
+#define FORMAT_JSON 0
+#define FORMAT_DOT  1
+
+//Tile state data array entry per tile
+#define TILE_STATE_SIZE 48
+
+#define MAX_CL_STACK 16
+
+#define NO_NODE 0xffffffff
+
+static const char* category_names[FP_NUM_CATEGORIES] = {
+   "cl", "draw", "shader_record", "qpu_program", "uniforms", "attribute_array", "index_buffer",
+   "tile_memory", "tile_state", "framebuffer", "texture"
+};
+
+typedef struct {
+   uint32_t category;
+   uint32_t addr;
+   uint32_t size;
+   uint32_t num_parents;
+} fp_node_t;
+
+typedef struct {
+   uint32_t from;
+   uint32_t to;
+} fp_edge_t;
+
+//Open addressing map from a non-zero 64 bit key to an index
+typedef struct {
+   uint64_t* keys;
+   uint32_t* values;
+   uint32_t  size;
+   uint32_t  used;
+} fp_hash_t;
+
+typedef struct {
+   fp_node_t* nodes;
+   uint32_t   num_nodes;
+   uint32_t   max_nodes;
+
+   fp_edge_t* edges;
+   uint32_t   num_edges;
+   uint32_t   max_edges;
+
+   fp_hash_t node_hash;
+   fp_hash_t edge_hash;
+
+   //CL buffers being walked, the top one holds the current instruction
+   uint32_t cl_stack[MAX_CL_STACK];
+   int      cl_depth;
+
+   uint32_t tile_mem_node;
+} footprint_t;
+
+static uint32_t* hash_find(fp_hash_t* hash, uint64_t key, int* found) {
+   uint32_t i;
+
+   if(hash->used * 2 >= hash->size) {
+      fp_hash_t grown;
+
+      grown.size   = hash->size ? hash->size * 2 : 1024;
+      grown.used   = hash->used;
+      grown.keys   = calloc(grown.size, sizeof(uint64_t));
+      grown.values = calloc(grown.size, sizeof(uint32_t));
+      assert(grown.keys && grown.values);
+
+      for(i = 0;i < hash->size; ++i) {
+         uint32_t j;
+
+         if(!hash->keys[i])
+            continue;
+
+         for(j = (hash->keys[i] * 0x9e3779b97f4a7c15ull) >> 32;grown.keys[j & (grown.size - 1)]; ++j);
+
+         grown.keys[j & (grown.size - 1)]   = hash->keys[i];
+         grown.values[j & (grown.size - 1)] = hash->values[i];
+      }
+
+      free(hash->keys);
+      free(hash->values);
+      *hash = grown;
+   }
+
+   key++; //0 marks an empty slot
+
+   for(i = (key * 0x9e3779b97f4a7c15ull) >> 32;; ++i) {
+      uint32_t slot = i & (hash->size - 1);
+
+      if(hash->keys[slot] == key) {
+         *found = 1;
+         return &hash->values[slot];
+      }
+
+      if(!hash->keys[slot]) {
+         hash->keys[slot] = key;
+         hash->used++;
+         *found = 0;
+         return &hash->values[slot];
+      }
+   }
+}
+
+//Returns the node for the buffer, growing it to size if it's bigger.  created
+//(if given) is set when the node is new.
+static uint32_t add_node(footprint_t* fp, uint32_t category, uint32_t addr, uint32_t size, int* created) {
+   fp_node_t* node;
+   uint32_t*  index;
+   int        found;
+
+   index = hash_find(&fp->node_hash, ((uint64_t)category << 32) | addr, &found);
+
+   if(created)
+      *created = !found;
+
+   if(found) {
+      node = &fp->nodes[*index];
+      if(size > node->size)
+         node->size = size;
+
+      return *index;
+   }
+
+   if(fp->num_nodes == fp->max_nodes) {
+      fp->max_nodes = fp->max_nodes ? fp->max_nodes * 2 : 256;
+      fp->nodes = realloc(fp->nodes, fp->max_nodes * sizeof(fp_node_t));
+      assert(fp->nodes);
+   }
+
+   *index = fp->num_nodes;
+
+   node = &fp->nodes[fp->num_nodes++];
+   node->category    = category;
+   node->addr        = addr;
+   node->size        = size;
+   node->num_parents = 0;
+
+   return *index;
+}
+
+static void add_edge(footprint_t* fp, uint32_t from, uint32_t to) {
+   uint32_t* index;
+   int       found;
+
+   if(from == NO_NODE || from == to)
+      return;
+
+   index = hash_find(&fp->edge_hash, ((uint64_t)from << 32) | to, &found);
+   if(found)
+      return;
+
+   if(fp->num_edges == fp->max_edges) {
+      fp->max_edges = fp->max_edges ? fp->max_edges * 2 : 256;
+      fp->edges = realloc(fp->edges, fp->max_edges * sizeof(fp_edge_t));
+      assert(fp->edges);
+   }
+
+   *index = fp->num_edges;
+   fp->edges[fp->num_edges].from = from;
+   fp->edges[fp->num_edges].to   = to;
+   fp->num_edges++;
+
+   fp->nodes[to].num_parents++;
+}
+
+static uint32_t cur_cl(footprint_t* fp) {
+   return fp->cl_depth ? fp->cl_stack[fp->cl_depth - 1] : NO_NODE;
+}
+
+static int in_tile_mem(footprint_t* fp, uint32_t addr) {
+   fp_node_t* tile_mem;
+
+   if(fp->tile_mem_node == NO_NODE)
+      return 0;
+
+   tile_mem = &fp->nodes[fp->tile_mem_node];
+
+   return addr >= tile_mem->addr && addr - tile_mem->addr < tile_mem->size;
+}
+
+static uint32_t framebuffer_size(instr_STATE_TILE_RENDERING_MODE_t* ins) {
+   uint32_t bpp;
+
+   //colour_format 1 is RGBA8888, the others BGR565
+   if(ins->colour_64)
+      bpp = 8;
+   else
+      bpp = ins->colour_format == 1 ? 4 : 2;
+
+   return (uint32_t)ins->width * ins->height * bpp;
+}
+
+static int fp_cl_walk_fn(void* ctx, void* ins, uint32_t addr) {
+   footprint_t* fp = ctx;
+   uint8_t      opcode = *(uint8_t*)ins;
+   uint32_t     cl = cur_cl(fp);
+   uint32_t     node;
+
+   add_node(fp, FP_CL, fp->nodes[cl].addr, addr + v3d_instr_size(opcode) - fp->nodes[cl].addr, 0);
+
+   switch(opcode) {
+      case V3D_HW_INSTR_BRANCH_SUB:
+      case V3D_HW_INSTR_BRANCH: {
+         //Both packets start with the branch address
+         uint32_t target = ((instr_BRANCH_SUB_t*)ins)->branch_addr;
+
+         //Render CLs branch into the tile lists the binner wrote, those are
+         //already counted as tile memory
+         if(in_tile_mem(fp, target)) {
+            add_edge(fp, cl, fp->tile_mem_node);
+            return CL_WALK_NO_FOLLOW;
+         }
+
+         node = add_node(fp, FP_CL, target, 0, 0);
+         add_edge(fp, cl, node);
+
+         if(opcode == V3D_HW_INSTR_BRANCH) {
+            fp->cl_stack[fp->cl_depth - 1] = node;
+         } else if(fp->cl_depth < MAX_CL_STACK) {
+            fp->cl_stack[fp->cl_depth++] = node;
+         } else {
+            fprintf(stderr, "Sub-lists nested too deeply at %08x\n", addr);
+            return 1;
+         }
+         break;
+      }
+      case V3D_HW_INSTR_RETURN:
+         if(fp->cl_depth > 1)
+            fp->cl_depth--;
+         break;
+      case V3D_HW_INSTR_STATE_TILE_BINNING_MODE: {
+         instr_STATE_TILE_BINNING_MODE_t* mode = ins;
+
+         fp->tile_mem_node = add_node(fp, FP_TILE_MEM, mode->tile_mem_addr, mode->tile_mem_size, 0);
+         add_edge(fp, cl, fp->tile_mem_node);
+
+         node = add_node(fp, FP_TILE_STATE, mode->tile_state_addr,
+            (uint32_t)mode->w_in_tiles * mode->h_in_tiles * TILE_STATE_SIZE, 0);
+         add_edge(fp, cl, node);
+         break;
+      }
+      case V3D_HW_INSTR_STATE_TILE_RENDERING_MODE: {
+         instr_STATE_TILE_RENDERING_MODE_t* mode = ins;
+
+         node = add_node(fp, FP_FRAMEBUFFER, mode->framebuffer_address, framebuffer_size(mode), 0);
+         add_edge(fp, cl, node);
+         break;
+      }
+   }
+
+   return 0;
+}
+
+static int walk_cl_buffers(footprint_t* fp, uint32_t start_addr, uint32_t end_addr) {
+   fp->cl_depth    = 1;
+   fp->cl_stack[0] = add_node(fp, FP_CL, start_addr, end_addr > start_addr ? end_addr - start_addr : 0, 0);
+
+   return walk_cl(start_addr, end_addr, fp_cl_walk_fn, fp);
+}
+
+static uint32_t containing_cl(footprint_t* fp, uint32_t addr) {
+   uint32_t i;
+
+   for(i = 0;i < fp->num_nodes; ++i) {
+      fp_node_t* node = &fp->nodes[i];
+
+      if(node->category == FP_CL && addr >= node->addr && addr - node->addr < node->size)
+         return i;
+   }
+
+   return NO_NODE;
+}
+
+static void add_prog(footprint_t* fp, uint32_t rec, uint32_t code_addr, uint32_t uniforms_addr,
+   uint32_t num_uniforms) {
+   qpu_unif_use_t use;
+   uint32_t       node;
+   uint32_t       referrer = rec;
+   uint32_t       i;
+   int            created;
+
+   if(code_addr) {
+      node = add_node(fp, FP_QPU_PROG, code_addr, 0, &created);
+
+      if(created) {
+         uint32_t num_insts;
+         uint32_t mapped_size;
+         void*    insts = map_qpu_prog(code_addr, 0, &num_insts, &mapped_size);
+
+         if(insts) {
+            fp->nodes[node].size = num_insts * 8;
+            unmap_area(insts, mapped_size);
+         }
+      }
+
+      add_edge(fp, rec, node);
+   }
+
+   if(uniforms_addr && num_uniforms) {
+      referrer = add_node(fp, FP_UNIFORMS, uniforms_addr, num_uniforms * 4, 0);
+      add_edge(fp, rec, referrer);
+   }
+
+   if(code_addr && !decode_qpu_uniforms(code_addr, uniforms_addr, num_uniforms, &use)) {
+      for(i = 0;i < use.num_lookups && i < MAX_TEX_LOOKUPS; ++i) {
+         tex_config_t* tex = &use.lookups[i];
+
+         add_edge(fp, referrer, add_node(fp, FP_TEXTURE, tex->base, tex_size(tex), 0));
+      }
+   }
+}
+
+static int fp_draw_fn(void* ctx, cl_draw_t* draw) {
+   footprint_t* fp = ctx;
+   uint32_t     draw_node;
+   uint32_t     num_verts;
+   uint32_t     i;
+
+   //Draws are keyed by index as a sub-list called twice draws twice
+   draw_node = add_node(fp, FP_DRAW, draw->index, 0, 0);
+   fp->nodes[draw_node].addr = draw->addr;
+
+   add_edge(fp, containing_cl(fp, draw->addr), draw_node);
+
+   if(draw->opcode == V3D_HW_INSTR_INDEXED_PRIM_LIST) {
+      num_verts = draw->max_index + 1;
+      add_edge(fp, draw_node, add_node(fp, FP_INDEX_BUF, draw->indices_addr,
+         draw->length * (draw->index_type ? 2 : 1), 0));
+   } else {
+      num_verts = draw->first_vertex + draw->length;
+   }
+
+   if(draw->shader_rec_addr) {
+      instr_SHADER_RECORD_t* rec = &draw->shader_rec;
+      uint32_t rec_node = add_node(fp, FP_SHADER_REC, draw->shader_rec_addr,
+         sizeof(instr_SHADER_RECORD_t) + sizeof(instr_ATTR_ARRAY_RECORD_t) * draw->num_attr_arrays, 0);
+
+      add_edge(fp, draw_node, rec_node);
+
+      add_prog(fp, rec_node, rec->fs_code_addr, rec->fs_uniforms_addr, rec->fs_num_uniforms);
+      add_prog(fp, rec_node, rec->vs_code_addr, rec->vs_uniforms_addr, rec->vs_num_uniforms);
+      add_prog(fp, rec_node, rec->cs_code_addr, rec->cs_uniforms_addr, rec->cs_num_uniforms);
+
+      //array_size_bytes holds the attribute size - 1
+      for(i = 0;i < draw->num_attr_arrays; ++i) {
+         instr_ATTR_ARRAY_RECORD_t* attr = &draw->attr_arrays[i];
+         uint32_t size = num_verts ? attr->array_stride * (num_verts - 1) + attr->array_size_bytes + 1 : 0;
+
+         add_edge(fp, rec_node, add_node(fp, FP_ATTR_ARRAY, attr->array_base_addr, size, 0));
+      }
+   }
+
+   return 0;
+}
+
+typedef struct {
+   uint32_t buffers;
+   uint64_t bytes;
+   uint64_t shared_bytes;
+} fp_totals_t;
+
+static int cmp_node_addr(const void* a, const void* b) {
+   const fp_node_t* na = *(const fp_node_t**)a;
+   const fp_node_t* nb = *(const fp_node_t**)b;
+
+   return na->addr < nb->addr ? -1 : na->addr > nb->addr;
+}
+
+//Bytes covered by all the buffers, counting overlapping ranges once
+static uint64_t union_bytes(footprint_t* fp) {
+   fp_node_t** sorted;
+   uint64_t    total = 0;
+   uint64_t    covered_to = 0;
+   uint32_t    num = 0;
+   uint32_t    i;
+
+   sorted = malloc((fp->num_nodes + 1) * sizeof(fp_node_t*));
+   assert(sorted);
+
+   for(i = 0;i < fp->num_nodes; ++i) {
+      if(fp->nodes[i].category != FP_DRAW)
+         sorted[num++] = &fp->nodes[i];
+   }
+
+   qsort(sorted, num, sizeof(fp_node_t*), cmp_node_addr);
+
+   for(i = 0;i < num; ++i) {
+      uint64_t start = sorted[i]->addr;
+      uint64_t end   = start + sorted[i]->size;
+
+      if(start < covered_to)
+         start = covered_to;
+
+      if(end > start) {
+         total += end - start;
+         covered_to = end;
+      }
+   }
+
+   free(sorted);
+
+   return total;
+}
+
+static void sum_categories(footprint_t* fp, fp_totals_t* totals) {
+   uint32_t i;
+
+   memset(totals, 0, sizeof(fp_totals_t) * FP_NUM_CATEGORIES);
+
+   for(i = 0;i < fp->num_nodes; ++i) {
+      fp_node_t*   node = &fp->nodes[i];
+      fp_totals_t* t = &totals[node->category];
+
+      t->buffers++;
+      t->bytes += node->size;
+      if(node->num_parents > 1)
+         t->shared_bytes += node->size;
+   }
+}
+
+static void print_json(footprint_t* fp) {
+   fp_totals_t totals[FP_NUM_CATEGORIES];
+   uint64_t    bytes = 0;
+   uint64_t    shared_bytes = 0;
+   uint64_t    frame_bytes;
+   uint32_t    i;
+
+   sum_categories(fp, totals);
+   frame_bytes = union_bytes(fp);
+
+   printf("{\n  \"buffers\": [\n");
+   for(i = 0;i < fp->num_nodes; ++i) {
+      fp_node_t* node = &fp->nodes[i];
+
+      printf("    {\"id\": %u, \"category\": \"%s\", \"addr\": \"0x%08x\", \"size\": %u, \"referrers\": %u, "
+         "\"shared\": %s}%s\n", i, category_names[node->category], node->addr, node->size, node->num_parents,
+         node->num_parents > 1 ? "true" : "false", i + 1 < fp->num_nodes ? "," : "");
+   }
+
+   printf("  ],\n  \"references\": [\n");
+   for(i = 0;i < fp->num_edges; ++i) {
+      printf("    {\"from\": %u, \"to\": %u}%s\n", fp->edges[i].from, fp->edges[i].to,
+         i + 1 < fp->num_edges ? "," : "");
+   }
+
+   printf("  ],\n  \"categories\": {");
+   for(i = 0;i < FP_NUM_CATEGORIES; ++i) {
+      fp_totals_t* t = &totals[i];
+
+      //Draws are nodes in the graph but not buffers
+      if(i == FP_DRAW)
+         continue;
+
+      bytes        += t->bytes;
+      shared_bytes += t->shared_bytes;
+
+      printf("%s\n    \"%s\": {\"buffers\": %u, \"bytes\": %llu, \"shared_bytes\": %llu, \"exclusive_bytes\": %llu}",
+         i ? "," : "", category_names[i], t->buffers, (unsigned long long)t->bytes,
+         (unsigned long long)t->shared_bytes, (unsigned long long)(t->bytes - t->shared_bytes));
+   }
+   printf("\n");
+
+   //Buffers can overlap (e.g. attribute arrays interleaved in one buffer), the
+   //frame footprint counts those bytes once
+   printf("  },\n");
+   printf("  \"bytes\": %llu,\n", (unsigned long long)bytes);
+   printf("  \"shared_bytes\": %llu,\n", (unsigned long long)shared_bytes);
+   printf("  \"exclusive_bytes\": %llu,\n", (unsigned long long)(bytes - shared_bytes));
+   printf("  \"frame_bytes\": %llu\n", (unsigned long long)frame_bytes);
+   printf("}\n");
+}
+
+static void print_dot(footprint_t* fp) {
+   uint32_t i;
+
+   printf("digraph footprint {\n");
+   printf("  node [shape=box, fontname=monospace];\n");
+
+   for(i = 0;i < fp->num_nodes; ++i) {
+      fp_node_t* node = &fp->nodes[i];
+
+      if(node->category == FP_DRAW) {
+         printf("  n%u [label=\"draw\\n%08x\", shape=ellipse];\n", i, node->addr);
+      } else {
+         printf("  n%u [label=\"%s\\n%08x\\n%u bytes\"%s];\n", i, category_names[node->category], node->addr,
+            node->size, node->num_parents > 1 ? ", style=filled, fillcolor=lightblue" : "");
+      }
+   }
+
+   for(i = 0;i < fp->num_edges; ++i) {
+      printf("  n%u -> n%u;\n", fp->edges[i].from, fp->edges[i].to);
+   }
+
+   printf("}\n");
+}
+
+int do_footprint(int argc, char* argv[]) {
+   footprint_t fp;
+   uint32_t    start_addr;
+   uint32_t    end_addr;
+   uint32_t    render_start_addr = 0;
+   uint32_t    render_end_addr = 0;
+   int         have_render = 0;
+   int         format = FORMAT_JSON;
+   int         ret;
+   int         i;
+
+   if(argc < 2 || parse_cl_range(argv[0], argv[1], &start_addr, &end_addr))
+      return 1;
+
+   for(i = 2;i < argc; ++i) {
+      if(strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+         ++i;
+         if(strcmp(argv[i], "json") == 0) {
+            format = FORMAT_JSON;
+         } else if(strcmp(argv[i], "dot") == 0) {
+            format = FORMAT_DOT;
+         } else {
+            fprintf(stderr, "Format must be json or dot\n");
+            return 1;
+         }
+      } else if(!have_render && i + 1 < argc && argv[i][0] != '-') {
+         if(parse_cl_range(argv[i], argv[i + 1], &render_start_addr, &render_end_addr))
+            return 1;
+
+         have_render = 1;
+         ++i;
+      } else {
+         fprintf(stderr, "Unknown footprint option %s\n", argv[i]);
+         return 1;
+      }
+   }
+
+   memset(&fp, 0, sizeof(fp));
+   fp.tile_mem_node = NO_NODE;
+
+   ret = walk_cl_buffers(&fp, start_addr, end_addr);
+
+   if(!ret)
+      ret = walk_draws(start_addr, end_addr, fp_draw_fn, &fp);
+
+   if(!ret && have_render)
+      ret = walk_cl_buffers(&fp, render_start_addr, render_end_addr);
+
+   if(format == FORMAT_DOT)
+      print_dot(&fp);
+   else
+      print_json(&fp);
+
+   free(fp.nodes);
+   free(fp.edges);
+   free(fp.node_hash.keys);
+   free(fp.node_hash.values);
+   free(fp.edge_hash.keys);
+   free(fp.edge_hash.values);
+
+   return ret;
+}
@@ -0,0 +1,263 @@
+/*
+ * cl_redundant.c - Finds state packets in a CL that don't change anything
+ *
+ * Tracks the current value of every state packet through the CL (following
+ * sub-lists).  A packet is redundant if it sets the value already in effect
+ * and dead if it is overwritten before any draw uses it.  Runs of draws with
+ * identical state are also reported as candidates for merging.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "v3d_cl_instr_autogen.h"
+#include "cl_dump.h"
+
+//Big enough for any of the tracked packets
+#define MAX_STATE_PACKET 16
+
+typedef struct {
+   uint32_t addr;    //Address of the packet currently in effect, 0 if never set
+   uint32_t size;
+   uint8_t  value[MAX_STATE_PACKET];
+   int      used;    //A draw has happened since the value was set
+
+   uint32_t redundant_count;
+   uint32_t redundant_bytes;
+   uint32_t dead_count;
+   uint32_t dead_bytes;
+} state_slot_t;
+
+static const uint8_t tracked_opcodes[] = {
+   V3D_HW_INSTR_STATE_CFG,
+   V3D_HW_INSTR_STATE_FLATSHADE,
+   V3D_HW_INSTR_STATE_POINT_SIZE,
+   V3D_HW_INSTR_STATE_LINE_WIDTH,
+   V3D_HW_INSTR_STATE_RHTX,
+   V3D_HW_INSTR_STATE_DEPTH_OFFSET,
+   V3D_HW_INSTR_STATE_CLIP_WINDOW,
+   V3D_HW_INSTR_STATE_VIEWPORT_OFFSET,
+   V3D_HW_INSTR_STATE_CLIPZ,
+   V3D_HW_INSTR_STATE_CLIPPER_XY,
+   V3D_HW_INSTR_STATE_CLIPPER_Z,
+   V3D_HW_INSTR_PRIMITIVE_LIST_FORMAT,
+   V3D_HW_INSTR_GL_SHADER,
+   V3D_HW_INSTR_NV_SHADER,
+   V3D_HW_INSTR_VG_SHADER
+};
+
+#define NUM_TRACKED (sizeof(tracked_opcodes) / sizeof(tracked_opcodes[0]))
+
+typedef struct {
+   uint32_t first_draw;
+   uint32_t num_draws;
+   uint32_t start_addr;
+   uint32_t end_addr;
+} draw_run_t;
+
+typedef struct {
+   state_slot_t slots[NUM_TRACKED];
+   int          slot_of_opcode[256]; //-1 if the opcode isn't tracked
+
+   //Bumped whenever a packet actually changes state, draws with the same epoch
+   //share identical state
+   uint32_t state_epoch;
+
+   uint32_t num_draws;
+   uint32_t run_start_draw;
+   uint32_t run_start_addr;
+   uint32_t run_epoch;
+
+   draw_run_t* runs;
+   uint32_t    num_runs;
+   uint32_t    max_runs;
+   uint32_t    run_draws;
+} redundant_state_t;
+
+static int is_draw(uint8_t opcode) {
+   return opcode == V3D_HW_INSTR_VERTEX_PRIM_LIST ||
+      opcode == V3D_HW_INSTR_INDEXED_PRIM_LIST ||
+      opcode == V3D_HW_INSTR_VG_COORD_LIST ||
+      opcode == V3D_HW_INSTR_VG_INLINE_LIST;
+}
+
+static void end_draw_run(redundant_state_t* rs, uint32_t last_addr) {
+   uint32_t    run_length = rs->num_draws - rs->run_start_draw;
+   draw_run_t* run;
+
+   if(run_length < 2)
+      return;
+
+   if(rs->num_runs == rs->max_runs) {
+      rs->max_runs = rs->max_runs ? rs->max_runs * 2 : 64;
+      rs->runs = realloc(rs->runs, rs->max_runs * sizeof(draw_run_t));
+      assert(rs->runs);
+   }
+
+   run = &rs->runs[rs->num_runs++];
+   run->first_draw = rs->run_start_draw;
+   run->num_draws  = run_length;
+   run->start_addr = rs->run_start_addr;
+   run->end_addr   = last_addr;
+
+   rs->run_draws += run_length;
+}
+
+static void track_draw(redundant_state_t* rs, uint32_t addr, uint32_t* last_draw_addr) {
+   uint32_t i;
+
+   for(i = 0;i < NUM_TRACKED; ++i) {
+      rs->slots[i].used = 1;
+   }
+
+   if(rs->num_draws == 0 || rs->state_epoch != rs->run_epoch) {
+      if(rs->num_draws)
+         end_draw_run(rs, *last_draw_addr);
+
+      rs->run_start_draw = rs->num_draws;
+      rs->run_start_addr = addr;
+      rs->run_epoch      = rs->state_epoch;
+   }
+
+   rs->num_draws++;
+   *last_draw_addr = addr;
+}
+
+static void track_state(redundant_state_t* rs, state_slot_t* slot, uint8_t* ins, uint32_t size, uint32_t addr) {
+   const char* name = v3d_instr_name(*ins);
+
+   if(slot->addr && memcmp(slot->value, ins, size) == 0) {
+      printf("%08x: %s (%u bytes) redundant, same as %08x\n", addr, name, size, slot->addr);
+
+      slot->redundant_count++;
+      slot->redundant_bytes += size;
+      return;
+   }
+
+   if(slot->addr && !slot->used) {
+      printf("%08x: %s (%u bytes) dead, overwritten at %08x before any draw\n", slot->addr, name,
+         slot->size, addr);
+
+      slot->dead_count++;
+      slot->dead_bytes += slot->size;
+   }
+
+   slot->addr = addr;
+   slot->size = size;
+   slot->used = 0;
+   memcpy(slot->value, ins, size);
+
+   rs->state_epoch++;
+}
+
+typedef struct {
+   redundant_state_t* rs;
+   uint32_t           last_draw_addr;
+} redundant_walk_t;
+
+static int redundant_walk_fn(void* ctx, void* ins, uint32_t addr) {
+   redundant_walk_t* walk = ctx;
+   uint8_t opcode = *(uint8_t*)ins;
+   int slot = walk->rs->slot_of_opcode[opcode];
+
+   if(slot >= 0) {
+      track_state(walk->rs, &walk->rs->slots[slot], ins, v3d_instr_size(opcode), addr);
+   } else if(is_draw(opcode)) {
+      track_draw(walk->rs, addr, &walk->last_draw_addr);
+   }
+
+   return 0;
+}
+
+static void print_draw_runs(redundant_state_t* rs) {
+   uint32_t i;
+
+   printf("\nDraw runs sharing identical state\n");
+   printf("---------------------------------\n");
+
+   for(i = 0;i < rs->num_runs; ++i) {
+      draw_run_t* run = &rs->runs[i];
+
+      printf("draws %u-%u (%08x-%08x): %u draws\n", run->first_draw, run->first_draw + run->num_draws - 1,
+         run->start_addr, run->end_addr, run->num_draws);
+   }
+}
+
+static void print_summary(redundant_state_t* rs) {
+   uint32_t i;
+   uint32_t redundant_count = 0;
+   uint32_t redundant_bytes = 0;
+   uint32_t dead_count = 0;
+   uint32_t dead_bytes = 0;
+
+   printf("\nSummary\n");
+   printf("-------\n");
+
+   for(i = 0;i < NUM_TRACKED; ++i) {
+      state_slot_t* slot = &rs->slots[i];
+
+      if(!slot->redundant_count && !slot->dead_count)
+         continue;
+
+      printf("%-24s %4u redundant (%5u bytes) %4u dead (%5u bytes)\n", v3d_instr_name(tracked_opcodes[i]),
+         slot->redundant_count, slot->redundant_bytes, slot->dead_count, slot->dead_bytes);
+
+      redundant_count += slot->redundant_count;
+      redundant_bytes += slot->redundant_bytes;
+      dead_count      += slot->dead_count;
+      dead_bytes      += slot->dead_bytes;
+   }
+
+   printf("Total: %u redundant packets (%u bytes), %u dead packets (%u bytes), %u bytes could be saved\n",
+      redundant_count, redundant_bytes, dead_count, dead_bytes, redundant_bytes + dead_bytes);
+   printf("%u draws, %u runs covering %u draws share identical state\n", rs->num_draws, rs->num_runs,
+      rs->run_draws);
+}
+
+int do_redundant(char* start_addr_str, char* end_addr_str) {
+   redundant_state_t* rs;
+   redundant_walk_t   walk;
+   uint32_t start_addr;
+   uint32_t end_addr;
+   uint32_t i;
+   int      ret;
+
+   if(parse_cl_range(start_addr_str, end_addr_str, &start_addr, &end_addr))
+      return 1;
+
+   rs = calloc(1, sizeof(redundant_state_t));
+   if(!rs) {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+   }
+
+   for(i = 0;i < 256; ++i) {
+      rs->slot_of_opcode[i] = -1;
+   }
+
+   for(i = 0;i < NUM_TRACKED; ++i) {
+      rs->slot_of_opcode[tracked_opcodes[i]] = i;
+   }
+
+   printf("Redundant state in CL start: %08x end: %08x\n", start_addr, end_addr);
+   printf("------------------------------------------------\n");
+
+   walk.rs = rs;
+   walk.last_draw_addr = 0;
+
+   ret = walk_cl(start_addr, end_addr, redundant_walk_fn, &walk);
+
+   if(rs->num_draws)
+      end_draw_run(rs, walk.last_draw_addr);
+
+   print_draw_runs(rs);
+   print_summary(rs);
+
+   free(rs->runs);
+   free(rs);
+
+   return ret;
+}
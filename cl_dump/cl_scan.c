@@ -0,0 +1,617 @@
+/*
+ * cl_scan.c - Finds control lists and QPU programs in a raw memory dump
+ *
+ * After a GPU hang all we may have is a dump with no idea where the CLs are.
+ * The range is split into units scanned by a pool of threads:
+ *
+ * - Control lists: every byte that could start a packet is followed packet
+ *   by packet (as calc_next_ins would) until a terminator (HALT, BRANCH,
+ *   RETURN) or an invalid opcode.  Only chain heads (offsets no other packet leads to) are
+ *   followed and each offset is visited once, so the scan is linear.
+ * - QPU programs: 8 byte aligned words with the program end signal followed
+ *   by two plausible delay slot instructions, extended backwards while the
+ *   instructions stay plausible.
+ *
+ * Candidates are scored 0-100 on how much they look like real GPU data
+ * (packet variety, pointers landing inside the dump, typical signal and nop
+ * encodings) and printed ranked by that confidence.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "v3d_cl_instr_autogen.h"
+#include "cl_dump.h"
+
+#define SCAN_UNIT_SIZE  (4 * 1024 * 1024)
+//Candidates starting in a unit may run past its end (CLs) or start before it
+//(QPU programs), windows are extended by this much either side
+#define SCAN_OVERLAP    (64 * 1024)
+
+#define DEFAULT_TOP         20
+#define DEFAULT_MIN_PACKETS 3
+#define MIN_QPU_INSTS       4
+
+#define CAND_CL  0
+#define CAND_QPU 1
+
+#define CAND_TERMINATED 1 //CL ended in HALT, BRANCH or RETURN
+#define CAND_MERGED     2 //CL ran into one found from an earlier start
+#define CAND_TRUNCATED  4 //Ran off the end of the scan window
+
+typedef struct {
+   uint32_t type;
+   uint32_t start;
+   uint32_t end;
+   uint32_t count;      //Packets or instructions
+   uint32_t confidence;
+   uint32_t flags;
+} scan_cand_t;
+
+typedef struct {
+   scan_cand_t* cands;
+   uint32_t     num_cands;
+   uint32_t     max_cands;
+} scan_results_t;
+
+typedef struct {
+   uint32_t start;
+   uint32_t end;
+   uint32_t num_units;
+   uint32_t next_unit;   //Shared work counter
+   uint32_t min_packets;
+   int      failed;
+} scan_job_t;
+
+typedef struct {
+   scan_job_t*    job;
+   scan_results_t results;
+   pthread_t      thread;
+} scan_thread_t;
+
+//Packet sizes by opcode, 0 for invalid opcodes.  Every byte of the dump gets
+//looked up so this saves going through calc_next_ins each time.
+static uint8_t op_size[256];
+//As op_size but also 0 for terminators, the step to the packet that follows
+static uint8_t op_step[256];
+
+static int is_terminator(uint8_t opcode);
+
+static void init_op_size(void) {
+   int i;
+
+   for(i = 0;i < 256; ++i) {
+      op_size[i] = v3d_instr_size(i);
+      op_step[i] = is_terminator(i) ? 0 : op_size[i];
+   }
+}
+
+static void add_cand(scan_results_t* results, scan_cand_t* cand) {
+   if(results->num_cands == results->max_cands) {
+      scan_cand_t* grown;
+
+      results->max_cands = results->max_cands ? results->max_cands * 2 : 256;
+      grown = realloc(results->cands, results->max_cands * sizeof(scan_cand_t));
+      if(!grown) {
+         fprintf(stderr, "Out of memory, dropping scan candidates\n");
+         return;
+      }
+      results->cands = grown;
+   }
+
+   results->cands[results->num_cands++] = *cand;
+}
+
+//SWAR check for a block of all zero bytes, zeroed memory is the bulk of most
+//dumps and holds neither CLs (just HALTs) nor QPU code (breakpoints)
+//p needn't be aligned (scan start can be any address), memcpy compiles to
+//plain loads where unaligned access is allowed
+static int zero_block(const uint8_t* p) {
+   uint64_t w[8];
+
+   memcpy(w, p, sizeof(w));
+
+   return (w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) == 0;
+}
+
+static int is_terminator(uint8_t opcode) {
+   return opcode == V3D_HW_INSTR_HALT || opcode == V3D_HW_INSTR_BRANCH || opcode == V3D_HW_INSTR_RETURN;
+}
+
+//Packets that only make sense in a real CL, long runs of NOPs or a lone
+//FLUSH are as likely to be other data
+static int is_strong(uint8_t opcode) {
+   return (opcode >= V3D_HW_INSTR_STATE_CFG && opcode <= V3D_HW_INSTR_STATE_TILE_COORDS) ||
+      opcode == V3D_HW_INSTR_GL_SHADER || opcode == V3D_HW_INSTR_NV_SHADER ||
+      opcode == V3D_HW_INSTR_INDEXED_PRIM_LIST || opcode == V3D_HW_INSTR_VERTEX_PRIM_LIST ||
+      opcode == V3D_HW_INSTR_START_TILE_BINNING || opcode == V3D_HW_INSTR_PRIMITIVE_LIST_FORMAT ||
+      (opcode >= V3D_HW_INSTR_STORE_SUBSAMPLE && opcode <= V3D_HW_INSTR_LOAD_GENERAL);
+}
+
+static int in_scan(scan_job_t* job, uint32_t addr) {
+   return addr >= job->start && addr < job->end;
+}
+
+//Fields that land inside the dump or hold sensible values count for the
+//packet, ones that don't against.  Returns 1, -1 or 0 for packets with
+//nothing to check.
+static int check_fields(scan_job_t* job, uint8_t* ins) {
+   switch(*ins) {
+      case V3D_HW_INSTR_BRANCH:
+      case V3D_HW_INSTR_BRANCH_SUB:
+         return in_scan(job, ((instr_BRANCH_SUB_t*)ins)->branch_addr) ? 1 : -1;
+      case V3D_HW_INSTR_GL_SHADER:
+         return in_scan(job, ((instr_GL_SHADER_t*)ins)->shader_record_addr << 4) ? 1 : -1;
+      case V3D_HW_INSTR_INDEXED_PRIM_LIST: {
+         instr_INDEXED_PRIM_LIST_t* prim = (instr_INDEXED_PRIM_LIST_t*)ins;
+
+         return prim->prim_mode <= 6 && prim->index_type <= 1 && in_scan(job, prim->indices_addr) ? 1 : -1;
+      }
+      case V3D_HW_INSTR_VERTEX_PRIM_LIST:
+         return ((instr_VERTEX_PRIM_LIST_t*)ins)->prim_mode <= 6 ? 1 : -1;
+      default:
+         return 0;
+   }
+}
+
+static void scan_cl(scan_job_t* job, scan_results_t* results, uint8_t* window, uint32_t window_addr,
+   uint32_t window_size, uint32_t unit_start, uint32_t unit_end) {
+   uint8_t* reached;
+   uint8_t* visited;
+   uint32_t off;
+
+   //Byte rather than bit maps so the first pass can mark without branching,
+   //padded for a step from the last byte
+   reached = calloc(1, window_size + 256);
+   visited = calloc(1, window_size);
+   if(!reached || !visited) {
+      fprintf(stderr, "Out of memory scanning %08x\n", unit_start);
+      job->failed = 1;
+      free(reached);
+      free(visited);
+      return;
+   }
+
+   //Mark every offset some packet leads on to, a step of 0 marks nothing
+   for(off = 0;off < window_size; off += 64) {
+      uint32_t block = window_size - off < 64 ? window_size - off : 64;
+      uint32_t i;
+
+      if(block == 64 && zero_block(window + off))
+         continue;
+
+      for(i = off;i < off + block; ++i) {
+         uint8_t step = op_step[window[i]];
+
+         reached[i + step] |= step != 0;
+      }
+   }
+
+   //Follow the chains from each head starting in this unit
+   for(off = unit_start - window_addr;off < unit_end - window_addr; ++off) {
+      scan_cand_t cand;
+      uint32_t    opcodes_seen[8];
+      uint32_t    distinct = 0;
+      uint32_t    strong = 0;
+      uint32_t    nops = 0;
+      int         fields = 0;
+      uint32_t    p = off;
+      int         score;
+
+      if((off & 63) == 0 && off + 64 <= window_size && zero_block(window + off)) {
+         off += 63;
+         continue;
+      }
+
+      if(!op_size[window[off]] || reached[off])
+         continue;
+
+      memset(&cand, 0, sizeof(cand));
+      memset(opcodes_seen, 0, sizeof(opcodes_seen));
+
+      while(1) {
+         uint8_t opcode;
+
+         if(p >= window_size || p + op_size[window[p]] > window_size) {
+            cand.flags |= CAND_TRUNCATED;
+            break;
+         }
+
+         if(visited[p]) {
+            cand.flags |= CAND_MERGED;
+            break;
+         }
+
+         opcode = window[p];
+         if(!op_size[opcode])
+            break;
+
+         visited[p] = 1;
+         cand.count++;
+
+         if(!(opcodes_seen[opcode >> 5] & (1u << (opcode & 31)))) {
+            opcodes_seen[opcode >> 5] |= 1u << (opcode & 31);
+            distinct++;
+         }
+
+         strong   += is_strong(opcode);
+         nops     += opcode == V3D_HW_INSTR_NOP;
+         fields   += check_fields(job, window + p);
+
+         p += op_size[opcode];
+
+         if(is_terminator(opcode)) {
+            cand.flags |= CAND_TERMINATED;
+            break;
+         }
+      }
+
+      if(cand.count - nops < job->min_packets || distinct < 2)
+         continue;
+
+      score = 8 * (distinct < 8 ? distinct : 8);
+      score += 20 * strong / cand.count;
+      score += fields > 4 ? 16 : fields * 4;
+      if(!(cand.flags & (CAND_TERMINATED | CAND_MERGED)))
+         score -= 20;
+      if(score > 100)
+         score = 100;
+      if(score <= 0)
+         continue;
+
+      cand.type       = CAND_CL;
+      cand.start      = window_addr + off;
+      cand.end        = window_addr + p;
+      cand.confidence = score;
+
+      add_cand(results, &cand);
+   }
+
+   free(reached);
+   free(visited);
+}
+
+static uint32_t qpu_sig(const uint32_t* inst) {
+   return inst[1] >> 28;
+}
+
+static int qpu_plausible(const uint32_t* inst) {
+   uint32_t addop;
+
+   switch(qpu_sig(inst)) {
+      case 0: //Breakpoint, and what zeroed memory decodes as
+         return 0;
+      case 15:
+         return ((inst[1] >> 24) & 0xf) == 0;
+      case 14: {
+         uint32_t unpack = (inst[1] >> 25) & 0x7;
+
+         return unpack == 0 || unpack == 1 || unpack == 3;
+      }
+      default:
+         addop = (inst[0] >> 24) & 0x1f;
+         return !((addop >= 9 && addop <= 11) || (addop >= 25 && addop <= 29));
+   }
+}
+
+//Compilers fill an idle pipe with a nop writing the nop register, which
+//random data almost never does
+static int qpu_has_idle_pipe(const uint32_t* inst) {
+   uint32_t sig = qpu_sig(inst);
+   uint32_t waddr_add = (inst[1] >> 6) & 0x3f;
+   uint32_t waddr_mul = inst[1] & 0x3f;
+
+   if(sig == 14 || sig == 15)
+      return waddr_add == 39 || waddr_mul == 39;
+
+   return (((inst[0] >> 24) & 0x1f) == 0 && waddr_add == 39) || (((inst[0] >> 29) & 0x7) == 0 && waddr_mul == 39);
+}
+
+static void scan_qpu(scan_job_t* job, scan_results_t* results, uint8_t* window, uint32_t window_addr,
+   uint32_t window_size, uint32_t unit_start, uint32_t unit_end) {
+   uint32_t  first = ((window_addr + 7) & ~7) - window_addr;
+   uint32_t* insts = (uint32_t*)(window + first);
+   uint32_t  num_insts;
+   uint32_t  unit_first;
+   uint32_t  unit_last;
+   uint32_t  i;
+
+   //Not even one aligned instruction to look at, and the sizes below would wrap
+   if(window_size < first + 8 || unit_end - window_addr < first + 8)
+      return;
+
+   num_insts  = (window_size - first) / 8;
+   unit_first = (unit_start - window_addr - first + 7) / 8;
+   unit_last  = (unit_end - window_addr - first) / 8;
+
+   if(unit_last > num_insts)
+      unit_last = num_insts;
+
+   for(i = unit_first;i < unit_last; ++i) {
+      scan_cand_t cand;
+      uint32_t    start;
+      uint32_t    end;
+      uint32_t    j;
+      uint32_t    common = 0;
+      uint32_t    idle = 0;
+      uint32_t    n;
+      int         score;
+
+      //Prefilter on the signal field, eight instructions at a time
+      if((i & 7) == 0 && i + 8 <= unit_last) {
+         uint32_t* hi = insts + i * 2 + 1;
+
+         if(((hi[0] >> 28) != 3) & ((hi[2] >> 28) != 3) & ((hi[4] >> 28) != 3) & ((hi[6] >> 28) != 3) &
+            ((hi[8] >> 28) != 3) & ((hi[10] >> 28) != 3) & ((hi[12] >> 28) != 3) & ((hi[14] >> 28) != 3)) {
+            i += 7;
+            continue;
+         }
+      }
+
+      if(qpu_sig(&insts[i * 2]) != 3 || i + 2 >= num_insts)
+         continue;
+
+      //Two delay slots that aren't themselves branches or program ends
+      for(j = i + 1;j <= i + 2; ++j) {
+         uint32_t sig = qpu_sig(&insts[j * 2]);
+
+         if(!qpu_plausible(&insts[j * 2]) || sig == 3 || sig == 15)
+            break;
+      }
+      if(j <= i + 2)
+         continue;
+
+      end   = i + 3;
+      start = i;
+
+      while(start > 0 && qpu_plausible(&insts[(start - 1) * 2]) && qpu_sig(&insts[(start - 1) * 2]) != 3)
+         start--;
+
+      memset(&cand, 0, sizeof(cand));
+
+      //The instructions after the previous program's end are its delay slots
+      if(start > 0 && qpu_sig(&insts[(start - 1) * 2]) == 3)
+         start += 2;
+      else if(start == 0)
+         cand.flags |= CAND_TRUNCATED;
+
+      if(start > i)
+         continue;
+
+      n = end - start;
+      if(n < MIN_QPU_INSTS)
+         continue;
+
+      for(j = start;j < end; ++j) {
+         uint32_t sig = qpu_sig(&insts[j * 2]);
+
+         common += sig == 1 || sig == 13 || sig == 14;
+         idle   += qpu_has_idle_pipe(&insts[j * 2]);
+      }
+
+      score = 50 * idle / n + 25 * common / n + 25 * (n < 32 ? n : 32) / 32;
+      if(score > 100)
+         score = 100;
+
+      cand.type       = CAND_QPU;
+      cand.start      = window_addr + first + start * 8;
+      cand.end        = window_addr + first + end * 8;
+      cand.count      = n;
+      cand.confidence = score;
+      cand.flags     |= CAND_TERMINATED;
+
+      add_cand(results, &cand);
+   }
+}
+
+static void* scan_thread(void* arg) {
+   scan_thread_t* st = arg;
+   scan_job_t*    job = st->job;
+
+   while(1) {
+      uint32_t unit = __sync_fetch_and_add(&job->next_unit, 1);
+      uint32_t unit_start;
+      uint32_t unit_end;
+      uint32_t window_start;
+      uint32_t window_end;
+      uint8_t* window;
+
+      if(unit >= job->num_units)
+         break;
+
+      unit_start = job->start + unit * SCAN_UNIT_SIZE;
+      unit_end   = job->end - unit_start > SCAN_UNIT_SIZE ? unit_start + SCAN_UNIT_SIZE : job->end;
+
+      window_start = unit_start - job->start > SCAN_OVERLAP ? unit_start - SCAN_OVERLAP : job->start;
+      window_end   = job->end - unit_end > SCAN_OVERLAP ? unit_end + SCAN_OVERLAP : job->end;
+
+      window = map_area(window_start, window_end - window_start);
+      if(!window) {
+         fprintf(stderr, "Failed to map scan window at %08x\n", window_start);
+         job->failed = 1;
+         continue;
+      }
+
+      scan_cl(job, &st->results, window, window_start, window_end - window_start, unit_start, unit_end);
+      scan_qpu(job, &st->results, window, window_start, window_end - window_start, unit_start, unit_end);
+
+      unmap_area(window, window_end - window_start);
+   }
+
+   return 0;
+}
+
+static int cmp_cand(const void* a, const void* b) {
+   const scan_cand_t* ca = a;
+   const scan_cand_t* cb = b;
+
+   if(ca->confidence != cb->confidence)
+      return ca->confidence < cb->confidence ? 1 : -1;
+
+   return ca->start < cb->start ? -1 : ca->start > cb->start;
+}
+
+static int cmp_cand_addr(const void* a, const void* b) {
+   const scan_cand_t* ca = a;
+   const scan_cand_t* cb = b;
+
+   return ca->start < cb->start ? -1 : ca->start > cb->start;
+}
+
+//Bytes inside a real CL or program also decode as short chains of packets, so
+//drop candidates that start inside a more confident one
+static void drop_overlapping(scan_results_t* results) {
+   scan_cand_t* cover = 0;
+   uint32_t     kept = 0;
+   uint32_t     i;
+
+   qsort(results->cands, results->num_cands, sizeof(scan_cand_t), cmp_cand_addr);
+
+   for(i = 0;i < results->num_cands; ++i) {
+      scan_cand_t* cand = &results->cands[i];
+
+      if(cover && cand->start < cover->end && cand->confidence <= cover->confidence)
+         continue;
+
+      results->cands[kept] = *cand;
+      if(!cover || results->cands[kept].end > cover->end || cand->confidence > cover->confidence)
+         cover = &results->cands[kept];
+      kept++;
+   }
+
+   results->num_cands = kept;
+}
+
+static void print_cands(scan_results_t* results, uint32_t type, uint32_t top) {
+   uint32_t shown = 0;
+   uint32_t total = 0;
+   uint32_t i;
+
+   for(i = 0;i < results->num_cands; ++i) {
+      total += results->cands[i].type == type;
+   }
+
+   if(type == CAND_CL) {
+      printf("Control list candidates (%u found)\n", total);
+      printf("-----------------------\n");
+      printf("%4s %4s %8s %8s %8s  %s\n", "rank", "conf", "start", "end", "packets", "notes");
+   } else {
+      printf("QPU program candidates (%u found)\n", total);
+      printf("----------------------\n");
+      printf("%4s %4s %8s %8s %8s  %s\n", "rank", "conf", "start", "end", "insts", "notes");
+   }
+
+   for(i = 0;i < results->num_cands && shown < top; ++i) {
+      scan_cand_t* cand = &results->cands[i];
+
+      if(cand->type != type)
+         continue;
+
+      shown++;
+      printf("%4u %4u %08x %08x %8u  %s%s%s\n", shown, cand->confidence, cand->start, cand->end, cand->count,
+         type == CAND_CL && (cand->flags & CAND_TERMINATED) ? "terminated " : "",
+         cand->flags & CAND_MERGED ? "joins an earlier list " : "",
+         cand->flags & CAND_TRUNCATED ? "truncated" : "");
+   }
+
+   printf("\n");
+}
+
+int do_scan(int argc, char* argv[]) {
+   scan_job_t      job;
+   scan_thread_t*  threads;
+   scan_results_t  all;
+   struct timespec t0;
+   struct timespec t1;
+   uint32_t        top = DEFAULT_TOP;
+   long            num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+   long            i;
+   uint32_t        j;
+
+   memset(&job, 0, sizeof(job));
+   job.min_packets = DEFAULT_MIN_PACKETS;
+
+   if(argc < 2 || parse_cl_range(argv[0], argv[1], &job.start, &job.end))
+      return 1;
+
+   for(i = 2;i < argc; ++i) {
+      if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+         num_threads = atol(argv[++i]);
+      } else if(strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+         top = atoi(argv[++i]);
+      } else if(strcmp(argv[i], "--min-packets") == 0 && i + 1 < argc) {
+         job.min_packets = atoi(argv[++i]);
+      } else {
+         fprintf(stderr, "Unknown scan option %s\n", argv[i]);
+         return 1;
+      }
+   }
+
+   if(job.end <= job.start || clip_to_mem(&job.start, &job.end)) {
+      fprintf(stderr, "Nothing to scan between %s and %s\n", argv[0], argv[1]);
+      return 1;
+   }
+
+   if(num_threads < 1)
+      num_threads = 1;
+
+   job.num_units = (job.end - job.start + SCAN_UNIT_SIZE - 1) / SCAN_UNIT_SIZE;
+   if(num_threads > job.num_units)
+      num_threads = job.num_units;
+
+   init_op_size();
+
+   threads = calloc(num_threads, sizeof(scan_thread_t));
+   if(!threads) {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &t0);
+
+   for(i = 0;i < num_threads; ++i) {
+      threads[i].job = &job;
+
+      if(pthread_create(&threads[i].thread, 0, scan_thread, &threads[i])) {
+         fprintf(stderr, "Failed to start scan thread\n");
+         job.failed = 1;
+         num_threads = i;
+         break;
+      }
+   }
+
+   memset(&all, 0, sizeof(all));
+
+   for(i = 0;i < num_threads; ++i) {
+      pthread_join(threads[i].thread, 0);
+
+      for(j = 0;j < threads[i].results.num_cands; ++j) {
+         add_cand(&all, &threads[i].results.cands[j]);
+      }
+
+      free(threads[i].results.cands);
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &t1);
+
+   drop_overlapping(&all);
+   qsort(all.cands, all.num_cands, sizeof(scan_cand_t), cmp_cand);
+
+   printf("Scanned %08x-%08x (%u bytes) with %ld threads in %.3f s\n\n", job.start, job.end,
+      job.end - job.start, num_threads, (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+
+   print_cands(&all, CAND_CL, top);
+   print_cands(&all, CAND_QPU, top);
+
+   free(all.cands);
+   free(threads);
+
+   return job.failed;
+}
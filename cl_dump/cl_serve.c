@@ -0,0 +1,563 @@
+/*
+ * cl_serve.c - Serves requests for cl_dump commands over a UNIX socket
+ *
+ * The memory source is opened (and a dump file mapped) once when the server
+ * starts, then each client connection gets a forked process inheriting it,
+ * so clients are served concurrently and a request only costs the command
+ * itself.  A client keeps its process, and so its QPU program cache, until
+ * it disconnects.
+ *
+ * Requests are one line each, a command and its arguments as given on the
+ * command line without --file:
+ *
+ *    dis|redundant|pairs|draws|textures|hazards|sim|footprint|cfg|scan
+ *       start end [options]
+ *    qpu start [end]                - Lists one QPU program
+ *    snapshot addr size out_file    - Same as dump, written by the server
+ *    stats                          - Requests served so far
+ *    source dump_file:mem_base|-    - Switches source for this client
+ *
+ * Responses are JSON lines.  Each request gets a record naming the command,
+ * then records carrying chunks of what it prints ("out" for stdout, "err"
+ * for stderr, chunks end at a newline where possible) as it's printed, then
+ * a record with the exit status and time taken:
+ *
+ *    {"request":1,"command":"dis"}
+ *    {"request":1,"out":"Control list:\n"}
+ *    ...
+ *    {"request":1,"status":0,"ms":1.234}
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "cl_dump.h"
+
+#define MAX_REQUEST_LEN  1024
+#define MAX_REQUEST_ARGS 16
+#define RELAY_BUF_SIZE   4096
+#define LISTEN_BACKLOG   16
+
+//Requests other than the read commands, numbered after them
+#define REQ_QPU      (NUM_READ_CMDS + 0)
+#define REQ_SNAPSHOT (NUM_READ_CMDS + 1)
+#define REQ_STATS    (NUM_READ_CMDS + 2)
+#define REQ_SOURCE   (NUM_READ_CMDS + 3)
+#define NUM_REQS     (NUM_READ_CMDS + 4)
+
+static const char* extra_req_names[NUM_REQS - NUM_READ_CMDS] = {
+   "qpu", "snapshot", "stats", "source"
+};
+
+typedef struct {
+   uint64_t count;
+   uint64_t failed;
+   uint64_t ns;
+} req_stats_t;
+
+//Shared between the server and its client processes, only updated atomically
+typedef struct {
+   double      start_time;
+   uint32_t    clients;
+   uint32_t    active_clients;
+   uint64_t    unknown;
+   req_stats_t reqs[NUM_REQS];
+} serve_stats_t;
+
+static serve_stats_t*        stats;
+static volatile sig_atomic_t stopping;
+
+//Copies what a command prints on one of stdout/stderr to the client
+typedef struct {
+   int              client;
+   int              fd;
+   const char*      stream;
+   uint32_t         request;
+   pthread_mutex_t* lock;
+} relay_t;
+
+static double now(void) {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char* req_name(int req) {
+   return req < NUM_READ_CMDS ? read_cmd_name(req) : extra_req_names[req - NUM_READ_CMDS];
+}
+
+static int write_all(int fd, const char* buf, size_t len) {
+   while(len) {
+      ssize_t written = write(fd, buf, len);
+
+      if(written < 0) {
+         if(errno == EINTR)
+            continue;
+         return 1;
+      }
+
+      buf += written;
+      len -= written;
+   }
+
+   return 0;
+}
+
+//Writes a record carrying len bytes of text as a JSON string
+static void send_chunk(relay_t* relay, const char* text, size_t len) {
+   static const char hex[] = "0123456789abcdef";
+   char   record[RELAY_BUF_SIZE * 6 + 64];
+   size_t out;
+   size_t i;
+
+   out = sprintf(record, "{\"request\":%u,\"%s\":\"", relay->request, relay->stream);
+
+   for(i = 0;i < len; ++i) {
+      unsigned char c = text[i];
+
+      if(c == '"' || c == '\\') {
+         record[out++] = '\\';
+         record[out++] = c;
+      } else if(c == '\n') {
+         record[out++] = '\\';
+         record[out++] = 'n';
+      } else if(c == '\t') {
+         record[out++] = '\\';
+         record[out++] = 't';
+      } else if(c < 0x20) {
+         memcpy(&record[out], "\\u00", 4);
+         record[out + 4] = hex[c >> 4];
+         record[out + 5] = hex[c & 0xf];
+         out += 6;
+      } else {
+         record[out++] = c;
+      }
+   }
+
+   memcpy(&record[out], "\"}\n", 3);
+   out += 3;
+
+   pthread_mutex_lock(relay->lock);
+   write_all(relay->client, record, out);
+   pthread_mutex_unlock(relay->lock);
+}
+
+static void* relay_fn(void* arg) {
+   relay_t* relay = arg;
+   char     buf[RELAY_BUF_SIZE];
+   size_t   used = 0;
+
+   for(;;) {
+      ssize_t got = read(relay->fd, buf + used, sizeof(buf) - used);
+      size_t  line_len;
+
+      if(got < 0 && errno == EINTR)
+         continue;
+      if(got <= 0)
+         break;
+
+      used += got;
+
+      //Send whole lines, or everything once a line fills the buffer
+      for(line_len = used;line_len && buf[line_len - 1] != '\n'; --line_len);
+
+      if(line_len) {
+         send_chunk(relay, buf, line_len);
+         memmove(buf, buf + line_len, used - line_len);
+         used -= line_len;
+      } else if(used == sizeof(buf)) {
+         send_chunk(relay, buf, used);
+         used = 0;
+      }
+   }
+
+   if(used)
+      send_chunk(relay, buf, used);
+
+   close(relay->fd);
+
+   return 0;
+}
+
+//Points target_fd at a pipe with a relay thread reading it, saving the
+//original in *saved_fd
+static int start_relay(relay_t* relay, pthread_t* thread, int target_fd, int* saved_fd) {
+   int fds[2];
+
+   if(pipe(fds))
+      return 1;
+
+   relay->fd = fds[0];
+   *saved_fd = dup(target_fd);
+   dup2(fds[1], target_fd);
+   close(fds[1]);
+
+   if(pthread_create(thread, 0, relay_fn, relay)) {
+      dup2(*saved_fd, target_fd);
+      close(*saved_fd);
+      close(fds[0]);
+      return 1;
+   }
+
+   return 0;
+}
+
+//Restoring the fd closes the pipe's last write end, so the relay finishes
+//once it has sent everything
+static void stop_relay(pthread_t thread, int target_fd, int saved_fd) {
+   dup2(saved_fd, target_fd);
+   close(saved_fd);
+   pthread_join(thread, 0);
+}
+
+static int print_stats(void) {
+   uint64_t total = 0;
+   int      r;
+
+   printf("Up %.1f s, %u clients (%u connected), %llu unknown requests\n", now() - stats->start_time,
+      stats->clients, stats->active_clients, (unsigned long long)stats->unknown);
+   printf("%-10s %9s %7s %10s %10s\n", "request", "count", "failed", "total ms", "mean ms");
+
+   for(r = 0;r < NUM_REQS; ++r) {
+      req_stats_t* req = &stats->reqs[r];
+
+      if(!req->count)
+         continue;
+
+      printf("%-10s %9llu %7llu %10.3f %10.3f\n", req_name(r), (unsigned long long)req->count,
+         (unsigned long long)req->failed, req->ns / 1e6, req->ns / 1e6 / req->count);
+      total += req->count;
+   }
+
+   printf("%llu requests\n", (unsigned long long)total);
+
+   return 0;
+}
+
+static int run_request(int req, int argc, char* argv[]) {
+   uint32_t start;
+   uint32_t end = 0;
+   char*    mem_file;
+   uint32_t base;
+
+   if(req < NUM_READ_CMDS)
+      return run_read_cmd(req, argc - 1, &argv[1]);
+
+   switch(req) {
+      case REQ_QPU:
+         if(argc < 2 || argc > 3 || sscanf(argv[1], "0x%x", &start) != 1 ||
+            (argc == 3 && sscanf(argv[2], "0x%x", &end) != 1)) {
+            fprintf(stderr, "Usage: qpu 0x1234abcd [0x1234abcd]\n");
+            return 1;
+         }
+
+         return dis_qpu_prog(start, end);
+      case REQ_SNAPSHOT:
+         if(argc != 4) {
+            fprintf(stderr, "Usage: snapshot addr size out_file\n");
+            return 1;
+         }
+
+         return do_dump(argv[3], argv[1], argv[2]);
+      case REQ_STATS:
+         return print_stats();
+      case REQ_SOURCE:
+         if(argc != 2 || parse_source_spec(argv[1], &mem_file, &base)) {
+            fprintf(stderr, "Usage: source dump_file:0x1234abcd|-\n");
+            return 1;
+         }
+
+         return select_source(mem_file, base);
+   }
+
+   return 1;
+}
+
+static int find_request(const char* name) {
+   int r;
+
+   for(r = 0;r < NUM_REQS; ++r) {
+      if(strcmp(req_name(r), name) == 0)
+         return r;
+   }
+
+   return -1;
+}
+
+//Requests cut short (too_long, by the line buffer) or with too many arguments
+//get an error rather than running with what's left
+static void handle_request(int client, pthread_mutex_t* lock, uint32_t id, char* line, int too_long) {
+   char*     argv[MAX_REQUEST_ARGS];
+   int       argc = 0;
+   int       too_many = 0;
+   char*     arg;
+   char      record[128];
+   relay_t   out = { client, -1, "out", id, lock };
+   relay_t   err = { client, -1, "err", id, lock };
+   pthread_t out_thread;
+   pthread_t err_thread;
+   int       saved_stdout;
+   int       saved_stderr;
+   int       req;
+   int       status = 1;
+   double    start;
+   uint64_t  ns;
+
+   for(arg = strtok(line, " \t\r\n");arg; arg = strtok(0, " \t\r\n")) {
+      if(argc == MAX_REQUEST_ARGS) {
+         too_many = 1;
+         break;
+      }
+
+      argv[argc++] = arg;
+   }
+
+   if(!argc)
+      return;
+
+   req = find_request(argv[0]);
+
+   pthread_mutex_lock(lock);
+   snprintf(record, sizeof(record), "{\"request\":%u,\"command\":\"%s\"}\n", id, req < 0 ? "unknown" : req_name(req));
+   write_all(client, record, strlen(record));
+   pthread_mutex_unlock(lock);
+
+   start = now();
+
+   fflush(stdout);
+   fflush(stderr);
+
+   if(start_relay(&out, &out_thread, STDOUT_FILENO, &saved_stdout))
+      goto done;
+
+   if(start_relay(&err, &err_thread, STDERR_FILENO, &saved_stderr)) {
+      stop_relay(out_thread, STDOUT_FILENO, saved_stdout);
+      goto done;
+   }
+
+   if(too_long)
+      fprintf(stderr, "Request longer than %d bytes\n", MAX_REQUEST_LEN - 2);
+   else if(too_many)
+      fprintf(stderr, "Request has more than %d arguments\n", MAX_REQUEST_ARGS - 1);
+   else if(req < 0)
+      fprintf(stderr, "Unknown request %s\n", argv[0]);
+   else
+      status = run_request(req, argc, argv);
+
+   fflush(stdout);
+   fflush(stderr);
+
+   stop_relay(out_thread, STDOUT_FILENO, saved_stdout);
+   stop_relay(err_thread, STDERR_FILENO, saved_stderr);
+
+done:
+   ns = (now() - start) * 1e9;
+
+   if(req < 0) {
+      __sync_fetch_and_add(&stats->unknown, 1);
+   } else {
+      __sync_fetch_and_add(&stats->reqs[req].count, 1);
+      __sync_fetch_and_add(&stats->reqs[req].failed, status != 0);
+      __sync_fetch_and_add(&stats->reqs[req].ns, ns);
+   }
+
+   pthread_mutex_lock(lock);
+   snprintf(record, sizeof(record), "{\"request\":%u,\"status\":%d,\"ms\":%.3f}\n", id, status, ns / 1e6);
+   write_all(client, record, strlen(record));
+   pthread_mutex_unlock(lock);
+}
+
+static void serve_client(int client) {
+   pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+   FILE*           requests;
+   char            line[MAX_REQUEST_LEN];
+   uint32_t        id = 0;
+
+   signal(SIGINT, SIG_DFL);
+   signal(SIGTERM, SIG_DFL);
+
+   __sync_fetch_and_add(&stats->clients, 1);
+   __sync_fetch_and_add(&stats->active_clients, 1);
+
+   requests = fdopen(dup(client), "r");
+   if(requests) {
+      while(fgets(line, sizeof(line), requests)) {
+         int too_long = !strchr(line, '\n') && !feof(requests);
+         int c;
+
+         //Skip the rest of a line that didn't fit
+         if(too_long) {
+            do {
+               c = getc(requests);
+            } while(c != '\n' && c != EOF);
+         }
+
+         handle_request(client, &lock, ++id, line, too_long);
+      }
+
+      fclose(requests);
+   }
+
+   close(client);
+
+   __sync_fetch_and_sub(&stats->active_clients, 1);
+}
+
+static void stop_handler(int sig) {
+   stopping = 1;
+}
+
+//Removes a socket left behind by a server that didn't shut down cleanly,
+//refusing to take over one a running server is still listening on
+static int remove_stale_socket(const struct sockaddr_un* addr) {
+   struct stat st;
+   int         probe;
+   int         err;
+
+   if(stat(addr->sun_path, &st) != 0 || !S_ISSOCK(st.st_mode))
+      return 0;
+
+   probe = socket(AF_UNIX, SOCK_STREAM, 0);
+   if(probe < 0) {
+      fprintf(stderr, "Couldn't create socket: %s\n", strerror(errno));
+      return 1;
+   }
+
+   err = connect(probe, (const struct sockaddr*)addr, sizeof(*addr)) ? errno : 0;
+   close(probe);
+
+   if(!err) {
+      fprintf(stderr, "A server is already listening on %s\n", addr->sun_path);
+      return 1;
+   }
+
+   if(err != ECONNREFUSED) {
+      fprintf(stderr, "Couldn't check socket %s: %s\n", addr->sun_path, strerror(err));
+      return 1;
+   }
+
+   unlink(addr->sun_path);
+
+   return 0;
+}
+
+int do_serve(int argc, char* argv[]) {
+   struct sockaddr_un addr;
+   struct sigaction   action;
+   mode_t             old_umask;
+   int                listener;
+   int                bound;
+   int                ret = 0;
+
+   if(argc != 1) {
+      fprintf(stderr, "serve takes only a socket path\n");
+      return 1;
+   }
+
+   if(strlen(argv[0]) >= sizeof(addr.sun_path)) {
+      fprintf(stderr, "Socket path %s is too long\n", argv[0]);
+      return 1;
+   }
+
+   stats = mmap(0, sizeof(serve_stats_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if(stats == MAP_FAILED) {
+      fprintf(stderr, "Couldn't allocate server stats: %s\n", strerror(errno));
+      return 1;
+   }
+
+   memset(stats, 0, sizeof(serve_stats_t));
+   stats->start_time = now();
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path, argv[0]);
+
+   if(remove_stale_socket(&addr)) {
+      munmap(stats, sizeof(serve_stats_t));
+      return 1;
+   }
+
+   listener = socket(AF_UNIX, SOCK_STREAM, 0);
+   if(listener < 0) {
+      fprintf(stderr, "Couldn't create socket: %s\n", strerror(errno));
+      munmap(stats, sizeof(serve_stats_t));
+      return 1;
+   }
+
+   //Clients can write files and open sources as the server's user (often
+   //root for /dev/mem), so only that user gets to connect
+   old_umask = umask(0077);
+   bound     = bind(listener, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+   umask(old_umask);
+
+   if(!bound || listen(listener, LISTEN_BACKLOG)) {
+      fprintf(stderr, "Couldn't listen on %s: %s\n", argv[0], strerror(errno));
+      close(listener);
+      munmap(stats, sizeof(serve_stats_t));
+      return 1;
+   }
+
+   //No SA_RESTART so accept returns when asked to stop
+   memset(&action, 0, sizeof(action));
+   action.sa_handler = stop_handler;
+   sigaction(SIGINT, &action, 0);
+   sigaction(SIGTERM, &action, 0);
+   //Clients are never waited for, and one disconnecting mid response shouldn't
+   //kill its process
+   signal(SIGCHLD, SIG_IGN);
+   signal(SIGPIPE, SIG_IGN);
+
+   printf("Serving on %s\n", argv[0]);
+
+   while(!stopping) {
+      int   client = accept(listener, 0, 0);
+      pid_t pid;
+
+      if(client < 0) {
+         if(errno == EINTR)
+            continue;
+
+         fprintf(stderr, "accept failed: %s\n", strerror(errno));
+         ret = 1;
+         break;
+      }
+
+      fflush(stdout);
+      fflush(stderr);
+
+      pid = fork();
+      if(pid == 0) {
+         close(listener);
+         serve_client(client);
+         _exit(0);
+      }
+
+      if(pid < 0)
+         fprintf(stderr, "fork failed: %s\n", strerror(errno));
+
+      close(client);
+   }
+
+   close(listener);
+   unlink(argv[0]);
+
+   printf("Served %u clients\n", stats->clients);
+   munmap(stats, sizeof(serve_stats_t));
+
+   return ret;
+}
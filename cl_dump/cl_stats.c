@@ -0,0 +1,258 @@
+/*
+ * cl_stats.c - Self instrumentation for cl_dump
+ *
+ * With --stats each instrumented phase has its calls and time summed using
+ * the monotonic clock, along with counters for syscalls, bytes mapped and
+ * written, instructions decoded and buffers disassembled.  A breakdown goes
+ * to stderr at exit.  --stats-trace also records the phases (other than the
+ * per instruction ones) as a Chrome trace event JSON file, loadable in
+ * chrome://tracing or Perfetto.
+ *
+ * Output writes are caught by swapping stdout for a stream that writes to
+ * the same fd, so redirecting fd 1 (as batch and serve do) still works.
+ * Forked batch and serve workers exit without reporting, use batch --jobs 1
+ * to see a whole batch.
+ */
+
+#ifdef CL_DUMP_STATS
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "cl_stats.h"
+
+//Bounds the memory a long run's trace takes, later events are dropped
+#define MAX_TRACE_EVENTS (1 << 20)
+
+typedef struct {
+   const char* name;
+   int         traced;
+} stats_phase_info_t;
+
+static const stats_phase_info_t phase_info[NUM_STATS_PHASES] = {
+   { "map",        1 },
+   { "unmap",      1 },
+   { "dis area",   1 },
+   { "cl decode",  0 },
+   { "cl format",  0 },
+   { "qpu format", 1 },
+   { "output",     1 },
+};
+
+static const char* counter_names[NUM_STATS_COUNTERS] = {
+   "mmap calls", "munmap calls", "write calls", "bytes mapped", "window maps", "CL instructions decoded",
+   "QPU instructions formatted", "bytes written", "CL buffers", "shader records", "QPU programs"
+};
+
+typedef struct {
+   uint32_t phase;
+   uint64_t start;
+   uint64_t duration;
+} stats_event_t;
+
+int stats_enabled;
+
+static uint64_t       run_start;
+static uint64_t       phase_calls[NUM_STATS_PHASES];
+static uint64_t       phase_ns[NUM_STATS_PHASES];
+static uint64_t       counters[NUM_STATS_COUNTERS];
+static const char*    trace_file;
+static stats_event_t* events;
+static uint32_t       num_events;
+static uint64_t       dropped_events;
+
+uint64_t stats_begin(void) {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//Called from scan's threads too, so everything is updated atomically and
+//each event gets its own slot
+void stats_end(uint32_t phase, uint64_t start) {
+   uint64_t duration = stats_begin() - start;
+   uint32_t slot;
+
+   __sync_fetch_and_add(&phase_calls[phase], 1);
+   __sync_fetch_and_add(&phase_ns[phase], duration);
+
+   if(!events || !phase_info[phase].traced)
+      return;
+
+   //Checking first stops num_events wrapping on a very long run
+   slot = num_events < MAX_TRACE_EVENTS ? __sync_fetch_and_add(&num_events, 1) : MAX_TRACE_EVENTS;
+   if(slot >= MAX_TRACE_EVENTS) {
+      __sync_fetch_and_add(&dropped_events, 1);
+      return;
+   }
+
+   events[slot].phase    = phase;
+   events[slot].start    = start;
+   events[slot].duration = duration;
+}
+
+void stats_count(uint32_t counter, uint64_t n) {
+   __sync_fetch_and_add(&counters[counter], n);
+}
+
+static ssize_t stats_write(void* cookie, const char* buf, size_t size) {
+   size_t left = size;
+
+   while(left) {
+      ssize_t written;
+
+      STATS_BEGIN(STATS_OUTPUT);
+      written = write(STDOUT_FILENO, buf, left);
+      STATS_END(STATS_OUTPUT);
+      stats_count(STATS_WRITES, 1);
+
+      if(written < 0) {
+         if(errno == EINTR)
+            continue;
+         return size == left ? -1 : size - left;
+      }
+
+      buf  += written;
+      left -= written;
+      stats_count(STATS_BYTES_OUT, written);
+   }
+
+   return size;
+}
+
+static void write_trace(uint32_t written) {
+   FILE*    f = fopen(trace_file, "w");
+   uint32_t i;
+
+   if(!f) {
+      fprintf(stderr, "Couldn't open trace file %s: %s\n", trace_file, strerror(errno));
+      return;
+   }
+
+   fprintf(f, "{\"traceEvents\":[\n");
+
+   for(i = 0;i < written; ++i) {
+      stats_event_t* event = &events[i];
+
+      fprintf(f, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":0,\"ts\":%.3f,\"dur\":%.3f}%s\n",
+         phase_info[event->phase].name, (int)getpid(), (event->start - run_start) / 1e3,
+         event->duration / 1e3, i + 1 < written ? "," : "");
+   }
+
+   fprintf(f, "],\"displayTimeUnit\":\"ns\"}\n");
+   fclose(f);
+}
+
+static void stats_report(void) {
+   double   run_ms;
+   uint32_t i;
+
+   fflush(stdout);
+
+   //Don't time the report itself
+   stats_enabled = 0;
+   run_ms = (stats_begin() - run_start) / 1e6;
+
+   fprintf(stderr, "\ncl_dump stats, %.3f ms run\n", run_ms);
+   fprintf(stderr, "%-12s %10s %12s %10s %8s\n", "phase", "calls", "total ms", "mean us", "% run");
+
+   for(i = 0;i < NUM_STATS_PHASES; ++i) {
+      double ms = phase_ns[i] / 1e6;
+
+      if(!phase_calls[i])
+         continue;
+
+      fprintf(stderr, "%-12s %10llu %12.3f %10.3f %7.1f%%\n", phase_info[i].name, (unsigned long long)phase_calls[i],
+         ms, 1000 * ms / phase_calls[i], run_ms > 0 ? 100 * ms / run_ms : 0.0);
+   }
+
+   fprintf(stderr, "%-27s %12llu\n", "syscalls", (unsigned long long)(counters[STATS_MMAPS] +
+      counters[STATS_MUNMAPS] + counters[STATS_WRITES]));
+
+   for(i = 0;i < NUM_STATS_COUNTERS; ++i) {
+      fprintf(stderr, "%-27s %12llu\n", counter_names[i], (unsigned long long)counters[i]);
+   }
+
+   if(events) {
+      //num_events counts the dropped events too
+      uint32_t written = num_events < MAX_TRACE_EVENTS ? num_events : MAX_TRACE_EVENTS;
+
+      write_trace(written);
+      fprintf(stderr, "%u trace events written to %s", written, trace_file);
+      if(dropped_events)
+         fprintf(stderr, ", %llu dropped", (unsigned long long)dropped_events);
+      fprintf(stderr, "\n");
+   }
+}
+
+static int enable_stats(void) {
+   cookie_io_functions_t io = { 0, stats_write, 0, 0 };
+   FILE*                 out;
+
+   if(trace_file) {
+      events = malloc(MAX_TRACE_EVENTS * sizeof(stats_event_t));
+      if(!events) {
+         fprintf(stderr, "Couldn't allocate trace buffer\n");
+         return 1;
+      }
+   }
+
+   out = fopencookie(0, "w", io);
+   if(!out) {
+      fprintf(stderr, "Couldn't wrap stdout: %s\n", strerror(errno));
+      return 1;
+   }
+
+   setvbuf(out, 0, isatty(STDOUT_FILENO) ? _IOLBF : _IOFBF, BUFSIZ);
+   fflush(stdout);
+   stdout = out;
+
+   run_start     = stats_begin();
+   stats_enabled = 1;
+   atexit(stats_report);
+
+   return 0;
+}
+
+int parse_stats_opt(int* argc, char* argv[]) {
+   int found = 0;
+   int i = 2;
+
+   while(i < *argc) {
+      int consumed = 0;
+
+      if(strcmp(argv[i], "--stats") == 0) {
+         consumed = 1;
+      } else if(strcmp(argv[i], "--stats-trace") == 0) {
+         if(i + 1 >= *argc) {
+            fprintf(stderr, "--stats-trace needs a trace_file\n");
+            return 1;
+         }
+
+         trace_file = argv[i + 1];
+         consumed   = 2;
+      }
+
+      if(!consumed) {
+         ++i;
+         continue;
+      }
+
+      memmove(&argv[i], &argv[i + consumed], (*argc - i - consumed) * sizeof(char*));
+      *argc -= consumed;
+      found  = 1;
+   }
+
+   return found ? enable_stats() : 0;
+}
+
+#endif
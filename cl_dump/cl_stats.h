@@ -0,0 +1,58 @@
+#ifndef __CL_STATS_H__
+#define __CL_STATS_H__
+
+//Times and counts what cl_dump spends its time on, reported to stderr at
+//exit when run with --stats.  Only built in with CL_DUMP_STATS (make STATS=1),
+//otherwise the macros below expand to nothing.
+//#define CL_DUMP_STATS
+
+#include <stdint.h>
+
+//Phases nest (output writes happen inside the formatting phases) so their
+//times overlap
+#define STATS_MAP        0 //mmap in map_area
+#define STATS_UNMAP      1 //munmap in unmap_area
+#define STATS_DIS_AREA   2 //increase_dis_area, including its map and unmap
+#define STATS_CL_DECODE  3 //calc_next_ins
+#define STATS_CL_FORMAT  4 //disassemble_instr
+#define STATS_QPU_FORMAT 5 //show_qpu_fragment
+#define STATS_OUTPUT     6 //write of stdout's buffer
+#define NUM_STATS_PHASES 7
+
+#define STATS_MMAPS         0
+#define STATS_MUNMAPS       1
+#define STATS_WRITES        2
+#define STATS_BYTES_MAPPED  3
+#define STATS_WINDOW_MAPS   4 //map_area calls served from the dump file window
+#define STATS_CL_INSTS      5
+#define STATS_QPU_INSTS     6
+#define STATS_BYTES_OUT     7
+#define STATS_CL_BUFS       8
+#define STATS_SHADER_RECS   9
+#define STATS_QPU_PROGS     10
+#define NUM_STATS_COUNTERS  11
+
+#ifdef CL_DUMP_STATS
+
+extern int stats_enabled;
+
+uint64_t stats_begin(void);
+void stats_end(uint32_t phase, uint64_t start);
+void stats_count(uint32_t counter, uint64_t n);
+//Removes --stats [--stats-trace trace_file] from the arguments, enabling the
+//stats if present
+int parse_stats_opt(int* argc, char* argv[]);
+
+#define STATS_BEGIN(phase) uint64_t stats_start_##phase = stats_enabled ? stats_begin() : 0
+#define STATS_END(phase) do { if(stats_enabled) stats_end(phase, stats_start_##phase); } while(0)
+#define STATS_COUNT(counter, n) do { if(stats_enabled) stats_count(counter, n); } while(0)
+
+#else
+
+#define STATS_BEGIN(phase)
+#define STATS_END(phase) do { } while(0)
+#define STATS_COUNT(counter, n) do { } while(0)
+
+#endif
+
+#endif
@@ -0,0 +1,372 @@
+/*
+ * cl_textures.c - Uniform stream and texture config decoding
+ *
+ * Follows a QPU program counting the uniforms it reads and its TMU writes.
+ * Writing a TMU's S coordinate after any of its other coordinates starts a
+ * texture lookup, which takes the texture config parameters (P0, P1 and P2
+ * for cube maps) from the program's uniform stream at that point.  Those are
+ * decoded to give the textures each draw uses, their memory footprint and the
+ * bytes a fetch reads.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "v3d_cl_instr_autogen.h"
+#include "cl_dump.h"
+#include "cl_draws.h"
+#include "cl_textures.h"
+#include "qpudis.h"
+
+#define UNIFORMS_ADDR 40
+
+//Sizes of 0 in P1 mean 2048
+#define TEX_MAX_SIZE 2048
+
+#define MIN_FILTER_LINEAR 0
+
+#define MAX_DRAW_TEXTURES (3 * MAX_TEX_LOOKUPS)
+
+typedef struct {
+   const char* name;
+   uint32_t    bpp;
+} tex_type_t;
+
+static const tex_type_t tex_types[] = {
+   { "rgba8888", 32 }, { "rgbx8888", 32 }, { "rgba4444", 16 }, { "rgba5551", 16 }, { "rgb565", 16 },
+   { "luminance", 8 }, { "alpha", 8 }, { "lumalpha", 16 }, { "etc1", 4 }, { "s16f", 16 }, { "s8", 8 },
+   { "s16", 16 }, { "bw1", 1 }, { "a4", 4 }, { "a1", 1 }, { "rgba64", 64 }, { "rgba32r", 32 }, { "yuyv422r", 16 }
+};
+
+#define NUM_TEX_TYPES (sizeof(tex_types) / sizeof(tex_types[0]))
+
+static const char* wrap_names[] = { "repeat", "clamp", "mirror", "border" };
+
+static const char* min_filter_names[] = {
+   "linear", "nearest", "near_mip_near", "near_mip_lin", "lin_mip_near", "lin_mip_lin", "reserved6", "reserved7"
+};
+
+//Texels read per fetch for each min filter, mipmap filters with a linear
+//blend between levels read from two
+static const uint32_t min_filter_texels[] = { 4, 1, 1, 2, 4, 8, 1, 1 };
+
+const char* tex_type_name(uint32_t type) {
+   return type < NUM_TEX_TYPES ? tex_types[type].name : "unknown";
+}
+
+static uint32_t tex_bpp(uint32_t type) {
+   return type < NUM_TEX_TYPES ? tex_types[type].bpp : 0;
+}
+
+uint64_t tex_size(tex_config_t* tex) {
+   uint64_t bits = 0;
+   uint32_t level;
+
+   for(level = 0;level < tex->mip_levels; ++level) {
+      uint32_t width  = tex->width >> level ? tex->width >> level : 1;
+      uint32_t height = tex->height >> level ? tex->height >> level : 1;
+
+      bits += (uint64_t)width * height * tex_bpp(tex->type);
+   }
+
+   return (bits + 7) / 8 * (tex->cube ? 6 : 1);
+}
+
+double tex_fetch_bytes(tex_config_t* tex) {
+   uint32_t texels = min_filter_texels[tex->min_filter];
+   uint32_t mag_texels = tex->mag_filter ? 1 : 4;
+
+   if(mag_texels > texels)
+      texels = mag_texels;
+
+   return texels * tex_bpp(tex->type) / 8.0;
+}
+
+static void decode_tex_config(tex_config_t* tex) {
+   tex->base       = tex->p0 & 0xfffff000;
+   tex->cube       = (tex->p0 >> 9) & 0x1;
+   tex->type       = ((tex->p0 >> 4) & 0xf) | ((tex->p1 >> 31) << 4);
+   tex->mip_levels = (tex->p0 & 0xf) + 1;
+   tex->height     = (tex->p1 >> 20) & 0x7ff;
+   tex->width      = (tex->p1 >> 8) & 0x7ff;
+   tex->mag_filter = (tex->p1 >> 7) & 0x1;
+   tex->min_filter = (tex->p1 >> 4) & 0x7;
+   tex->wrap_t     = (tex->p1 >> 2) & 0x3;
+   tex->wrap_s     = tex->p1 & 0x3;
+
+   if(tex->height == 0)
+      tex->height = TEX_MAX_SIZE;
+   if(tex->width == 0)
+      tex->width = TEX_MAX_SIZE;
+}
+
+static uint32_t read_uniform(uint32_t* uniforms, uint32_t num_uniforms, uint32_t index) {
+   return uniforms && index < num_uniforms ? uniforms[index] : 0;
+}
+
+uint32_t tmu_coord_write(uint32_t waddr, uint32_t* other_coords) {
+   uint32_t tmu = waddr >= TMU1_S;
+
+   if(waddr != TMU0_S && waddr != TMU1_S) {
+      other_coords[tmu] = 1;
+      return TMU_WRITE_COORD;
+   }
+
+   if(!other_coords[tmu])
+      return TMU_WRITE_DIRECT;
+
+   other_coords[tmu] = 0;
+
+   return TMU_WRITE_LOOKUP;
+}
+
+uint32_t tex_config_params(uint32_t p0) {
+   return (p0 >> 9) & 0x1 ? 3 : 2;
+}
+
+static void tmu_write(qpu_unif_use_t* use, uint32_t waddr, uint32_t inst, uint32_t* other_coords,
+   uint32_t* uniforms, uint32_t num_uniforms) {
+   tex_config_t* tex;
+   uint32_t      tmu = waddr >= TMU1_S;
+
+   use->tmu_writes++;
+
+   switch(tmu_coord_write(waddr, other_coords)) {
+      case TMU_WRITE_COORD:
+         return;
+      case TMU_WRITE_DIRECT:
+         use->direct_lookups++;
+         return;
+   }
+
+   //Where the parameters are in the stream isn't known once it's moved
+   if(use->unif_addr_written)
+      return;
+
+   if(use->num_lookups++ >= MAX_TEX_LOOKUPS) {
+      use->uniforms_used += 2;
+      return;
+   }
+
+   tex = &use->lookups[use->num_lookups - 1];
+   tex->inst       = inst;
+   tex->tmu        = tmu;
+   tex->p0_index   = use->uniforms_used;
+   tex->p0         = read_uniform(uniforms, num_uniforms, tex->p0_index);
+   tex->p1         = read_uniform(uniforms, num_uniforms, tex->p0_index + 1);
+   tex->num_params = tex_config_params(tex->p0);
+
+   decode_tex_config(tex);
+
+   if(tex->num_params > 2)
+      tex->p2 = read_uniform(uniforms, num_uniforms, tex->p0_index + 2);
+
+   use->uniforms_used += tex->num_params;
+}
+
+int decode_qpu_uniforms(uint32_t code_addr, uint32_t uniforms_addr, uint32_t num_uniforms, qpu_unif_use_t* use) {
+   uint32_t* insts;
+   uint32_t* uniforms = 0;
+   uint32_t  mapped_size;
+   uint32_t  other_coords[2] = { 0, 0 };
+   uint32_t  i;
+
+   memset(use, 0, sizeof(qpu_unif_use_t));
+
+   insts = map_qpu_prog(code_addr, 0, &use->num_insts, &mapped_size);
+   if(!insts)
+      return 1;
+
+   if(uniforms_addr && num_uniforms) {
+      uniforms = map_area(uniforms_addr, num_uniforms * 4);
+      if(!uniforms)
+         fprintf(stderr, "Failed to map uniforms at %08x, reading them as 0\n", uniforms_addr);
+   }
+
+   for(i = 0;i < use->num_insts; ++i) {
+      qpu_inst_t d;
+      qpu_regs_t reads;
+      qpu_regs_t writes;
+      uint32_t   waddrs[2];
+      uint32_t   num_waddrs = 0;
+      uint32_t   j;
+
+      qpu_decode(&insts[i * 2], &d);
+      qpu_inst_regs(&d, &reads, &writes);
+
+      //Both read ports asking for a uniform still only pop one
+      if(reads.io & QPU_IO_UNIF) {
+         use->unif_reads++;
+         use->uniforms_used++;
+      }
+
+      if(qpu_add_active(&d))
+         waddrs[num_waddrs++] = d.waddr_add;
+      if(qpu_mul_active(&d))
+         waddrs[num_waddrs++] = d.waddr_mul;
+
+      for(j = 0;j < num_waddrs; ++j) {
+         if(waddrs[j] >= TMU0_S && waddrs[j] <= TMU1_B)
+            tmu_write(use, waddrs[j], i, other_coords, uniforms, num_uniforms);
+         else if(waddrs[j] == UNIFORMS_ADDR)
+            use->unif_addr_written = 1;
+      }
+   }
+
+   if(uniforms)
+      unmap_area(uniforms, num_uniforms * 4);
+   unmap_area(insts, mapped_size);
+
+   return 0;
+}
+
+//textures command
+
+typedef struct {
+   tex_config_t* textures;
+   uint32_t      num_textures;
+   uint32_t      max_textures;
+   uint64_t      total_bytes;
+   uint32_t      num_draws;
+} textures_state_t;
+
+static int same_texture(tex_config_t* a, tex_config_t* b) {
+   return a->base == b->base && tex_size(a) == tex_size(b);
+}
+
+static void add_frame_texture(textures_state_t* ts, tex_config_t* tex) {
+   uint32_t i;
+
+   for(i = 0;i < ts->num_textures; ++i) {
+      if(same_texture(&ts->textures[i], tex))
+         return;
+   }
+
+   if(ts->num_textures == ts->max_textures) {
+      ts->max_textures = ts->max_textures ? ts->max_textures * 2 : 16;
+      ts->textures = realloc(ts->textures, ts->max_textures * sizeof(tex_config_t));
+      assert(ts->textures);
+   }
+
+   ts->textures[ts->num_textures++] = *tex;
+   ts->total_bytes += tex_size(tex);
+}
+
+static void print_tex(tex_config_t* tex) {
+   printf("\t\ttmu%u lookup at %04x (uniforms %u-%u): %08x %s %ux%u%s, %u mip level%s, wrap %s/%s, "
+      "filter %s/%s\n", tex->tmu, tex->inst * 8, tex->p0_index, tex->p0_index + tex->num_params - 1, tex->base,
+      tex_type_name(tex->type), tex->width, tex->height, tex->cube ? " cube" : "", tex->mip_levels,
+      tex->mip_levels == 1 ? "" : "s", wrap_names[tex->wrap_s], wrap_names[tex->wrap_t],
+      min_filter_names[tex->min_filter], tex->mag_filter ? "nearest" : "linear");
+   printf("\t\t\t%llu bytes, %.1f bytes per fetch\n", (unsigned long long)tex_size(tex), tex_fetch_bytes(tex));
+}
+
+//Prints one shader's use of its uniforms and adds its textures to the draw's
+//list, returning the bytes fetched per invocation
+static double print_shader(const char* name, uint32_t code_addr, uint32_t uniforms_addr, uint32_t num_uniforms,
+   tex_config_t* draw_textures, uint32_t* num_draw_textures) {
+   qpu_unif_use_t use;
+   double         fetch_bytes = 0;
+   uint32_t       i;
+   uint32_t       j;
+
+   if(!code_addr)
+      return 0;
+
+   if(decode_qpu_uniforms(code_addr, uniforms_addr, num_uniforms, &use)) {
+      printf("\t%s: %08x could not be mapped\n", name, code_addr);
+      return 0;
+   }
+
+   printf("\t%s: %08x, uniforms %08x: %u unif reads, %u tmu writes, %u texture lookups, %u direct lookups\n",
+      name, code_addr, uniforms_addr, use.unif_reads, use.tmu_writes, use.num_lookups, use.direct_lookups);
+
+   if(use.uniforms_used != num_uniforms) {
+      printf("\t\tuses %u uniforms, the shader record gives %u\n", use.uniforms_used, num_uniforms);
+   }
+   if(use.unif_addr_written) {
+      printf("\t\twrites unif_addr, lookups after that aren't decoded\n");
+   }
+   if(use.num_lookups > MAX_TEX_LOOKUPS) {
+      printf("\t\tonly the first %u lookups are decoded\n", MAX_TEX_LOOKUPS);
+   }
+
+   for(i = 0;i < use.num_lookups && i < MAX_TEX_LOOKUPS; ++i) {
+      tex_config_t* tex = &use.lookups[i];
+
+      print_tex(tex);
+      fetch_bytes += tex_fetch_bytes(tex);
+
+      for(j = 0;j < *num_draw_textures; ++j) {
+         if(same_texture(&draw_textures[j], tex))
+            break;
+      }
+
+      if(j == *num_draw_textures)
+         draw_textures[(*num_draw_textures)++] = *tex;
+   }
+
+   return fetch_bytes;
+}
+
+static int textures_fn(void* ctx, cl_draw_t* draw) {
+   textures_state_t*      ts = ctx;
+   instr_SHADER_RECORD_t* rec = &draw->shader_rec;
+   tex_config_t           draw_textures[MAX_DRAW_TEXTURES];
+   uint32_t               num_draw_textures = 0;
+   uint64_t               draw_bytes = 0;
+   double                 fs_fetch;
+   double                 vs_fetch;
+   uint32_t               i;
+
+   ts->num_draws++;
+
+   printf("Draw %u at %08x: %s, %u primitives\n", draw->index, draw->addr, prim_mode_name(draw->prim_mode),
+      draw->num_prims);
+
+   if(!draw->shader_rec_addr) {
+      printf("\tno shader record\n\n");
+      return 0;
+   }
+
+   fs_fetch = print_shader("fs", rec->fs_code_addr, rec->fs_uniforms_addr, rec->fs_num_uniforms, draw_textures,
+      &num_draw_textures);
+   vs_fetch = print_shader("vs", rec->vs_code_addr, rec->vs_uniforms_addr, rec->vs_num_uniforms, draw_textures,
+      &num_draw_textures);
+   vs_fetch += print_shader("cs", rec->cs_code_addr, rec->cs_uniforms_addr, rec->cs_num_uniforms, draw_textures,
+      &num_draw_textures);
+
+   for(i = 0;i < num_draw_textures; ++i) {
+      draw_bytes += tex_size(&draw_textures[i]);
+      add_frame_texture(ts, &draw_textures[i]);
+   }
+
+   printf("\ttexture memory: %llu bytes in %u textures, %.1f bytes fetched per fragment, %.1f per vertex\n\n",
+      (unsigned long long)draw_bytes, num_draw_textures, fs_fetch, vs_fetch);
+
+   return 0;
+}
+
+int do_textures(char* start_addr_str, char* end_addr_str) {
+   textures_state_t ts;
+   uint32_t         cl_start;
+   uint32_t         cl_end;
+   int              ret;
+
+   if(parse_cl_range(start_addr_str, end_addr_str, &cl_start, &cl_end))
+      return 1;
+
+   memset(&ts, 0, sizeof(ts));
+
+   ret = walk_draws(cl_start, cl_end, textures_fn, &ts);
+
+   printf("%u draws, %u distinct textures, %llu bytes of texture memory\n", ts.num_draws, ts.num_textures,
+      (unsigned long long)ts.total_bytes);
+
+   free(ts.textures);
+
+   return ret;
+}
@@ -0,0 +1,69 @@
+#ifndef __CL_TEXTURES_H__
+#define __CL_TEXTURES_H__
+
+#include <stdint.h>
+
+//Texture lookups kept per program, further ones are only counted
+#define MAX_TEX_LOOKUPS 32
+
+#define TMU0_S 56
+#define TMU0_B 59
+#define TMU1_S 60
+#define TMU1_B 63
+
+//What a write to a TMU register does, from tmu_coord_write
+#define TMU_WRITE_COORD  0 //T, R or B, held until S is written
+#define TMU_WRITE_DIRECT 1 //S on its own, a direct memory lookup without config
+#define TMU_WRITE_LOOKUP 2 //S after other coordinates, a lookup taking config uniforms
+
+//Texture config parameters a lookup took from the uniform stream, decoded
+typedef struct {
+   uint32_t inst;          //Instruction writing the S coordinate
+   uint32_t tmu;
+   uint32_t p0_index;      //Uniform index of P0
+   uint32_t num_params;    //2, or 3 for cube maps
+   uint32_t p0;
+   uint32_t p1;
+   uint32_t p2;
+
+   uint32_t base;
+   uint32_t type;
+   uint32_t width;
+   uint32_t height;
+   uint32_t mip_levels;
+   uint32_t cube;
+   uint32_t wrap_s;
+   uint32_t wrap_t;
+   uint32_t min_filter;
+   uint32_t mag_filter;
+} tex_config_t;
+
+//How a QPU program consumes its uniform stream, followed in program order
+//(branches are not taken, so a lookup in a loop is seen once)
+typedef struct {
+   uint32_t     num_insts;
+   uint32_t     unif_reads;
+   uint32_t     tmu_writes;
+   uint32_t     direct_lookups;   //S written with no other coordinate, no config read
+   uint32_t     uniforms_used;    //Reads plus texture config parameters
+   int          unif_addr_written; //Stream moved, positions after that are unknown
+   uint32_t     num_lookups;
+   tex_config_t lookups[MAX_TEX_LOOKUPS];
+} qpu_unif_use_t;
+
+//Classifies a write to TMU register waddr (TMU0_S to TMU1_B), other_coords
+//holding whether each TMU has had coordinates other than S written since its
+//last S, both 0 at the start of a program
+uint32_t tmu_coord_write(uint32_t waddr, uint32_t* other_coords);
+//Config uniforms a lookup takes from the stream given its P0, 2 or 3 for cube maps
+uint32_t tex_config_params(uint32_t p0);
+//Decodes the program at code_addr against its uniform stream, uniforms past
+//num_uniforms (or all with no stream) read as 0
+int decode_qpu_uniforms(uint32_t code_addr, uint32_t uniforms_addr, uint32_t num_uniforms, qpu_unif_use_t* use);
+const char* tex_type_name(uint32_t type);
+//Bytes for every mip level (and face) ignoring tiling padding
+uint64_t tex_size(tex_config_t* tex);
+//Bytes read from memory for one fetch with the texture's filters
+double tex_fetch_bytes(tex_config_t* tex);
+
+#endif
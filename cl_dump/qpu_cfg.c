@@ -0,0 +1,685 @@
+/*
+ * qpu_cfg.c - Control flow graphs of QPU programs
+ *
+ * Splits each program used by the CL into basic blocks.  Branches take effect
+ * after their three delay slots, so a block ends with the branch's last delay
+ * slot (and a thread end's two).  Back edges found from the entry mark loops,
+ * whose trip count is worked out for the common counted form (a register
+ * loaded with ldi, decremented by a constant with setf and branched on while
+ * non-zero) or otherwise assumed.  Each block gets a static cycle estimate
+ * and the longest path through the program is found both straight-line (one
+ * trip round each loop) and weighted by the loop trip counts.
+ *
+ * Output is text or a DOT graph (a cluster per program) with back edges
+ * dashed and the critical path in bold.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cl_dump.h"
+#include "qpudis.h"
+
+#define FORMAT_TEXT 0
+#define FORMAT_DOT  1
+
+#define DEFAULT_LOOP_ITERS 8
+
+#define BRANCH_DELAY_SLOTS 3
+#define THREND_DELAY_SLOTS 2
+
+#define COND_ALWAYS 15
+#define COND_ALLNZ  1
+#define COND_ANYNZ  3
+
+#define ADDOP_ADD 12
+#define ADDOP_SUB 13
+
+//Add/mul mux value reading the regfile B read port (the small immediate)
+#define MUX_RB 7
+
+//Small immediates from 32 up are floats and mul output rotations
+#define SMALL_IMM_INTS 32
+
+//Accumulators a loop counter can live in, r4 and r5 are only written by side effect
+#define COUNTER_ACCS (QPU_ACC(0) | QPU_ACC(1) | QPU_ACC(2) | QPU_ACC(3))
+
+#define NO_BLOCK 0xffffffff
+
+typedef struct {
+   uint32_t start; //Instruction indices [start, end)
+   uint32_t end;
+   uint32_t succs[2];
+   int      back[2];        //Edge is a loop back edge
+   uint32_t num_succs;
+   int      unknown_target; //Branches to a register
+   int      exit;           //Ends the program
+   int      reachable;
+   int      on_stack;
+   uint32_t cycles;
+   uint32_t loop_depth;
+   uint64_t exec_count;     //Times run per invocation from the loop trip counts
+
+   uint64_t dist;           //Longest path from the entry ending here
+   uint64_t flat_dist;      //As dist with every block run once
+   uint32_t path_pred;
+   int      critical;
+} cfg_block_t;
+
+typedef struct {
+   uint32_t head;
+   uint32_t tail;           //Last block with a back edge to the head
+   uint32_t num_tails;
+   uint32_t num_blocks;
+   uint32_t trip_count;
+   int      counted;        //trip_count worked out rather than assumed
+   uint32_t counter_init;   //Instruction loading the counter when counted
+} cfg_loop_t;
+
+typedef struct {
+   qpu_prog_t*  prog;
+   qpu_inst_t*  insts;
+   uint32_t     num_insts;
+   uint32_t*    block_of;
+
+   cfg_block_t* blocks;
+   uint32_t     num_blocks;
+   cfg_loop_t*  loops;
+   uint32_t     num_loops;
+   uint32_t     max_loops;
+   uint32_t*    order; //Reverse postorder of the reachable blocks
+   uint32_t     num_order;
+} qpu_cfg_t;
+
+typedef struct {
+   int      format;
+   uint32_t loop_iters;
+   uint32_t programs;
+   uint32_t loops;
+} cfg_options_t;
+
+static int is_branch(qpu_cfg_t* cfg, int32_t i) {
+   return i >= 0 && (uint32_t)i < cfg->num_insts && cfg->insts[i].sig == QPU_SIG_BRANCH;
+}
+
+static int is_thrend(qpu_cfg_t* cfg, int32_t i) {
+   return i >= 0 && (uint32_t)i < cfg->num_insts && cfg->insts[i].sig == QPU_SIG_THREND;
+}
+
+//Instruction index a branch lands on, -1 for register branches or targets
+//outside the program
+static int32_t branch_target(qpu_cfg_t* cfg, uint32_t i) {
+   qpu_inst_t* inst = &cfg->insts[i];
+   int64_t     target;
+
+   if(inst->addreg)
+      return -1;
+
+   //Relative branches are from the instruction after the delay slots
+   if(inst->pcrel)
+      target = (int64_t)(i + BRANCH_DELAY_SLOTS + 1) * 8 + (int32_t)inst->imm;
+   else
+      target = (int64_t)inst->imm - cfg->prog->addr;
+
+   if(target < 0 || (target & 7) || target / 8 >= cfg->num_insts)
+      return -1;
+
+   return target / 8;
+}
+
+static void add_succ(qpu_cfg_t* cfg, cfg_block_t* block, uint32_t inst) {
+   if(inst < cfg->num_insts)
+      block->succs[block->num_succs++] = cfg->block_of[inst];
+   else
+      block->exit = 1;
+}
+
+static int build_blocks(qpu_cfg_t* cfg) {
+   uint8_t* leader;
+   uint32_t i;
+   uint32_t b;
+
+   leader = calloc(cfg->num_insts + BRANCH_DELAY_SLOTS + 2, 1);
+   cfg->block_of = calloc(cfg->num_insts, sizeof(uint32_t));
+   cfg->blocks = calloc(cfg->num_insts, sizeof(cfg_block_t));
+   if(!leader || !cfg->block_of || !cfg->blocks) {
+      free(leader);
+      return 1;
+   }
+
+   leader[0] = 1;
+
+   for(i = 0;i < cfg->num_insts; ++i) {
+      if(is_branch(cfg, i)) {
+         int32_t target = branch_target(cfg, i);
+
+         leader[i + BRANCH_DELAY_SLOTS + 1] = 1;
+         if(target >= 0)
+            leader[target] = 1;
+      } else if(is_thrend(cfg, i)) {
+         leader[i + THREND_DELAY_SLOTS + 1] = 1;
+      }
+   }
+
+   for(i = 0;i < cfg->num_insts; ++i) {
+      if(leader[i]) {
+         cfg->blocks[cfg->num_blocks].start = i;
+         cfg->num_blocks++;
+      }
+
+      cfg->block_of[i] = cfg->num_blocks - 1;
+      cfg->blocks[cfg->num_blocks - 1].end = i + 1;
+   }
+
+   free(leader);
+
+   //A block ending in the last delay slot of a branch or thread end takes its
+   //control flow, anything else falls through
+   for(b = 0;b < cfg->num_blocks; ++b) {
+      cfg_block_t* block = &cfg->blocks[b];
+      int32_t      br = (int32_t)block->end - BRANCH_DELAY_SLOTS - 1;
+
+      block->cycles     = (block->end - block->start) * QPU_CYCLES_PER_INSTR;
+      block->path_pred  = NO_BLOCK;
+      block->exec_count = 1;
+
+      if(is_branch(cfg, br)) {
+         int32_t target = branch_target(cfg, br);
+
+         if(target >= 0)
+            add_succ(cfg, block, target);
+         else
+            block->unknown_target = 1;
+
+         if(cfg->insts[br].cond != COND_ALWAYS)
+            add_succ(cfg, block, block->end);
+      } else if(is_thrend(cfg, (int32_t)block->end - THREND_DELAY_SLOTS - 1)) {
+         block->exit = 1;
+      } else {
+         add_succ(cfg, block, block->end);
+      }
+   }
+
+   return 0;
+}
+
+//Depth first from the entry, recording the postorder and marking edges to
+//blocks still on the stack as back edges
+static void dfs(qpu_cfg_t* cfg, uint32_t b) {
+   cfg_block_t* block = &cfg->blocks[b];
+   uint32_t     i;
+
+   block->reachable = 1;
+   block->on_stack  = 1;
+
+   for(i = 0;i < block->num_succs; ++i) {
+      cfg_block_t* succ = &cfg->blocks[block->succs[i]];
+
+      if(succ->on_stack)
+         block->back[i] = 1;
+      else if(!succ->reachable)
+         dfs(cfg, block->succs[i]);
+   }
+
+   block->on_stack = 0;
+   cfg->order[cfg->num_order++] = b;
+}
+
+//Keeps only the registers a loop counter can be in
+static void counter_regs(qpu_regs_t* regs) {
+   regs->acc &= COUNTER_ACCS;
+   regs->io   = 0;
+}
+
+static int writes_reg(const qpu_inst_t* inst, const qpu_regs_t* reg) {
+   qpu_regs_t reads;
+   qpu_regs_t writes;
+
+   qpu_inst_regs(inst, &reads, &writes);
+
+   return (writes.ra & reg->ra) || (writes.rb & reg->rb) || (writes.acc & reg->acc);
+}
+
+static int32_t small_imm_value(uint32_t raddr_b) {
+   return raddr_b < 16 ? (int32_t)raddr_b : (int32_t)raddr_b - 32;
+}
+
+//Trip count of a loop ending in a branch while non-zero on flags set by
+//reg -= k (reg += -k), with reg loaded by ldi before the loop.  Returns 0 if
+//the loop isn't of that form.
+static uint32_t counted_trip_count(qpu_cfg_t* cfg, cfg_loop_t* loop) {
+   int32_t     br = (int32_t)cfg->blocks[loop->tail].end - BRANCH_DELAY_SLOTS - 1;
+   uint32_t    head_start = cfg->blocks[loop->head].start;
+   qpu_inst_t* setf = 0;
+   uint32_t    setf_index = 0;
+   qpu_inst_t  add_only;
+   qpu_regs_t  reads;
+   qpu_regs_t  reg;
+   int32_t     step;
+   uint32_t    init;
+   int32_t     i;
+
+   //Back edges can also be fall throughs
+   if(!is_branch(cfg, br) || (cfg->insts[br].cond != COND_ALLNZ && cfg->insts[br].cond != COND_ANYNZ))
+      return 0;
+
+   for(i = br - 1;i >= (int32_t)head_start; --i) {
+      if(cfg->insts[i].sig != QPU_SIG_BRANCH && cfg->insts[i].sig != QPU_SIG_LDI && cfg->insts[i].sf) {
+         setf = &cfg->insts[i];
+         setf_index = i;
+         break;
+      }
+   }
+
+   //The flags come from the add pipe when it's active, and the step has to
+   //be an integer immediate
+   if(!setf || !qpu_add_active(setf) || setf->sig != QPU_SIG_SMALL_IMM || setf->addb != MUX_RB ||
+      setf->raddr_b >= SMALL_IMM_INTS)
+      return 0;
+
+   step = small_imm_value(setf->raddr_b);
+   if(setf->addop == ADDOP_SUB)
+      step = -step;
+   else if(setf->addop != ADDOP_ADD)
+      return 0;
+
+   //The counter is the one register the add pipe both reads and writes,
+   //looked at without the mul pipe's registers
+   add_only       = *setf;
+   add_only.mulop = 0;
+   qpu_inst_regs(&add_only, &reads, &reg);
+   counter_regs(&reads);
+   counter_regs(&reg);
+
+   if(step >= 0 || reads.ra != reg.ra || reads.rb != reg.rb || reads.acc != reg.acc ||
+      __builtin_popcount(reg.ra) + __builtin_popcount(reg.rb) + __builtin_popcount(reg.acc) != 1)
+      return 0;
+
+   //Nothing else in the loop may touch the counter
+   for(i = head_start;i <= br; ++i) {
+      if(i != (int32_t)setf_index && writes_reg(&cfg->insts[i], &reg))
+         return 0;
+   }
+
+   for(i = head_start - 1;i >= 0; --i) {
+      if(writes_reg(&cfg->insts[i], &reg))
+         break;
+   }
+
+   if(i < 0 || cfg->insts[i].sig != QPU_SIG_LDI || ((cfg->insts[i].i1 >> 25) & 0x7) != 0)
+      return 0;
+
+   init = cfg->insts[i].imm;
+   if(init == 0 || init % -step != 0)
+      return 0;
+
+   loop->counter_init = i;
+
+   return init / -step;
+}
+
+//Back edges sharing a head (a continue as well as the loop end branch) make
+//one loop, so its body is only scaled by the trip count once
+static void add_loop(qpu_cfg_t* cfg, uint32_t head, uint32_t assumed_iters) {
+   cfg_loop_t* loop;
+   uint8_t*    body;
+   uint32_t*   work;
+   uint32_t    num_work = 0;
+   uint32_t    b;
+   uint32_t    i;
+
+   if(cfg->num_loops == cfg->max_loops) {
+      cfg_loop_t* grown;
+
+      cfg->max_loops = cfg->max_loops ? cfg->max_loops * 2 : 8;
+      grown = realloc(cfg->loops, cfg->max_loops * sizeof(cfg_loop_t));
+      if(!grown)
+         return;
+      cfg->loops = grown;
+   }
+
+   body = calloc(cfg->num_blocks, 1);
+   work = calloc(cfg->num_blocks, sizeof(uint32_t));
+   if(!body || !work) {
+      free(body);
+      free(work);
+      return;
+   }
+
+   loop = &cfg->loops[cfg->num_loops++];
+   memset(loop, 0, sizeof(cfg_loop_t));
+   loop->head = head;
+
+   //The body is everything reaching a tail without going through the head
+   body[head] = 1;
+   for(b = 0;b < cfg->num_blocks; ++b) {
+      for(i = 0;i < cfg->blocks[b].num_succs; ++i) {
+         if(cfg->blocks[b].back[i] && cfg->blocks[b].succs[i] == head)
+            break;
+      }
+
+      if(i == cfg->blocks[b].num_succs)
+         continue;
+
+      loop->tail = b;
+      loop->num_tails++;
+      if(!body[b]) {
+         body[b] = 1;
+         work[num_work++] = b;
+      }
+   }
+
+   while(num_work) {
+      uint32_t x = work[--num_work];
+
+      for(b = 0;b < cfg->num_blocks; ++b) {
+         if(body[b] || !cfg->blocks[b].reachable)
+            continue;
+
+         for(i = 0;i < cfg->blocks[b].num_succs; ++i) {
+            if(cfg->blocks[b].succs[i] == x) {
+               body[b] = 1;
+               work[num_work++] = b;
+               break;
+            }
+         }
+      }
+   }
+
+   //A counter decremented on one path round the loop says nothing of the others
+   loop->trip_count = loop->num_tails == 1 ? counted_trip_count(cfg, loop) : 0;
+   loop->counted    = loop->trip_count != 0;
+   if(!loop->counted)
+      loop->trip_count = assumed_iters;
+
+   for(b = 0;b < cfg->num_blocks; ++b) {
+      if(!body[b])
+         continue;
+
+      loop->num_blocks++;
+      cfg->blocks[b].loop_depth++;
+      cfg->blocks[b].exec_count *= loop->trip_count;
+   }
+
+   free(body);
+   free(work);
+}
+
+static void find_loops(qpu_cfg_t* cfg, uint32_t assumed_iters) {
+   uint8_t* is_head;
+   uint32_t b;
+   uint32_t i;
+
+   is_head = calloc(cfg->num_blocks, 1);
+   if(!is_head)
+      return;
+
+   for(b = 0;b < cfg->num_blocks; ++b) {
+      for(i = 0;i < cfg->blocks[b].num_succs; ++i) {
+         if(cfg->blocks[b].back[i])
+            is_head[cfg->blocks[b].succs[i]] = 1;
+      }
+   }
+
+   for(b = 0;b < cfg->num_blocks; ++b) {
+      if(is_head[b])
+         add_loop(cfg, b, assumed_iters);
+   }
+
+   free(is_head);
+}
+
+//Longest paths over the graph without its back edges, visited in reverse
+//postorder so every block's predecessors are done first.  Returns the block
+//ending the weighted critical path.
+static uint32_t longest_path(qpu_cfg_t* cfg) {
+   uint32_t last = NO_BLOCK;
+   int32_t  o;
+   uint32_t i;
+
+   for(o = cfg->num_order - 1;o >= 0; --o) {
+      cfg_block_t* block = &cfg->blocks[cfg->order[o]];
+      uint64_t     cost = block->cycles * block->exec_count;
+
+      if(cfg->order[o] == 0) {
+         block->dist      = cost;
+         block->flat_dist = block->cycles;
+      }
+
+      if(last == NO_BLOCK || block->dist > cfg->blocks[last].dist)
+         last = cfg->order[o];
+
+      for(i = 0;i < block->num_succs; ++i) {
+         cfg_block_t* succ = &cfg->blocks[block->succs[i]];
+
+         if(block->back[i])
+            continue;
+
+         if(block->dist + succ->cycles * succ->exec_count > succ->dist) {
+            succ->dist      = block->dist + succ->cycles * succ->exec_count;
+            succ->path_pred = cfg->order[o];
+         }
+         if(block->flat_dist + succ->cycles > succ->flat_dist)
+            succ->flat_dist = block->flat_dist + succ->cycles;
+      }
+   }
+
+   for(i = last;i != NO_BLOCK; i = cfg->blocks[i].path_pred) {
+      cfg->blocks[i].critical = 1;
+   }
+
+   return last;
+}
+
+static uint64_t max_flat_dist(qpu_cfg_t* cfg) {
+   uint64_t best = 0;
+   uint32_t b;
+
+   for(b = 0;b < cfg->num_blocks; ++b) {
+      if(cfg->blocks[b].reachable && cfg->blocks[b].flat_dist > best)
+         best = cfg->blocks[b].flat_dist;
+   }
+
+   return best;
+}
+
+static void print_text(qpu_cfg_t* cfg, uint32_t last) {
+   qpu_prog_t* prog = cfg->prog;
+   uint32_t    b;
+   uint32_t    i;
+
+   printf("QPU Program Addr: %08x (%s shader, %u instructions, %u blocks)\n", prog->addr,
+      qpu_prog_type_name(prog->type), cfg->num_insts, cfg->num_blocks);
+   printf("--------------------------\n");
+
+   for(b = 0;b < cfg->num_blocks; ++b) {
+      cfg_block_t* block = &cfg->blocks[b];
+
+      printf("block %u: %08x-%08x, %u instructions, %u cycles", b, prog->addr + block->start * 8,
+         prog->addr + block->end * 8 - 1, block->end - block->start, block->cycles);
+
+      if(!block->reachable) {
+         printf(", unreachable\n");
+         continue;
+      }
+
+      if(block->loop_depth)
+         printf(", loop depth %u, runs %llux", block->loop_depth, (unsigned long long)block->exec_count);
+
+      printf(" ->");
+      for(i = 0;i < block->num_succs; ++i) {
+         printf(" %u%s", block->succs[i], block->back[i] ? " (back)" : "");
+      }
+      if(block->unknown_target)
+         printf(" (register branch)");
+      if(block->exit)
+         printf(" exit");
+      printf("\n");
+   }
+
+   for(i = 0;i < cfg->num_loops; ++i) {
+      cfg_loop_t* loop = &cfg->loops[i];
+
+      printf("loop: block %u back to block %u, ", loop->tail, loop->head);
+      if(loop->num_tails > 1)
+         printf("%u back edges, ", loop->num_tails);
+      printf("%u blocks, ", loop->num_blocks);
+      if(loop->counted) {
+         printf("%u iterations (counter loaded at %08x)\n", loop->trip_count,
+            prog->addr + loop->counter_init * 8);
+      } else {
+         printf("%u iterations assumed\n", loop->trip_count);
+      }
+   }
+
+   printf("critical path:");
+   for(b = 0;b < cfg->num_blocks; ++b) {
+      if(cfg->blocks[b].critical)
+         printf(" %u", b);
+   }
+   printf("\n");
+
+   printf("longest path: %llu cycles straight-line, %llu cycles with loop iterations\n\n",
+      (unsigned long long)max_flat_dist(cfg), (unsigned long long)(last != NO_BLOCK ? cfg->blocks[last].dist : 0));
+}
+
+static void print_dot(qpu_cfg_t* cfg) {
+   qpu_prog_t* prog = cfg->prog;
+   uint32_t    b;
+   uint32_t    i;
+
+   printf("  subgraph cluster_%08x {\n", prog->addr);
+   printf("    label=\"%08x %s shader\";\n", prog->addr, qpu_prog_type_name(prog->type));
+
+   for(b = 0;b < cfg->num_blocks; ++b) {
+      cfg_block_t* block = &cfg->blocks[b];
+
+      printf("    p%08x_b%u [label=\"%08x-%08x\\n%u cycles", prog->addr, b, prog->addr + block->start * 8,
+         prog->addr + block->end * 8 - 1, block->cycles);
+      if(block->exec_count > 1)
+         printf(" x%llu", (unsigned long long)block->exec_count);
+      printf("\"%s%s];\n", block->critical ? ", style=bold" : "", block->reachable ? "" : ", color=grey");
+
+      if(block->exit || block->unknown_target) {
+         printf("    p%08x_b%u -> p%08x_%s%u;\n", prog->addr, b, prog->addr, block->exit ? "exit" : "unknown", b);
+         printf("    p%08x_%s%u [shape=point];\n", prog->addr, block->exit ? "exit" : "unknown", b);
+      }
+
+      for(i = 0;i < block->num_succs; ++i) {
+         cfg_block_t* succ = &cfg->blocks[block->succs[i]];
+         int          critical = block->critical && succ->critical && succ->path_pred == b;
+
+         printf("    p%08x_b%u -> p%08x_b%u%s;\n", prog->addr, b, prog->addr, block->succs[i],
+            block->back[i] ? " [style=dashed]" : critical ? " [style=bold]" : "");
+      }
+   }
+
+   printf("  }\n");
+}
+
+static int cfg_prog_fn(void* ctx, qpu_prog_t* prog) {
+   cfg_options_t* opts = ctx;
+   qpu_cfg_t      cfg;
+   uint32_t       last;
+   uint32_t       i;
+   int            ret = 1;
+
+   memset(&cfg, 0, sizeof(cfg));
+   cfg.prog      = prog;
+   cfg.num_insts = prog->num_insts;
+
+   if(!cfg.num_insts)
+      return 0;
+
+   cfg.insts = calloc(cfg.num_insts, sizeof(qpu_inst_t));
+   if(!cfg.insts)
+      goto out;
+
+   for(i = 0;i < cfg.num_insts; ++i) {
+      qpu_decode(&prog->insts[i * 2], &cfg.insts[i]);
+   }
+
+   if(build_blocks(&cfg))
+      goto out;
+
+   cfg.order = calloc(cfg.num_blocks, sizeof(uint32_t));
+   if(!cfg.order)
+      goto out;
+
+   dfs(&cfg, 0);
+   find_loops(&cfg, opts->loop_iters);
+   last = longest_path(&cfg);
+
+   if(opts->format == FORMAT_DOT)
+      print_dot(&cfg);
+   else
+      print_text(&cfg, last);
+
+   opts->programs++;
+   opts->loops += cfg.num_loops;
+   ret = 0;
+
+out:
+   if(ret)
+      fprintf(stderr, "Out of memory building the CFG of %08x\n", prog->addr);
+
+   free(cfg.insts);
+   free(cfg.block_of);
+   free(cfg.blocks);
+   free(cfg.loops);
+   free(cfg.order);
+
+   return ret;
+}
+
+int do_cfg(int argc, char* argv[]) {
+   cfg_options_t opts;
+   uint32_t      start_addr;
+   uint32_t      end_addr;
+   int           ret;
+   int           i;
+
+   memset(&opts, 0, sizeof(opts));
+   opts.format     = FORMAT_TEXT;
+   opts.loop_iters = DEFAULT_LOOP_ITERS;
+
+   if(argc < 2 || parse_cl_range(argv[0], argv[1], &start_addr, &end_addr))
+      return 1;
+
+   for(i = 2;i < argc; ++i) {
+      if(strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+         ++i;
+         if(strcmp(argv[i], "text") == 0) {
+            opts.format = FORMAT_TEXT;
+         } else if(strcmp(argv[i], "dot") == 0) {
+            opts.format = FORMAT_DOT;
+         } else {
+            fprintf(stderr, "Unknown format %s\n", argv[i]);
+            return 1;
+         }
+      } else if(strcmp(argv[i], "--loop-iters") == 0 && i + 1 < argc) {
+         opts.loop_iters = atoi(argv[++i]);
+         if(opts.loop_iters == 0)
+            opts.loop_iters = 1;
+      } else {
+         fprintf(stderr, "Unknown cfg option %s\n", argv[i]);
+         return 1;
+      }
+   }
+
+   if(opts.format == FORMAT_DOT) {
+      printf("digraph qpu_cfg {\n");
+      printf("  node [shape=box];\n");
+   }
+
+   ret = for_each_qpu_prog(start_addr, end_addr, 0, cfg_prog_fn, &opts);
+
+   if(opts.format == FORMAT_DOT)
+      printf("}\n");
+   else
+      printf("%u programs, %u loops\n", opts.programs, opts.loops);
+
+   return ret;
+}
@@ -0,0 +1,300 @@
+/*
+ * qpu_hazards.c - Finds QPU pipeline hazards and the stalls they cost
+ *
+ * Goes through each program used by the CL in order checking the V3D
+ * latency rules:
+ *
+ * - r4 holds an SFU result 2 instructions after the SFU write, reading it
+ *   sooner stalls for the remainder
+ * - ldtmu writes r4 at the end of its instruction, reading r4 in the same
+ *   instruction gets the old value
+ * - a regfile location can't be read in the instruction after it is written
+ * - ldtmu waits for its lookup, popping a result fewer than TMU_LATENCY
+ *   instructions after the lookup stalls for the difference
+ * - a TMU queues at most TMU_FIFO_DEPTH lookups, more without an ldtmu in
+ *   between blocks until the oldest returns, and an ldtmu with nothing queued
+ *   never returns
+ * - the tile buffer can't be accessed before sbwait
+ *
+ * Branches aren't followed, so hazards across a taken branch are missed.
+ * Stalls are counted in instructions and reported as cycles.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "cl_dump.h"
+#include "qpudis.h"
+
+#define SFU_LATENCY 2
+//Instructions from a lookup to its result for a TMU cache hit
+#define TMU_LATENCY    8
+#define TMU_FIFO_DEPTH 4
+
+#define SFU_RECIP 52
+#define SFU_LOG   55
+
+#define TMU0_S 56
+#define TMU1_S 60
+
+#define NO_INST -1
+
+#define HAZARD_SFU_R4    0
+#define HAZARD_LDTMU_R4  1
+#define HAZARD_REGFILE   2
+#define HAZARD_TMU_WAIT  3
+#define HAZARD_TMU_FULL  4
+#define HAZARD_TMU_EMPTY 5
+#define HAZARD_SBWAIT    6
+#define NUM_HAZARDS      7
+
+static const char* hazard_names[NUM_HAZARDS] = {
+   "r4 after sfu", "r4 with ldtmu", "regfile read after write", "ldtmu latency", "tmu fifo overflow",
+   "ldtmu without lookup", "tlb before sbwait"
+};
+
+typedef struct {
+   int32_t lookups[TMU_FIFO_DEPTH + 1]; //Instruction of each queued lookup, oldest first
+   int32_t num_lookups;
+} tmu_queue_t;
+
+typedef struct {
+   qpu_prog_t* prog;
+
+   int32_t     last_sfu;
+   uint32_t    last_sfu_waddr;
+   qpu_regs_t  prev_writes;
+   tmu_queue_t tmus[2];
+   int         sbwait_seen;
+   int         tlb_reported;
+
+   uint32_t    counts[NUM_HAZARDS];
+   uint32_t    stalls;
+} hazard_state_t;
+
+typedef struct {
+   uint32_t programs;
+   uint32_t insts;
+   uint32_t counts[NUM_HAZARDS];
+   uint32_t stalls;
+} hazard_totals_t;
+
+//Prints the hazard and the instruction it's at, stall is in instructions
+static void report(hazard_state_t* hs, uint32_t i, uint32_t type, uint32_t stall, const char* fmt, ...) {
+   char    line[QPU_FMT_LINE_MAX];
+   va_list args;
+
+   printf("%08x: %s: ", hs->prog->addr + i * 8, hazard_names[type]);
+
+   va_start(args, fmt);
+   vprintf(fmt, args);
+   va_end(args);
+
+   if(stall)
+      printf(", stalls %u cycles\n", stall * QPU_CYCLES_PER_INSTR);
+   else
+      printf("\n");
+
+   qpu_format_line(line, &hs->prog->insts[i * 2], i * 8);
+   printf("   %s", line);
+
+   hs->counts[type]++;
+   hs->stalls += stall;
+}
+
+static int lowest_bit(uint32_t mask) {
+   return __builtin_ctz(mask);
+}
+
+static void check_r4(hazard_state_t* hs, uint32_t i, const qpu_inst_t* inst, const qpu_regs_t* reads) {
+   int32_t distance;
+
+   if(!(reads->acc & QPU_ACC(4)))
+      return;
+
+   if(inst->sig == QPU_SIG_LDTMU0 || inst->sig == QPU_SIG_LDTMU1) {
+      report(hs, i, HAZARD_LDTMU_R4, 1, "%s reads r4 before the result lands in it", ops[inst->sig]);
+      return;
+   }
+
+   if(hs->last_sfu == NO_INST)
+      return;
+
+   distance = i - hs->last_sfu;
+   if(distance <= SFU_LATENCY) {
+      report(hs, i, HAZARD_SFU_R4, SFU_LATENCY + 1 - distance, "r4 read %d instruction%s after %s at %08x",
+         distance, distance == 1 ? "" : "s", banka_w[hs->last_sfu_waddr], hs->prog->addr + hs->last_sfu * 8);
+   }
+}
+
+static void check_regfile(hazard_state_t* hs, uint32_t i, const qpu_regs_t* reads) {
+   uint32_t ra = reads->ra & hs->prev_writes.ra;
+   uint32_t rb = reads->rb & hs->prev_writes.rb;
+
+   if(i == 0)
+      return;
+
+   if(ra)
+      report(hs, i, HAZARD_REGFILE, 1, "%s read in the instruction after it's written", banka_r[lowest_bit(ra)]);
+   if(rb)
+      report(hs, i, HAZARD_REGFILE, 1, "%s read in the instruction after it's written", bankb_r[lowest_bit(rb)]);
+}
+
+static void tmu_lookup(hazard_state_t* hs, uint32_t i, uint32_t tmu) {
+   tmu_queue_t* queue = &hs->tmus[tmu];
+
+   if(queue->num_lookups == TMU_FIFO_DEPTH) {
+      int32_t waited = i - queue->lookups[0];
+
+      report(hs, i, HAZARD_TMU_FULL, waited < TMU_LATENCY ? TMU_LATENCY - waited : 0,
+         "lookup %u on tmu%u with %u already queued", TMU_FIFO_DEPTH + 1, tmu, TMU_FIFO_DEPTH);
+
+      //Assume the oldest drains to make room
+      memmove(&queue->lookups[0], &queue->lookups[1], (TMU_FIFO_DEPTH - 1) * sizeof(int32_t));
+      queue->num_lookups--;
+   }
+
+   queue->lookups[queue->num_lookups++] = i;
+}
+
+static void tmu_load(hazard_state_t* hs, uint32_t i, uint32_t tmu) {
+   tmu_queue_t* queue = &hs->tmus[tmu];
+   int32_t      waited;
+
+   if(queue->num_lookups == 0) {
+      report(hs, i, HAZARD_TMU_EMPTY, 0, "%s with no lookup queued on tmu%u", ops[QPU_SIG_LDTMU0 + tmu], tmu);
+      return;
+   }
+
+   waited = i - queue->lookups[0];
+   if(waited < TMU_LATENCY) {
+      report(hs, i, HAZARD_TMU_WAIT, TMU_LATENCY - waited, "%s %d instructions after its lookup at %08x",
+         ops[QPU_SIG_LDTMU0 + tmu], waited, hs->prog->addr + queue->lookups[0] * 8);
+   }
+
+   memmove(&queue->lookups[0], &queue->lookups[1], (queue->num_lookups - 1) * sizeof(int32_t));
+   queue->num_lookups--;
+}
+
+static void check_inst(hazard_state_t* hs, uint32_t i) {
+   qpu_inst_t d;
+   qpu_regs_t reads;
+   qpu_regs_t writes;
+   uint32_t   waddrs[2];
+   uint32_t   num_waddrs = 0;
+   uint32_t   j;
+
+   qpu_decode(&hs->prog->insts[i * 2], &d);
+   qpu_inst_regs(&d, &reads, &writes);
+
+   check_r4(hs, i, &d, &reads);
+   check_regfile(hs, i, &reads);
+
+   if(d.sig == QPU_SIG_SBWAIT)
+      hs->sbwait_seen = 1;
+
+   //sbwait and sbdone count as tile buffer accesses to qpu_inst_regs
+   if(((reads.io | writes.io) & QPU_IO_TLB) && d.sig != QPU_SIG_SBWAIT && d.sig != QPU_SIG_SBDONE &&
+      !hs->sbwait_seen && !hs->tlb_reported) {
+      report(hs, i, HAZARD_SBWAIT, 0, "tile buffer accessed without a preceding sbwait");
+      hs->tlb_reported = 1;
+   }
+
+   if(d.sig == QPU_SIG_LDTMU0 || d.sig == QPU_SIG_LDTMU1)
+      tmu_load(hs, i, d.sig - QPU_SIG_LDTMU0);
+
+   if(qpu_add_active(&d))
+      waddrs[num_waddrs++] = d.waddr_add;
+   if(qpu_mul_active(&d))
+      waddrs[num_waddrs++] = d.waddr_mul;
+
+   for(j = 0;j < num_waddrs; ++j) {
+      if(waddrs[j] == TMU0_S || waddrs[j] == TMU1_S)
+         tmu_lookup(hs, i, waddrs[j] == TMU1_S);
+
+      if(waddrs[j] >= SFU_RECIP && waddrs[j] <= SFU_LOG) {
+         hs->last_sfu       = i;
+         hs->last_sfu_waddr = waddrs[j];
+      }
+   }
+
+   hs->prev_writes = writes;
+}
+
+static void print_counts(const uint32_t* counts) {
+   uint32_t t;
+   int      any = 0;
+
+   for(t = 0;t < NUM_HAZARDS; ++t) {
+      if(!counts[t])
+         continue;
+
+      printf("%s%u %s", any ? ", " : "", counts[t], hazard_names[t]);
+      any = 1;
+   }
+
+   printf("%s\n", any ? "" : "no hazards");
+}
+
+static int hazards_prog_fn(void* ctx, qpu_prog_t* prog) {
+   hazard_totals_t* totals = ctx;
+   hazard_state_t   hs;
+   uint32_t         i;
+   uint32_t         t;
+
+   memset(&hs, 0, sizeof(hs));
+   hs.prog     = prog;
+   hs.last_sfu = NO_INST;
+
+   printf("QPU Program Addr: %08x (%s shader, %u instructions)\n", prog->addr, qpu_prog_type_name(prog->type),
+      prog->num_insts);
+   printf("--------------------------\n");
+
+   for(i = 0;i < prog->num_insts; ++i) {
+      check_inst(&hs, i);
+   }
+
+   for(t = 0;t < 2; ++t) {
+      if(hs.tmus[t].num_lookups) {
+         printf("%u lookups on tmu%u never read back with ldtmu\n", hs.tmus[t].num_lookups, t);
+      }
+   }
+
+   print_counts(hs.counts);
+   printf("Stalls: %u cycles over %u instructions (%u cycles)\n\n", hs.stalls * QPU_CYCLES_PER_INSTR,
+      prog->num_insts, prog->num_insts * QPU_CYCLES_PER_INSTR);
+
+   totals->programs++;
+   totals->insts  += prog->num_insts;
+   totals->stalls += hs.stalls;
+   for(t = 0;t < NUM_HAZARDS; ++t) {
+      totals->counts[t] += hs.counts[t];
+   }
+
+   return 0;
+}
+
+int do_hazards(char* start_addr_str, char* end_addr_str) {
+   hazard_totals_t totals;
+   uint32_t        start_addr;
+   uint32_t        end_addr;
+   int             ret;
+
+   if(parse_cl_range(start_addr_str, end_addr_str, &start_addr, &end_addr))
+      return 1;
+
+   memset(&totals, 0, sizeof(totals));
+
+   ret = for_each_qpu_prog(start_addr, end_addr, 0, hazards_prog_fn, &totals);
+
+   printf("Summary\n");
+   printf("-------\n");
+   printf("%u programs, %u instructions\n", totals.programs, totals.insts);
+   print_counts(totals.counts);
+   printf("Stalls: %u cycles\n", totals.stalls * QPU_CYCLES_PER_INSTR);
+
+   return ret;
+}
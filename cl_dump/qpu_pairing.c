@@ -0,0 +1,533 @@
+/*
+ * qpu_pairing.c - Finds QPU instructions that could be dual-issued and nops
+ * that could be filled
+ *
+ * Every QPU instruction has an add and a mul slot but compilers often leave
+ * one of them idle.  For each program used by the CL this looks for adjacent
+ * instructions using only one pipe each that could be merged into one, and for
+ * nops (waiting out register file or SFU latency, or sitting in branch and
+ * thread end delay slots) that a nearby independent instruction could take the
+ * place of.  Each merge or fill saves one cycle per execution of the
+ * instruction.
+ *
+ * The checks are conservative: instructions touching peripherals are never
+ * moved, pairs must agree on read ports, pack mode and write bank, and any
+ * move that adds a latency violation within the surrounding instructions is
+ * rejected.  Branch offsets would need fixing up after a merge, that isn't
+ * counted.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cl_dump.h"
+#include "qpudis.h"
+
+//How far ahead of a latency nop to look for an instruction to fill it with
+#define MAX_FILL_DISTANCE 8
+
+//Instructions either side of a change that latency_violations looks at
+#define LATENCY_WINDOW 2
+
+//Small immediate codes from here rotate the mul output instead
+#define SMALL_IMM_ROTATE 48
+
+typedef struct {
+   qpu_inst_t inst;
+   qpu_regs_t reads;
+   qpu_regs_t writes;
+
+   int block_start;  //Branch target or first instruction after a branch's delay slots
+   int delay_slot;   //In the delay slots of a branch or thread end
+   int delay_owner;  //Index of the branch or thread end owning the delay slot
+   int used;         //Already part of a pair or fill
+} pair_inst_t;
+
+typedef struct {
+   qpu_regs_t reads;
+   qpu_regs_t writes;
+} slot_regs_t;
+
+typedef struct {
+   uint32_t programs;
+   uint32_t insts;
+   uint32_t pairs;
+   uint32_t filled_nops;
+   uint32_t removable_nops;
+   uint32_t unfilled_nops;
+} pairs_totals_t;
+
+static int regs_overlap(const qpu_regs_t* a, const qpu_regs_t* b) {
+   return (a->ra & b->ra) || (a->rb & b->rb) || (a->acc & b->acc) || (a->io & b->io);
+}
+
+static void merge_regs(qpu_regs_t* a, const qpu_regs_t* b) {
+   a->ra  |= b->ra;
+   a->rb  |= b->rb;
+   a->acc |= b->acc;
+   a->io  |= b->io;
+}
+
+static int has_delay_slots(const qpu_inst_t* inst) {
+   return inst->sig == QPU_SIG_BRANCH || inst->sig == QPU_SIG_THREND ||
+      inst->sig == QPU_SIG_THRSW || inst->sig == QPU_SIG_LTHRSW;
+}
+
+//Register file writes can't be read by the next instruction and SFU results
+//take two instructions to reach r4
+static uint32_t latency_violations(const slot_regs_t* slots, uint32_t num_slots) {
+   uint32_t violations = 0;
+   uint32_t p;
+   uint32_t c;
+
+   for(p = 0;p < num_slots; ++p) {
+      for(c = p + 1;c < num_slots && c <= p + 2; ++c) {
+         const qpu_regs_t* w = &slots[p].writes;
+         const qpu_regs_t* r = &slots[c].reads;
+
+         if(c == p + 1 && ((w->ra & r->ra) || (w->rb & r->rb)))
+            violations++;
+
+         if((w->io & QPU_IO_SFU) && (r->acc & QPU_ACC(4)))
+            violations++;
+      }
+   }
+
+   return violations;
+}
+
+//Fills slots with the instructions from lo to hi (inclusive, clipped to the
+//program) skipping skip, returns the number of slots used
+static uint32_t window_slots(pair_inst_t* insts, uint32_t num_insts, int lo, int hi, int skip,
+   slot_regs_t* slots) {
+   uint32_t n = 0;
+   int      i;
+
+   for(i = lo < 0 ? 0 : lo;i <= hi && i < (int)num_insts; ++i) {
+      if(i == skip)
+         continue;
+
+      slots[n].reads  = insts[i].reads;
+      slots[n].writes = insts[i].writes;
+      n++;
+   }
+
+   return n;
+}
+
+//Whether the instruction's active ALU reads regfile B (mux 7)
+static int reads_regfile_b(const qpu_inst_t* inst) {
+   if(qpu_add_active(inst) && (inst->adda == 7 || inst->addb == 7))
+      return 1;
+
+   return qpu_mul_active(inst) && (inst->mula == 7 || inst->mulb == 7);
+}
+
+static int is_single_alu(const qpu_inst_t* inst, int* is_add) {
+   int add;
+   int mul;
+
+   switch(inst->sig) {
+      case QPU_SIG_NONE:
+      case QPU_SIG_SMALL_IMM:
+      case QPU_SIG_SBWAIT:
+      case QPU_SIG_LDTMU0:
+      case QPU_SIG_LDTMU1:
+         break;
+      default:
+         return 0;
+   }
+
+   add = qpu_add_active(inst);
+   mul = qpu_mul_active(inst);
+
+   if(add == mul)
+      return 0;
+
+   //The idle pipe mustn't be writing anything either
+   if(add && inst->waddr_mul != 39)
+      return 0;
+   if(mul && inst->waddr_add != 39)
+      return 0;
+
+   *is_add = add;
+   return 1;
+}
+
+//Write addresses that mean the same thing in either register bank
+static int bank_free_waddr(uint32_t waddr) {
+   if(waddr < 32)
+      return 0;
+
+   switch(waddr) {
+      case 37: case 40: case 41: case 42: case 49: case 50:
+         return 0;
+      default:
+         return 1;
+   }
+}
+
+static int raddr_compatible(uint32_t a, uint32_t b) {
+   //Reading a FIFO like unif or vary from both halves would only pop it once
+   return a == 39 || b == 39 || (a == b && a < 32);
+}
+
+static int can_pair(pair_inst_t* insts, uint32_t num_insts, int i) {
+   const qpu_inst_t* a = &insts[i].inst;
+   const qpu_inst_t* b = &insts[i + 1].inst;
+   const qpu_inst_t* add_inst;
+   const qpu_inst_t* mul_inst;
+   slot_regs_t       old_slots[2 * LATENCY_WINDOW + 2];
+   slot_regs_t       new_slots[2 * LATENCY_WINDOW + 2];
+   uint32_t          num_old;
+   uint32_t          num_new;
+   uint32_t          k;
+   int               a_add;
+   int               b_add;
+
+   if(insts[i].used || insts[i + 1].used)
+      return 0;
+
+   if(insts[i].delay_slot || insts[i + 1].delay_slot || insts[i + 1].block_start)
+      return 0;
+
+   if(!is_single_alu(a, &a_add) || !is_single_alu(b, &b_add) || a_add == b_add)
+      return 0;
+
+   add_inst = a_add ? a : b;
+   mul_inst = a_add ? b : a;
+
+   //Only one signal and one pack mode can be encoded
+   if(a->sig != QPU_SIG_NONE && b->sig != QPU_SIG_NONE)
+      return 0;
+   if(a->packbits || b->packbits)
+      return 0;
+
+   //A merged instruction sets flags from the add result
+   if(mul_inst->sf)
+      return 0;
+
+   if(!raddr_compatible(a->raddr_a, b->raddr_a))
+      return 0;
+
+   if(a->sig == QPU_SIG_SMALL_IMM || b->sig == QPU_SIG_SMALL_IMM) {
+      const qpu_inst_t* other = a->sig == QPU_SIG_SMALL_IMM ? b : a;
+
+      const qpu_inst_t* imm = a->sig == QPU_SIG_SMALL_IMM ? a : b;
+
+      //The immediate takes the raddr_b field, so other can't read regfile B
+      //even at the address matching the immediate's encoding
+      if(reads_regfile_b(other) || other->raddr_b != 39)
+         return 0;
+
+      //A rotation would apply to other's mul result as well
+      if(imm->raddr_b >= SMALL_IMM_ROTATE && qpu_mul_active(other))
+         return 0;
+   } else if(!raddr_compatible(a->raddr_b, b->raddr_b)) {
+      return 0;
+   }
+
+   if(add_inst->ws != mul_inst->ws && !bank_free_waddr(add_inst->waddr_add) &&
+      !bank_free_waddr(mul_inst->waddr_mul)) {
+      return 0;
+   }
+
+   //Within one instruction reads happen before writes, so b can't depend on a
+   //and they can't write the same place or hit the same peripheral
+   if(regs_overlap(&insts[i].writes, &insts[i + 1].reads) ||
+      regs_overlap(&insts[i].writes, &insts[i + 1].writes) ||
+      ((insts[i].reads.io | insts[i].writes.io) & (insts[i + 1].reads.io | insts[i + 1].writes.io))) {
+      return 0;
+   }
+
+   //Merging pulls the following instructions one closer
+   num_old = window_slots(insts, num_insts, i - LATENCY_WINDOW, i + 1 + LATENCY_WINDOW, -1, old_slots);
+   num_new = window_slots(insts, num_insts, i - LATENCY_WINDOW, i + 1 + LATENCY_WINDOW, i + 1, new_slots);
+
+   k = i < LATENCY_WINDOW ? i : LATENCY_WINDOW;
+   merge_regs(&new_slots[k].reads, &insts[i + 1].reads);
+   merge_regs(&new_slots[k].writes, &insts[i + 1].writes);
+
+   return latency_violations(new_slots, num_new) <= latency_violations(old_slots, num_old);
+}
+
+//Whether deleting nop k breaks the latency of the instructions around it
+static int nop_needed(pair_inst_t* insts, uint32_t num_insts, int k) {
+   slot_regs_t old_slots[2 * LATENCY_WINDOW + 1];
+   slot_regs_t new_slots[2 * LATENCY_WINDOW + 1];
+   uint32_t    num_old;
+   uint32_t    num_new;
+
+   num_old = window_slots(insts, num_insts, k - LATENCY_WINDOW, k + LATENCY_WINDOW, -1, old_slots);
+   num_new = window_slots(insts, num_insts, k - LATENCY_WINDOW, k + LATENCY_WINDOW, k, new_slots);
+
+   return latency_violations(new_slots, num_new) > latency_violations(old_slots, num_old);
+}
+
+//Whether instruction m can move into nop slot k, everything in between must
+//be independent of it
+static int can_fill(pair_inst_t* insts, uint32_t num_insts, int k, int m) {
+   pair_inst_t* mi = &insts[m];
+   slot_regs_t  old_slots[MAX_FILL_DISTANCE + 2 * LATENCY_WINDOW + 2];
+   slot_regs_t  new_slots[MAX_FILL_DISTANCE + 2 * LATENCY_WINDOW + 2];
+   uint32_t     num_old = 0;
+   uint32_t     num_new = 0;
+   int          lo = (k < m ? k : m) - LATENCY_WINDOW;
+   int          hi = (k < m ? m : k) + LATENCY_WINDOW;
+   int          j;
+
+   if(mi->used || mi->delay_slot || qpu_is_nop(&mi->inst) || has_delay_slots(&mi->inst))
+      return 0;
+
+   //Peripheral accesses have to stay in order
+   if(mi->reads.io || mi->writes.io)
+      return 0;
+
+   if(m > k) {
+      for(j = k + 1;j <= m; ++j) {
+         if(insts[j].block_start)
+            return 0;
+      }
+
+      for(j = k + 1;j < m; ++j) {
+         if(has_delay_slots(&insts[j].inst))
+            return 0;
+      }
+   } else {
+      //Pushing an earlier instruction down into the delay slots of the
+      //branch or thread end just before it
+      if(!insts[k].delay_slot || m > insts[k].delay_owner)
+         return 0;
+
+      for(j = m + 1;j <= k; ++j) {
+         if(insts[j].block_start)
+            return 0;
+         if(j != insts[k].delay_owner && has_delay_slots(&insts[j].inst))
+            return 0;
+      }
+   }
+
+   for(j = (k < m ? k : m) + 1;j < (k < m ? m : k); ++j) {
+      if(regs_overlap(&mi->writes, &insts[j].reads) ||
+         regs_overlap(&mi->writes, &insts[j].writes) ||
+         regs_overlap(&mi->reads, &insts[j].writes)) {
+         return 0;
+      }
+   }
+
+   if(lo < 0)
+      lo = 0;
+   if(hi >= (int)num_insts)
+      hi = num_insts - 1;
+
+   for(j = lo;j <= hi; ++j) {
+      old_slots[num_old].reads  = insts[j].reads;
+      old_slots[num_old].writes = insts[j].writes;
+      num_old++;
+
+      if(j == m)
+         continue;
+
+      if(j == k) {
+         new_slots[num_new].reads  = mi->reads;
+         new_slots[num_new].writes = mi->writes;
+      } else {
+         new_slots[num_new].reads  = insts[j].reads;
+         new_slots[num_new].writes = insts[j].writes;
+      }
+      num_new++;
+   }
+
+   return latency_violations(new_slots, num_new) <= latency_violations(old_slots, num_old);
+}
+
+//Looks for an instruction to take the place of nop k, for delay slots one from
+//just before the branch, otherwise one shortly after.  Returns -1 if none.
+static int find_fill(pair_inst_t* insts, uint32_t num_insts, int k) {
+   int m;
+
+   if(insts[k].delay_slot) {
+      for(m = insts[k].delay_owner - 1;m >= 0 && m >= k - MAX_FILL_DISTANCE; --m) {
+         if(can_fill(insts, num_insts, k, m))
+            return m;
+         if(insts[m].block_start)
+            break;
+      }
+
+      return -1;
+   }
+
+   for(m = k + 1;m < (int)num_insts && m <= k + MAX_FILL_DISTANCE; ++m) {
+      if(insts[m].block_start)
+         break;
+      if(can_fill(insts, num_insts, k, m))
+         return m;
+   }
+
+   return -1;
+}
+
+static void print_inst(qpu_prog_t* prog, int i) {
+   char line[QPU_FMT_LINE_MAX];
+
+   qpu_format_line(line, &prog->insts[i * 2], i * 8);
+   printf("   %s", line);
+}
+
+static void mark_blocks(pair_inst_t* insts, uint32_t num_insts) {
+   uint32_t i;
+   uint32_t j;
+
+   insts[0].block_start = 1;
+
+   for(i = 0;i < num_insts; ++i) {
+      qpu_inst_t* inst = &insts[i].inst;
+      uint32_t    num_delay;
+
+      if(!has_delay_slots(inst))
+         continue;
+
+      num_delay = inst->sig == QPU_SIG_BRANCH ? 3 : 2;
+
+      for(j = i + 1;j <= i + num_delay && j < num_insts; ++j) {
+         insts[j].delay_slot  = 1;
+         insts[j].delay_owner = i;
+      }
+
+      if(inst->sig != QPU_SIG_BRANCH)
+         continue;
+
+      if(i + 4 < num_insts)
+         insts[i + 4].block_start = 1;
+
+      //Relative branches land 4 instructions on from the branch
+      if(inst->pcrel && !inst->addreg) {
+         int32_t target = (int32_t)(i + 4) * 8 + (int32_t)inst->imm;
+
+         if(target >= 0 && (target & 7) == 0 && (uint32_t)target / 8 < num_insts)
+            insts[target / 8].block_start = 1;
+      }
+   }
+}
+
+static int pairs_prog_fn(void* ctx, qpu_prog_t* prog) {
+   pairs_totals_t* totals = ctx;
+   pair_inst_t*    insts;
+   uint32_t        num_insts = prog->num_insts;
+   uint32_t        pairs = 0;
+   uint32_t        filled = 0;
+   uint32_t        removable = 0;
+   uint32_t        unfilled = 0;
+   uint32_t        saving;
+   uint32_t        i;
+
+   insts = calloc(num_insts, sizeof(pair_inst_t));
+   if(!insts) {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+   }
+
+   for(i = 0;i < num_insts; ++i) {
+      qpu_decode(&prog->insts[i * 2], &insts[i].inst);
+      qpu_inst_regs(&insts[i].inst, &insts[i].reads, &insts[i].writes);
+   }
+
+   mark_blocks(insts, num_insts);
+
+   printf("QPU Program Addr: %08x (%s shader, %u instructions)\n", prog->addr, qpu_prog_type_name(prog->type),
+      num_insts);
+   printf("--------------------------\n");
+
+   for(i = 0;i + 1 < num_insts; ++i) {
+      if(!can_pair(insts, num_insts, i))
+         continue;
+
+      printf("%08x: pair with %08x\n", prog->addr + i * 8, prog->addr + (i + 1) * 8);
+      print_inst(prog, i);
+      print_inst(prog, i + 1);
+
+      insts[i].used = insts[i + 1].used = 1;
+      pairs++;
+      ++i;
+   }
+
+   for(i = 0;i < num_insts; ++i) {
+      const char* reason;
+      int         m;
+
+      if(insts[i].used || !qpu_is_nop(&insts[i].inst))
+         continue;
+
+      if(insts[i].delay_slot) {
+         reason = insts[insts[i].delay_owner].inst.sig == QPU_SIG_BRANCH ? "branch delay slot" :
+            "thread switch delay slot";
+      } else if(nop_needed(insts, num_insts, i)) {
+         reason = "latency";
+      } else {
+         printf("%08x: nop can be removed\n", prog->addr + i * 8);
+         insts[i].used = 1;
+         removable++;
+         continue;
+      }
+
+      m = find_fill(insts, num_insts, i);
+
+      if(m >= 0) {
+         printf("%08x: %s nop can be filled with %08x\n", prog->addr + i * 8, reason, prog->addr + m * 8);
+         print_inst(prog, m);
+
+         insts[i].used = insts[m].used = 1;
+         filled++;
+      } else {
+         printf("%08x: %s nop, no independent instruction to fill it\n", prog->addr + i * 8, reason);
+         unfilled++;
+      }
+   }
+
+   saving = pairs + filled + removable;
+
+   printf("%u pairs, %u nops fillable, %u nops removable, %u nops unfillable\n", pairs, filled, removable,
+      unfilled);
+   printf("Potential saving: %u of %u cycles (%.1f%%)\n\n", saving * QPU_CYCLES_PER_INSTR,
+      num_insts * QPU_CYCLES_PER_INSTR, num_insts ? 100.0 * saving / num_insts : 0.0);
+
+   totals->programs++;
+   totals->insts          += num_insts;
+   totals->pairs          += pairs;
+   totals->filled_nops    += filled;
+   totals->removable_nops += removable;
+   totals->unfilled_nops  += unfilled;
+
+   free(insts);
+
+   return 0;
+}
+
+int do_pairs(char* start_addr_str, char* end_addr_str) {
+   pairs_totals_t totals;
+   uint32_t start_addr;
+   uint32_t end_addr;
+   uint32_t saving;
+   int      ret;
+
+   if(parse_cl_range(start_addr_str, end_addr_str, &start_addr, &end_addr))
+      return 1;
+
+   memset(&totals, 0, sizeof(totals));
+
+   ret = for_each_qpu_prog(start_addr, end_addr, 0, pairs_prog_fn, &totals);
+
+   saving = totals.pairs + totals.filled_nops + totals.removable_nops;
+
+   printf("Summary\n");
+   printf("-------\n");
+   printf("%u programs, %u instructions\n", totals.programs, totals.insts);
+   printf("%u pairs, %u nops fillable, %u nops removable, %u nops unfillable\n", totals.pairs,
+      totals.filled_nops, totals.removable_nops, totals.unfilled_nops);
+   printf("Potential saving: %u of %u cycles (%.1f%%)\n", saving * QPU_CYCLES_PER_INSTR,
+      totals.insts * QPU_CYCLES_PER_INSTR, totals.insts ? 100.0 * saving / totals.insts : 0.0);
+
+   return ret;
+}
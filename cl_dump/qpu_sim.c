@@ -0,0 +1,768 @@
+/*
+ * qpu_sim.c - Instruction level QPU simulator for profiling shaders offline
+ *
+ * Runs each QPU program used by a CL over the 16 SIMD lanes with the uniforms
+ * its shader record points at, reporting how many instructions were executed,
+ * how branches behaved and how hot each instruction was.  Registers are GCC
+ * vector types so lane operations use host SIMD where the compiler has it.
+ *
+ * Peripherals are stubbed: varyings, VPM reads and TMU/TLB loads return 0
+ * and writes to them are only counted.  SFU results land in r4 immediately
+ * and pack/unpack modes aren't applied, so values (and therefore data
+ * dependent branches) are approximate for shaders relying on those.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "cl_dump.h"
+#include "cl_textures.h"
+#include "qpudis.h"
+
+#define QPU_LANES 16
+
+//Stops runaway loops, particularly ones polling stubbed peripherals
+#define DEFAULT_MAX_INSTS 1000000
+
+//Instructions listed in the hot spot summary
+#define NUM_HOT_INSTS 5
+
+typedef uint32_t qpu_vec_t  __attribute__((vector_size(QPU_LANES * 4)));
+typedef int32_t  qpu_ivec_t __attribute__((vector_size(QPU_LANES * 4)));
+typedef float    qpu_fvec_t __attribute__((vector_size(QPU_LANES * 4)));
+
+#define SIM_END_THREND  0
+#define SIM_END_RANOFF  1
+#define SIM_END_BRANCH  2
+#define SIM_END_LIMIT   3
+
+static const char* sim_end_names[] = {
+   "thread end", "running off the end of the program", "a branch outside the program", "the instruction limit"
+};
+
+typedef struct {
+   qpu_vec_t ra[32];
+   qpu_vec_t rb[32];
+   qpu_vec_t acc[6];
+
+   //Flags as lane masks, all ones where set
+   qpu_vec_t z;
+   qpu_vec_t n;
+   qpu_vec_t c;
+
+   uint32_t* uniforms;
+   uint32_t  uniforms_addr;
+   uint32_t  num_uniforms;
+   uint32_t  next_uniform;
+   uint32_t  tmu_coords[2]; //Per TMU, see tmu_coord_write
+
+   uint64_t executed;
+   uint64_t* counts;     //Per instruction
+   uint64_t branches;
+   uint64_t branches_taken;
+   uint64_t branches_divergent;
+   uint64_t uniform_reads;
+   uint64_t uniform_overruns;
+   uint64_t varying_reads;
+   uint64_t tmu_writes;
+   uint64_t tmu_loads;
+   uint64_t sfu_ops;
+   uint64_t vpm_accesses;
+   uint64_t tlb_accesses;
+   uint32_t end_reason;
+} qpu_sim_t;
+
+typedef struct {
+   uint64_t max_insts;
+   uint32_t programs;
+   uint64_t executed;
+   uint64_t branches_divergent;
+} sim_cfg_t;
+
+//Vectors are passed by pointer, passing one wider than the host SIMD by value
+//makes GCC note an ABI change
+static void vec_splat(qpu_vec_t* r, uint32_t v) {
+   int i;
+
+   for(i = 0;i < QPU_LANES; ++i) {
+      (*r)[i] = v;
+   }
+}
+
+static void vec_elem_num(qpu_vec_t* r) {
+   int i;
+
+   for(i = 0;i < QPU_LANES; ++i) {
+      (*r)[i] = i;
+   }
+}
+
+//r may be a or b
+static void vec_select(qpu_vec_t* r, const qpu_vec_t* mask, const qpu_vec_t* a, const qpu_vec_t* b) {
+   *r = (*a & *mask) | (*b & ~*mask);
+}
+
+static uint32_t vec_any(const qpu_vec_t* mask) {
+   uint32_t r = 0;
+   int i;
+
+   for(i = 0;i < QPU_LANES; ++i) {
+      r |= (*mask)[i];
+   }
+
+   return r != 0;
+}
+
+static uint32_t vec_all(const qpu_vec_t* mask) {
+   uint32_t r = ~0u;
+   int i;
+
+   for(i = 0;i < QPU_LANES; ++i) {
+      r &= (*mask)[i];
+   }
+
+   return r != 0;
+}
+
+static void cond_mask(qpu_vec_t* r, qpu_sim_t* sim, uint32_t cond) {
+   switch(cond) {
+      case 0: vec_splat(r, 0); break;
+      case 1: vec_splat(r, ~0u); break;
+      case 2: *r = sim->z; break;
+      case 3: *r = ~sim->z; break;
+      case 4: *r = sim->n; break;
+      case 5: *r = ~sim->n; break;
+      case 6: *r = sim->c; break;
+      default: *r = ~sim->c; break;
+   }
+}
+
+static void small_imm(qpu_vec_t* r, uint32_t raddr_b) {
+   if(raddr_b < 16) {
+      vec_splat(r, raddr_b);
+   } else if(raddr_b < 32) {
+      vec_splat(r, (uint32_t)((int32_t)raddr_b - 32));
+   } else if(raddr_b < 40) {
+      float f = (float)(1 << (raddr_b - 32));
+      uint32_t v;
+
+      memcpy(&v, &f, 4);
+      vec_splat(r, v);
+   } else if(raddr_b < 48) {
+      float f = 1.0f / (float)(1 << (48 - raddr_b));
+      uint32_t v;
+
+      memcpy(&v, &f, 4);
+      vec_splat(r, v);
+   } else {
+      //48-63 are mul output rotations, the operand itself reads as 0
+      vec_splat(r, 0);
+   }
+}
+
+static void read_uniform(qpu_vec_t* r, qpu_sim_t* sim) {
+   sim->uniform_reads++;
+
+   if(sim->next_uniform < sim->num_uniforms) {
+      vec_splat(r, sim->uniforms[sim->next_uniform++]);
+      return;
+   }
+
+   sim->uniform_overruns++;
+   vec_splat(r, 0);
+}
+
+//A texture lookup pops its config parameters from the same stream as reads
+static void tmu_write(qpu_sim_t* sim, uint32_t waddr) {
+   uint32_t params;
+   uint32_t left;
+
+   sim->tmu_writes++;
+
+   if(tmu_coord_write(waddr, sim->tmu_coords) != TMU_WRITE_LOOKUP)
+      return;
+
+   left = sim->num_uniforms - sim->next_uniform;
+   if(!left)
+      return;
+
+   params = tex_config_params(sim->uniforms[sim->next_uniform]);
+   sim->next_uniform += params < left ? params : left;
+}
+
+static void read_raddr(qpu_vec_t* r, qpu_sim_t* sim, uint32_t raddr, int bank_b, const qpu_vec_t* unif) {
+   if(raddr < 32) {
+      *r = bank_b ? sim->rb[raddr] : sim->ra[raddr];
+      return;
+   }
+
+   switch(raddr) {
+      case 32:
+         *r = *unif;
+         break;
+      case 35:
+         sim->varying_reads++;
+         vec_splat(r, 0);
+         break;
+      case 38:
+         //qpu number is always 0
+         if(bank_b)
+            vec_splat(r, 0);
+         else
+            vec_elem_num(r);
+         break;
+      case 48:
+         sim->vpm_accesses++;
+         vec_splat(r, 0);
+         break;
+      default:
+         vec_splat(r, 0);
+         break;
+   }
+}
+
+static const qpu_vec_t* read_mux(qpu_sim_t* sim, uint32_t mux, const qpu_vec_t* a, const qpu_vec_t* b) {
+   if(mux < 6)
+      return &sim->acc[mux];
+
+   return mux == 6 ? a : b;
+}
+
+static void v8_op(qpu_vec_t* r, uint32_t op, const qpu_vec_t* a, const qpu_vec_t* b) {
+   int i, j;
+
+   for(i = 0;i < QPU_LANES; ++i) {
+      uint32_t out = 0;
+
+      for(j = 0;j < 32; j += 8) {
+         uint32_t x = ((*a)[i] >> j) & 0xff;
+         uint32_t y = ((*b)[i] >> j) & 0xff;
+         uint32_t v;
+
+         switch(op) {
+            case 3:  v = (x * y + 127) / 255; break;      //v8muld
+            case 4:  v = x < y ? x : y; break;            //v8min
+            case 5:  v = x > y ? x : y; break;            //v8max
+            case 6:  v = x + y > 255 ? 255 : x + y; break; //v8adds
+            default: v = x > y ? x - y : 0; break;        //v8subs
+         }
+
+         out |= v << j;
+      }
+
+      (*r)[i] = out;
+   }
+}
+
+//r must not be a or b
+static void add_op(qpu_vec_t* r, uint32_t op, const qpu_vec_t* a, const qpu_vec_t* b, qpu_vec_t* carry) {
+   qpu_fvec_t fa = (qpu_fvec_t)*a;
+   qpu_fvec_t fb = (qpu_fvec_t)*b;
+   qpu_ivec_t ia = (qpu_ivec_t)*a;
+   qpu_ivec_t ib = (qpu_ivec_t)*b;
+   qpu_vec_t  shift = *b & 31;
+   qpu_vec_t  mask;
+   int        i;
+
+   //C is only modelled for integer add and sub
+   vec_splat(carry, 0);
+
+   switch(op) {
+      case 1:  *r = (qpu_vec_t)(fa + fb); break;
+      case 2:  *r = (qpu_vec_t)(fa - fb); break;
+      case 3:
+         mask = (qpu_vec_t)(fa < fb);
+         vec_select(r, &mask, a, b);
+         break;
+      case 4:
+         mask = (qpu_vec_t)(fa > fb);
+         vec_select(r, &mask, a, b);
+         break;
+      case 5:
+      case 6: {
+         qpu_vec_t abs_a = *a & 0x7fffffff;
+         qpu_vec_t abs_b = *b & 0x7fffffff;
+
+         //Compared and returned as magnitudes
+         mask = op == 5 ? (qpu_vec_t)((qpu_fvec_t)abs_a < (qpu_fvec_t)abs_b) :
+            (qpu_vec_t)((qpu_fvec_t)abs_a > (qpu_fvec_t)abs_b);
+         vec_select(r, &mask, &abs_a, &abs_b);
+         break;
+      }
+      case 7:  *r = (qpu_vec_t)__builtin_convertvector(fa, qpu_ivec_t); break;
+      case 8:  *r = (qpu_vec_t)__builtin_convertvector(ia, qpu_fvec_t); break;
+      case 12:
+         *r = *a + *b;
+         *carry = (qpu_vec_t)(*r < *a);
+         break;
+      case 13:
+         *carry = (qpu_vec_t)(*a < *b);
+         *r = *a - *b;
+         break;
+      case 14: *r = *a >> shift; break;
+      case 15: *r = (qpu_vec_t)(ia >> (qpu_ivec_t)shift); break;
+      case 16: *r = (*a >> shift) | (*a << ((32 - shift) & 31)); break;
+      case 17: *r = *a << shift; break;
+      case 18:
+         mask = (qpu_vec_t)(ia < ib);
+         vec_select(r, &mask, a, b);
+         break;
+      case 19:
+         mask = (qpu_vec_t)(ia > ib);
+         vec_select(r, &mask, a, b);
+         break;
+      case 20: *r = *a & *b; break;
+      case 21: *r = *a | *b; break;
+      case 22: *r = *a ^ *b; break;
+      case 23: *r = ~*a; break;
+      case 24:
+         for(i = 0;i < QPU_LANES; ++i) {
+            (*r)[i] = (*a)[i] ? __builtin_clz((*a)[i]) : 32;
+         }
+         break;
+      case 30: v8_op(r, 6, a, b); break;
+      case 31: v8_op(r, 7, a, b); break;
+      default: vec_splat(r, 0); break;
+   }
+}
+
+//r must not be a or b
+static void mul_op(qpu_vec_t* r, uint32_t op, const qpu_vec_t* a, const qpu_vec_t* b) {
+   switch(op) {
+      case 1:  *r = (qpu_vec_t)((qpu_fvec_t)*a * (qpu_fvec_t)*b); break;
+      case 2:  *r = (*a & 0xffffff) * (*b & 0xffffff); break;
+      case 0:  vec_splat(r, 0); break;
+      default: v8_op(r, op, a, b); break;
+   }
+}
+
+static void rotate(qpu_vec_t* v, uint32_t n) {
+   qpu_vec_t r;
+   int i;
+
+   for(i = 0;i < QPU_LANES; ++i) {
+      r[i] = (*v)[(i - n) & (QPU_LANES - 1)];
+   }
+
+   *v = r;
+}
+
+static void sfu(qpu_vec_t* r, uint32_t waddr, const qpu_vec_t* v) {
+   qpu_fvec_t f = (qpu_fvec_t)*v;
+   int i;
+
+   for(i = 0;i < QPU_LANES; ++i) {
+      switch(waddr) {
+         case 52: f[i] = 1.0f / f[i]; break;
+         case 53: f[i] = 1.0f / sqrtf(f[i]); break;
+         case 54: f[i] = exp2f(f[i]); break;
+         default: f[i] = log2f(f[i]); break;
+      }
+   }
+
+   *r = (qpu_vec_t)f;
+}
+
+static void write_reg(qpu_sim_t* sim, uint32_t waddr, int bank_b, const qpu_vec_t* v, const qpu_vec_t* mask) {
+   qpu_vec_t* dst;
+
+   if(waddr < 32) {
+      dst = bank_b ? &sim->rb[waddr] : &sim->ra[waddr];
+      vec_select(dst, mask, v, dst);
+      return;
+   }
+
+   switch(waddr) {
+      case 32: case 33: case 34: case 35:
+         dst = &sim->acc[waddr - 32];
+         vec_select(dst, mask, v, dst);
+         break;
+      case 37: {
+         qpu_vec_t rep;
+         int i;
+
+         //Bank A replicates per quad, bank B across all lanes
+         for(i = 0;i < QPU_LANES; ++i) {
+            rep[i] = bank_b ? (*v)[0] : (*v)[i & ~3];
+         }
+         vec_select(&sim->acc[5], mask, &rep, &sim->acc[5]);
+         break;
+      }
+      case 40:
+         //unif_addr, only moves within the mapped stream are followed
+         if(!bank_b && vec_any(mask)) {
+            uint32_t index = ((*v)[0] - sim->uniforms_addr) / 4;
+
+            sim->next_uniform = (*v)[0] >= sim->uniforms_addr && index < sim->num_uniforms ? index :
+               sim->num_uniforms;
+         }
+         break;
+      case 43: case 44: case 45: case 46: case 47:
+         sim->tlb_accesses++;
+         break;
+      case 48:
+         sim->vpm_accesses++;
+         break;
+      case 52: case 53: case 54: case 55: {
+         qpu_vec_t result;
+
+         sim->sfu_ops++;
+         sfu(&result, waddr, v);
+         vec_select(&sim->acc[4], mask, &result, &sim->acc[4]);
+         break;
+      }
+      case 56: case 57: case 58: case 59:
+      case 60: case 61: case 62: case 63:
+         tmu_write(sim, waddr);
+         break;
+   }
+}
+
+static void set_flags(qpu_sim_t* sim, const qpu_vec_t* r, const qpu_vec_t* carry, const qpu_vec_t* mask) {
+   qpu_vec_t z = (qpu_vec_t)(*r == 0);
+   qpu_vec_t n = (qpu_vec_t)((qpu_ivec_t)*r < 0);
+
+   vec_select(&sim->z, mask, &z, &sim->z);
+   vec_select(&sim->n, mask, &n, &sim->n);
+   vec_select(&sim->c, mask, carry, &sim->c);
+}
+
+static void ldi_value(qpu_vec_t* r, const qpu_inst_t* inst) {
+   uint32_t mode = (inst->i1 >> 25) & 0x7;
+   int i;
+
+   if(mode != 1 && mode != 3) {
+      vec_splat(r, inst->imm);
+      return;
+   }
+
+   //Per element 2 bit values, the low bits in bits 0-15 and high in 16-31
+   for(i = 0;i < QPU_LANES; ++i) {
+      uint32_t v = ((inst->imm >> i) & 1) | (((inst->imm >> (16 + i)) & 1) << 1);
+
+      (*r)[i] = (mode == 1 && (v & 2)) ? v - 4 : v;
+   }
+}
+
+static int branch_taken(qpu_sim_t* sim, uint32_t cond, int* divergent) {
+   const qpu_vec_t* flag;
+
+   if(cond == 15) {
+      *divergent = 0;
+      return 1;
+   }
+
+   switch(cond >> 1) {
+      case 0: case 1: flag = &sim->z; break;
+      case 2: case 3: flag = &sim->n; break;
+      default:        flag = &sim->c; break;
+   }
+
+   *divergent = vec_any(flag) && !vec_all(flag);
+
+   //0 all set, 1 all clear, 2 any set, 3 any clear (then the same for N and C)
+   switch(cond & 3) {
+      case 0: return vec_all(flag);
+      case 1: return !vec_any(flag);
+      case 2: return vec_any(flag);
+      default: return !vec_all(flag);
+   }
+}
+
+static void sim_alu(qpu_sim_t* sim, const qpu_inst_t* inst) {
+   qpu_vec_t unif;
+   qpu_vec_t a;
+   qpu_vec_t b;
+   qpu_vec_t add_r;
+   qpu_vec_t mul_r;
+   qpu_vec_t carry;
+   qpu_vec_t add_mask;
+   qpu_vec_t mul_mask;
+   int       small = inst->sig == QPU_SIG_SMALL_IMM;
+
+   vec_splat(&unif, 0);
+   vec_splat(&add_r, 0);
+   vec_splat(&mul_r, 0);
+   vec_splat(&carry, 0);
+   cond_mask(&add_mask, sim, inst->addcc);
+   cond_mask(&mul_mask, sim, inst->mulcc);
+
+   //A uniform read from both ports pops one value
+   if(inst->raddr_a == 32 || (!small && inst->raddr_b == 32))
+      read_uniform(&unif, sim);
+
+   read_raddr(&a, sim, inst->raddr_a, 0, &unif);
+   if(small)
+      small_imm(&b, inst->raddr_b);
+   else
+      read_raddr(&b, sim, inst->raddr_b, 1, &unif);
+
+   if(inst->addop)
+      add_op(&add_r, inst->addop, read_mux(sim, inst->adda, &a, &b), read_mux(sim, inst->addb, &a, &b), &carry);
+
+   if(inst->mulop) {
+      mul_op(&mul_r, inst->mulop, read_mux(sim, inst->mula, &a, &b), read_mux(sim, inst->mulb, &a, &b));
+
+      if(small && inst->raddr_b >= 48)
+         rotate(&mul_r, inst->raddr_b == 48 ? sim->acc[5][0] & 15 : inst->raddr_b - 48);
+   }
+
+   if(inst->sf) {
+      if(inst->addop) {
+         set_flags(sim, &add_r, &carry, &add_mask);
+      } else {
+         vec_splat(&carry, 0);
+         set_flags(sim, &mul_r, &carry, &mul_mask);
+      }
+   }
+
+   write_reg(sim, inst->waddr_add, inst->ws, &add_r, &add_mask);
+   write_reg(sim, inst->waddr_mul, !inst->ws, &mul_r, &mul_mask);
+
+   switch(inst->sig) {
+      case QPU_SIG_LDTMU0:
+      case QPU_SIG_LDTMU1:
+         sim->tmu_loads++;
+         vec_splat(&sim->acc[4], 0);
+         break;
+      case QPU_SIG_SBWAIT:
+      case QPU_SIG_SBDONE:
+         sim->tlb_accesses++;
+         break;
+   }
+}
+
+static void sim_run(qpu_sim_t* sim, qpu_inst_t* insts, qpu_prog_t* prog, uint64_t max_insts) {
+   uint32_t pc = 0;
+   int32_t  branch_target = -1;
+   int      branch_delay = 0;
+   int      end_delay = -1;
+
+   while(1) {
+      qpu_inst_t* inst;
+
+      if(pc >= prog->num_insts) {
+         sim->end_reason = SIM_END_RANOFF;
+         return;
+      }
+
+      if(sim->executed >= max_insts) {
+         sim->end_reason = SIM_END_LIMIT;
+         return;
+      }
+
+      inst = &insts[pc];
+      sim->executed++;
+      sim->counts[pc]++;
+
+      if(inst->sig == QPU_SIG_BRANCH) {
+         int      divergent;
+         int      taken = branch_taken(sim, inst->cond, &divergent);
+         uint32_t link = prog->addr + (pc + 4) * 8;
+         int64_t  target = (int32_t)inst->imm;
+         qpu_vec_t link_vec;
+         qpu_vec_t all;
+
+         sim->branches++;
+         sim->branches_divergent += divergent;
+
+         if(inst->pcrel)
+            target += prog->addr + (pc + 4) * 8;
+         if(inst->addreg)
+            target += sim->ra[inst->raddr_a][0];
+
+         vec_splat(&link_vec, link);
+         vec_splat(&all, ~0u);
+         write_reg(sim, inst->waddr_add, inst->ws, &link_vec, &all);
+         write_reg(sim, inst->waddr_mul, !inst->ws, &link_vec, &all);
+
+         if(taken) {
+            sim->branches_taken++;
+
+            if(target < prog->addr || target >= prog->addr + prog->num_insts * 8 || (target & 7)) {
+               sim->end_reason = SIM_END_BRANCH;
+               return;
+            }
+
+            branch_target = (target - prog->addr) / 8;
+            branch_delay  = 4;
+         }
+      } else if(inst->sig == QPU_SIG_LDI) {
+         qpu_vec_t v;
+         qpu_vec_t mask;
+
+         ldi_value(&v, inst);
+         cond_mask(&mask, sim, inst->addcc);
+         write_reg(sim, inst->waddr_add, inst->ws, &v, &mask);
+         cond_mask(&mask, sim, inst->mulcc);
+         write_reg(sim, inst->waddr_mul, !inst->ws, &v, &mask);
+      } else {
+         sim_alu(sim, inst);
+
+         if(inst->sig == QPU_SIG_THREND && end_delay < 0)
+            end_delay = 3;
+      }
+
+      if(end_delay > 0 && --end_delay == 0) {
+         sim->end_reason = SIM_END_THREND;
+         return;
+      }
+
+      if(branch_delay > 0 && --branch_delay == 0) {
+         pc = branch_target;
+         continue;
+      }
+
+      pc++;
+   }
+}
+
+static void print_hot(qpu_sim_t* sim, qpu_prog_t* prog) {
+   uint32_t hot[NUM_HOT_INSTS];
+   uint32_t num_hot = 0;
+   uint32_t i;
+   uint32_t j;
+
+   //Insertion into a small sorted list, programs are short
+   for(i = 0;i < prog->num_insts; ++i) {
+      if(!sim->counts[i])
+         continue;
+
+      for(j = num_hot;j > 0 && sim->counts[hot[j - 1]] < sim->counts[i]; --j) {
+         if(j < NUM_HOT_INSTS)
+            hot[j] = hot[j - 1];
+      }
+
+      if(j < NUM_HOT_INSTS) {
+         hot[j] = i;
+         if(num_hot < NUM_HOT_INSTS)
+            num_hot++;
+      }
+   }
+
+   printf("hottest:");
+   for(i = 0;i < num_hot; ++i) {
+      printf(" %08x (%llu)", prog->addr + hot[i] * 8, (unsigned long long)sim->counts[hot[i]]);
+   }
+   printf("\n");
+}
+
+static void print_sim(qpu_sim_t* sim, qpu_prog_t* prog) {
+   char     line[QPU_FMT_LINE_MAX];
+   uint32_t i;
+
+   printf("executed %llu instructions (%llu lane operations), stopped by %s\n",
+      (unsigned long long)sim->executed, (unsigned long long)sim->executed * QPU_LANES,
+      sim_end_names[sim->end_reason]);
+   printf("branches: %llu executed, %llu taken, %llu divergent\n", (unsigned long long)sim->branches,
+      (unsigned long long)sim->branches_taken, (unsigned long long)sim->branches_divergent);
+   printf("uniform reads: %llu (%llu past the %u in the stream), varying reads: %llu\n",
+      (unsigned long long)sim->uniform_reads, (unsigned long long)sim->uniform_overruns, sim->num_uniforms,
+      (unsigned long long)sim->varying_reads);
+   printf("tmu writes: %llu, tmu loads: %llu, sfu ops: %llu, vpm accesses: %llu, tlb accesses: %llu\n",
+      (unsigned long long)sim->tmu_writes, (unsigned long long)sim->tmu_loads,
+      (unsigned long long)sim->sfu_ops, (unsigned long long)sim->vpm_accesses,
+      (unsigned long long)sim->tlb_accesses);
+   print_hot(sim, prog);
+
+   printf("%10s  %s\n", "count", "instruction");
+   for(i = 0;i < prog->num_insts; ++i) {
+      qpu_format_line(line, &prog->insts[i * 2], i * 8);
+      printf("%10llu  %s", (unsigned long long)sim->counts[i], line);
+   }
+   printf("\n");
+}
+
+static int sim_prog_fn(void* ctx, qpu_prog_t* prog) {
+   sim_cfg_t*  cfg = ctx;
+   qpu_sim_t*  sim;
+   qpu_inst_t* insts;
+   uint32_t    i;
+
+   printf("QPU Program Addr: %08x (%s shader, %u instructions), uniforms: %08x\n", prog->addr,
+      qpu_prog_type_name(prog->type), prog->num_insts, prog->uniforms_addr);
+   printf("--------------------------\n");
+
+   sim   = calloc(1, sizeof(qpu_sim_t));
+   insts = calloc(prog->num_insts, sizeof(qpu_inst_t));
+   if(sim)
+      sim->counts = calloc(prog->num_insts, sizeof(uint64_t));
+
+   if(!sim || !insts || !sim->counts) {
+      fprintf(stderr, "Out of memory\n");
+      if(sim)
+         free(sim->counts);
+      free(sim);
+      free(insts);
+      return 1;
+   }
+
+   for(i = 0;i < prog->num_insts; ++i) {
+      qpu_decode(&prog->insts[i * 2], &insts[i]);
+   }
+
+   sim->uniforms_addr = prog->uniforms_addr;
+
+   if(prog->num_uniforms && prog->uniforms_addr) {
+      sim->uniforms = map_area(prog->uniforms_addr, prog->num_uniforms * 4);
+      if(sim->uniforms)
+         sim->num_uniforms = prog->num_uniforms;
+      else
+         fprintf(stderr, "Failed to map uniforms at %08x, reading them as 0\n", prog->uniforms_addr);
+   }
+
+   sim_run(sim, insts, prog, cfg->max_insts);
+   print_sim(sim, prog);
+
+   cfg->programs++;
+   cfg->executed           += sim->executed;
+   cfg->branches_divergent += sim->branches_divergent;
+
+   if(sim->uniforms)
+      unmap_area(sim->uniforms, sim->num_uniforms * 4);
+
+   free(sim->counts);
+   free(sim);
+   free(insts);
+
+   return 0;
+}
+
+int do_sim(int argc, char* argv[]) {
+   sim_cfg_t cfg;
+   uint32_t  start_addr;
+   uint32_t  end_addr;
+   int       ret;
+   int       i;
+
+   memset(&cfg, 0, sizeof(cfg));
+   cfg.max_insts = DEFAULT_MAX_INSTS;
+
+   if(argc < 2 || parse_cl_range(argv[0], argv[1], &start_addr, &end_addr))
+      return 1;
+
+   for(i = 2;i < argc; ++i) {
+      if(strcmp(argv[i], "--max-insts") == 0 && i + 1 < argc) {
+         if(sscanf(argv[++i], "%llu", (unsigned long long*)&cfg.max_insts) != 1) {
+            fprintf(stderr, "--max-insts needs a number\n");
+            return 1;
+         }
+      } else {
+         fprintf(stderr, "Unknown sim option %s\n", argv[i]);
+         return 1;
+      }
+   }
+
+   //Each set of uniforms can take a program down a different path
+   ret = for_each_qpu_prog(start_addr, end_addr, 1, sim_prog_fn, &cfg);
+
+   printf("Summary\n");
+   printf("-------\n");
+   printf("%u program runs, %llu instructions executed, %llu divergent branches\n", cfg.programs,
+      (unsigned long long)cfg.executed, (unsigned long long)cfg.branches_divergent);
+
+   return ret;
+}
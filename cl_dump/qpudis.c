@@ -2,8 +2,10 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "qpudis.h"
+#include "cl_stats.h"
 
 int base;
 int showfields = 0;
@@ -127,79 +129,378 @@ const char *setf[] = {
 // 32 Bit Immediates:
 //   data:32, 1110 unknown:8 addcc:3 mulcc:3 F:1 X:1 wa:6 wb:6
 
-unsigned tmpthis=0;
-unsigned tmpnext=0;
-char tmpbuff[256];
-#define tmpalloc(sizebytes) ( tmpthis = tmpnext+sizebytes > sizeof(tmpbuff) ? 0 : tmpnext, tmpnext = (tmpthis+sizebytes), &tmpbuff[tmpthis])
+// Field decoding for analysis passes
 
-const char *qpu_r(uint32_t ra, uint32_t rb, uint32_t adda, uint32_t op, int rotator) {
+void qpu_decode(uint32_t *inst, qpu_inst_t *d)
+{
+	uint32_t i0 = inst[0];
+	uint32_t i1 = inst[1];
+
+	d->i0 = i0;
+	d->i1 = i1;
+	d->sig = (i1 >> 28) & 0x0f;
+	d->packbits = (i1 >> 20) & 0xff;
+	d->addcc = (i1 >> 17) & 0x07;
+	d->mulcc = (i1 >> 14) & 0x07;
+	d->sf = (i1 >> 13) & 0x01;
+	d->ws = (i1 >> 12) & 0x01;
+	d->waddr_add = (i1 >> 6) & 0x3f;
+	d->waddr_mul = (i1 >> 0) & 0x3f;
+
+	if (d->sig == QPU_SIG_BRANCH) {
+		d->addop = d->mulop = 0;
+		d->raddr_a = (i1 >> 13) & 0x1f;
+		d->raddr_b = 39;
+		d->adda = d->addb = d->mula = d->mulb = 0;
+		d->packbits = d->addcc = d->mulcc = d->sf = 0;
+		d->cond = (i1 >> 20) & 0x0f;
+		d->pcrel = (i1 >> 19) & 0x01;
+		d->addreg = (i1 >> 18) & 0x01;
+		d->imm = i0;
+	}
+	else if (d->sig == QPU_SIG_LDI) {
+		d->addop = d->mulop = 0;
+		d->raddr_a = d->raddr_b = 39;
+		d->adda = d->addb = d->mula = d->mulb = 0;
+		d->cond = d->pcrel = d->addreg = 0;
+		d->imm = i0;
+	}
+	else {
+		d->mulop = (i0 >> 29) & 0x7;
+		d->addop = (i0 >> 24) & 0x1f;
+		d->raddr_a = (i0 >> 18) & 0x3f;
+		d->raddr_b = (i0 >> 12) & 0x3f;
+		d->adda = (i0 >> 9) & 0x07;
+		d->addb = (i0 >> 6) & 0x07;
+		d->mula = (i0 >> 3) & 0x07;
+		d->mulb = (i0 >> 0) & 0x07;
+		d->cond = d->pcrel = d->addreg = 0;
+		d->imm = 0;
+	}
+}
+
+int qpu_is_nop(const qpu_inst_t *d)
+{
+	return d->sig == QPU_SIG_NONE && d->addop == 0 && d->mulop == 0 &&
+		d->waddr_add == 39 && d->waddr_mul == 39 && !d->sf;
+}
+
+int qpu_add_active(const qpu_inst_t *d)
+{
+	if (d->sig == QPU_SIG_BRANCH)
+		return 0;
+	if (d->sig == QPU_SIG_LDI)
+		return d->addcc != 0;
+	return d->addop != 0 && d->addcc != 0;
+}
+
+int qpu_mul_active(const qpu_inst_t *d)
+{
+	if (d->sig == QPU_SIG_BRANCH)
+		return 0;
+	if (d->sig == QPU_SIG_LDI)
+		return d->mulcc != 0;
+	return d->mulop != 0 && d->mulcc != 0;
+}
+
+// Side effects of reading a raddr that isn't in the register file
+static uint32_t raddr_io(uint32_t raddr)
+{
+	if (raddr < 32) return 0;
+	switch (raddr) {
+		case 32: return QPU_IO_UNIF;
+		case 35: return QPU_IO_VARY;
+		case 38: case 39: case 41: case 42: return 0; // element/qpu number, nop, coords and flags
+		case 48: case 49: case 50: return QPU_IO_VPM;
+		case 51: return QPU_IO_MUTEX;
+		default: return QPU_IO_OTHER;
+	}
+}
+
+static void read_mux(const qpu_inst_t *d, uint32_t mux, qpu_regs_t *reads)
+{
+	if (mux < 6)
+		reads->acc |= QPU_ACC(mux);
+	else if (mux == 6 && d->raddr_a < 32)
+		reads->ra |= 1u << d->raddr_a;
+	else if (mux == 7 && d->sig != QPU_SIG_SMALL_IMM && d->raddr_b < 32)
+		reads->rb |= 1u << d->raddr_b;
+}
+
+static void write_waddr(uint32_t waddr, int bank_b, qpu_regs_t *writes)
+{
+	if (waddr < 32) {
+		if (bank_b)
+			writes->rb |= 1u << waddr;
+		else
+			writes->ra |= 1u << waddr;
+		return;
+	}
+
+	switch (waddr) {
+		case 32: case 33: case 34: case 35: writes->acc |= QPU_ACC(waddr - 32); break;
+		case 36: writes->io |= QPU_IO_TMU0; break; // tmu noswap
+		case 37: writes->acc |= QPU_ACC(5); break;
+		case 39: break;
+		case 40: writes->io |= QPU_IO_UNIF; break;
+		case 43: case 44: case 45: case 46: case 47: writes->io |= QPU_IO_TLB; break;
+		case 48: case 49: case 50: writes->io |= QPU_IO_VPM; break;
+		case 51: writes->io |= QPU_IO_MUTEX; break;
+		case 52: case 53: case 54: case 55:
+			// SFU results turn up in r4
+			writes->io |= QPU_IO_SFU;
+			writes->acc |= QPU_ACC(4);
+			break;
+		case 56: case 57: case 58: case 59: writes->io |= QPU_IO_TMU0; break;
+		case 60: case 61: case 62: case 63: writes->io |= QPU_IO_TMU1; break;
+		default: writes->io |= QPU_IO_OTHER; break;
+	}
+}
+
+void qpu_inst_regs(const qpu_inst_t *d, qpu_regs_t *reads, qpu_regs_t *writes)
+{
+	int add = qpu_add_active(d);
+	int mul = qpu_mul_active(d);
+
+	memset(reads, 0, sizeof(qpu_regs_t));
+	memset(writes, 0, sizeof(qpu_regs_t));
+
+	if (d->sig == QPU_SIG_BRANCH) {
+		if (d->cond != 15)
+			reads->acc |= QPU_FLAGS;
+		if (d->addreg)
+			reads->ra |= 1u << d->raddr_a;
+		reads->io |= QPU_IO_BRANCH;
+	}
+	else if (d->sig != QPU_SIG_LDI) {
+		// The read ports pop FIFOs whether or not a mux uses them
+		reads->io |= raddr_io(d->raddr_a);
+		if (d->sig != QPU_SIG_SMALL_IMM)
+			reads->io |= raddr_io(d->raddr_b);
+
+		if (add) {
+			read_mux(d, d->adda, reads);
+			read_mux(d, d->addb, reads);
+		}
+		if (mul) {
+			read_mux(d, d->mula, reads);
+			read_mux(d, d->mulb, reads);
+		}
+	}
+	else if (d->packbits & 0x80) {
+		writes->io |= QPU_IO_SEMA;
+	}
+
+	if ((add && d->addcc > 1) || (mul && d->mulcc > 1))
+		reads->acc |= QPU_FLAGS;
+
+	if (add || (d->sig == QPU_SIG_BRANCH))
+		write_waddr(d->waddr_add, d->ws, writes);
+	if (mul || (d->sig == QPU_SIG_BRANCH))
+		write_waddr(d->waddr_mul, !d->ws, writes);
+
+	if (d->sf && d->sig != QPU_SIG_BRANCH)
+		writes->acc |= QPU_FLAGS;
+
+	switch (d->sig) {
+		case 0: writes->io |= QPU_IO_OTHER; break; // bkpt
+		case 2: case 3: case 6: writes->io |= QPU_IO_THREAD; break; // thrsw, thrend, lthrsw
+		case 4: case 5: writes->io |= QPU_IO_TLB; break; // sbwait, sbdone
+		case 7: case 8: case 9: case 12: // loadcv, loadc, ldcend, loadam
+			reads->io |= QPU_IO_TLB;
+			writes->acc |= QPU_ACC(4);
+			break;
+		case 10:
+			reads->io |= QPU_IO_TMU0;
+			writes->acc |= QPU_ACC(4);
+			break;
+		case 11:
+			reads->io |= QPU_IO_TMU1;
+			writes->acc |= QPU_ACC(4);
+			break;
+	}
+}
+
+// Text formatting
+//
+// Lines are assembled into a caller supplied buffer from length-prefixed copies
+// of the name tables above, so no format strings are parsed per instruction.
+// Names are copied as fixed size slots and the write pointer advanced by the
+// real length, hence the slack required in QPU_FMT_LINE_MAX.
+
+#define QPU_NAME_SLOT 16
+
+typedef struct {
+	uint8_t len;
+	char str[QPU_NAME_SLOT];
+} qpu_name_t;
+
+static int fmt_ready = 0;
+
+static qpu_name_t fmt_acc[6];
+static qpu_name_t fmt_banka_r[64], fmt_bankb_r[64], fmt_banka_w[64], fmt_bankb_w[64];
+static qpu_name_t fmt_ops[16], fmt_addops[33], fmt_mulops[9], fmt_cc[8], fmt_bcc[16];
+static qpu_name_t fmt_dstpackadd[16], fmt_dstpackmul[16], fmt_srcunpackadd[8], fmt_srcunpackmul[8];
+static qpu_name_t fmt_imm[64], fmt_setf[2];
+static qpu_name_t fmt_empty, fmt_err, fmt_sacq, fmt_srel, fmt_bra, fmt_brr, fmt_nop;
+static qpu_name_t fmt_ldi_elem[4][4]; // [unpack>>1][element], unpack 1 signed, 3 unsigned
+static char fmt_hex[256][2];
+
+static void fmt_name(qpu_name_t *n, const char *str) {
+	uint8_t len = 0;
+	while (str[len]) len++;
+	memset(n->str, 0, QPU_NAME_SLOT);
+	memcpy(n->str, str, len);
+	n->len = len;
+}
+
+static void fmt_table(qpu_name_t *n, const char **strs, int count) {
+	for (int i=0; i<count; i++)
+		fmt_name(&n[i], strs[i]);
+}
+
+static void qpu_fmt_init(void) {
+	static const char *ldi_elems[2][4] = {
+		{ "0", "1", "-2", "-1" },
+		{ "0", "1", "2", "3" },
+	};
+	static const char hexdigits[] = "0123456789abcdef";
+
+	if (fmt_ready)
+		return;
+
+	fmt_table(fmt_acc, acc_names, 6);
+	fmt_table(fmt_banka_r, banka_r, 64);
+	fmt_table(fmt_bankb_r, bankb_r, 64);
+	fmt_table(fmt_banka_w, banka_w, 64);
+	fmt_table(fmt_bankb_w, bankb_w, 64);
+	fmt_table(fmt_ops, ops, 16);
+	fmt_table(fmt_addops, addops, 33);
+	fmt_table(fmt_mulops, mulops, 9);
+	fmt_table(fmt_cc, cc, 8);
+	fmt_table(fmt_bcc, bcc, 16);
+	fmt_table(fmt_dstpackadd, dstpackadd, 16);
+	fmt_table(fmt_dstpackmul, dstpackmul, 16);
+	fmt_table(fmt_srcunpackadd, srcunpackadd, 8);
+	fmt_table(fmt_srcunpackmul, srcunpackmul, 8);
+	fmt_table(fmt_imm, imm, 64);
+	fmt_table(fmt_setf, setf, 2);
+	fmt_name(&fmt_empty, "");
+	fmt_name(&fmt_err, "err?");
+	fmt_name(&fmt_sacq, "sacq");
+	fmt_name(&fmt_srel, "srel");
+	fmt_name(&fmt_bra, "bra");
+	fmt_name(&fmt_brr, "brr");
+	fmt_name(&fmt_nop, "nop");
+
+	for (int i=0; i<4; i++) {
+		fmt_name(&fmt_ldi_elem[0][i], ldi_elems[0][i]);
+		fmt_name(&fmt_ldi_elem[1][i], ldi_elems[1][i]);
+	}
+
+	for (int i=0; i<256; i++) {
+		fmt_hex[i][0] = hexdigits[i >> 4];
+		fmt_hex[i][1] = hexdigits[i & 0xf];
+	}
+
+	fmt_ready = 1;
+}
+
+static inline char *put_name(char *p, const qpu_name_t *n) {
+	memcpy(p, n->str, QPU_NAME_SLOT);
+	return p + n->len;
+}
+
+static inline char *put_hex32(char *p, uint32_t v) {
+	memcpy(p + 0, fmt_hex[(v >> 24) & 0xff], 2);
+	memcpy(p + 2, fmt_hex[(v >> 16) & 0xff], 2);
+	memcpy(p + 4, fmt_hex[(v >>  8) & 0xff], 2);
+	memcpy(p + 6, fmt_hex[(v >>  0) & 0xff], 2);
+	return p + 8;
+}
+
+// As printf %+d
+static char *put_signed(char *p, int32_t v) {
+	char digits[10];
+	int n = 0;
+	uint32_t u = v < 0 ? 0u - (uint32_t)v : (uint32_t)v;
+
+	*p++ = v < 0 ? '-' : '+';
+	do {
+		digits[n++] = '0' + (u % 10);
+		u /= 10;
+	} while (u);
+
+	while (n)
+		*p++ = digits[--n];
 
+	return p;
+}
+
+#define PUT_LIT(p, lit) (memcpy((p), (lit), sizeof(lit) - 1), (p) + sizeof(lit) - 1)
+
+// Mirrors the operand selection of the original printf disassembler, a
+// rotated operand is the register name followed by the rotation
+static char *fmt_r(char *p, uint32_t ra, uint32_t rb, uint32_t adda, uint32_t op, int rotator) {
 	if (op == 13) {
 		if (rb<48) {
-			if (adda==6) return banka_r[ra];
-			if (adda==7) return imm[rb];
+			if (adda==6) return put_name(p, &fmt_banka_r[ra]);
+			if (adda==7) return put_name(p, &fmt_imm[rb]);
 		}
 		else {
-			if ((adda<6) && rotator) {
-				char *tmp = tmpalloc(32);
-				sprintf(tmp, "%s%s", acc_names[adda], imm[rb]);
-				return tmp;
-			}
-			if ((adda==6) && rotator) {
-				char *tmp = tmpalloc(32);
-				sprintf(tmp, "%s%s", banka_r[ra], imm[rb]);
-				return tmp;
-			}
-			if ((adda==7) && rotator) {
-				return "err?";
-			}
+			if ((adda<6) && rotator)
+				return put_name(put_name(p, &fmt_acc[adda]), &fmt_imm[rb]);
+			if ((adda==6) && rotator)
+				return put_name(put_name(p, &fmt_banka_r[ra]), &fmt_imm[rb]);
+			if ((adda==7) && rotator)
+				return put_name(p, &fmt_err);
 		}
 	}
 
-	if (adda==6) return banka_r[ra];
-	if (adda==7) return bankb_r[rb];
-	return acc_names[adda];
+	if (adda==6) return put_name(p, &fmt_banka_r[ra]);
+	if (adda==7) return put_name(p, &fmt_bankb_r[rb]);
+	return put_name(p, &fmt_acc[adda]);
 }
 
-const char *qpu_w_add(uint32_t wa, uint32_t X) {
-	return X ? bankb_w[wa] : banka_w[wa];
+static inline const qpu_name_t *fmt_w_add(uint32_t wa, uint32_t X) {
+	return X ? &fmt_bankb_w[wa] : &fmt_banka_w[wa];
 }
 
-const char *qpu_w_mul(uint32_t wb, uint32_t X) {
-	return X ? banka_w[wb] : bankb_w[wb];
+static inline const qpu_name_t *fmt_w_mul(uint32_t wb, uint32_t X) {
+	return X ? &fmt_banka_w[wb] : &fmt_bankb_w[wb];
 }
 
-const char *qpu_unpack_add(uint32_t packmul, uint32_t unpack, uint32_t adda) {
+static inline const qpu_name_t *fmt_unpack_add(uint32_t packmul, uint32_t unpack, uint32_t adda) {
 	if ((packmul == 0) && (adda == 6))
-		return srcunpackadd[unpack];
+		return &fmt_srcunpackadd[unpack];
 	if ((packmul == 1) && (adda == 4))
-		return srcunpackmul[unpack];
-	return "";
+		return &fmt_srcunpackmul[unpack];
+	return &fmt_empty;
 }
 
-const char *qpu_unpack_mul(uint32_t packmul, uint32_t unpack, uint32_t adda) {
+static inline const qpu_name_t *fmt_unpack_mul(uint32_t packmul, uint32_t unpack, uint32_t adda) {
 	if ((packmul == 0) && (adda == 6))
-		return srcunpackmul[unpack];
+		return &fmt_srcunpackmul[unpack];
 	if ((packmul == 1) && (adda == 4))
-		return srcunpackmul[unpack];
-	return "";
+		return &fmt_srcunpackmul[unpack];
+	return &fmt_empty;
 }
 
-const char *qpu_pack_add(uint32_t packmul, uint32_t pack, uint32_t wa, uint32_t X) {
+static inline const qpu_name_t *fmt_pack_add(uint32_t packmul, uint32_t pack, uint32_t wa, uint32_t X) {
 	if ((packmul == 0) && (X==0) && (wa<=32)) //todo: what is the real limit on ra range?
-		return dstpackadd[pack];
-	return "";
+		return &fmt_dstpackadd[pack];
+	return &fmt_empty;
 }
 
-const char *qpu_pack_mul(uint32_t packmul, uint32_t pack, uint32_t wa, uint32_t X) {
+static inline const qpu_name_t *fmt_pack_mul(uint32_t packmul, uint32_t pack, uint32_t wa, uint32_t X) {
 	if ((packmul == 0) && (X==1) && (wa<=32)) //todo: what is the real limit on ra range?
-		return dstpackmul[pack];
+		return &fmt_dstpackmul[pack];
 	if (packmul == 1)
-		return dstpackmul[pack];
-	return "";
+		return &fmt_dstpackmul[pack];
+	return &fmt_empty;
 }
 
-void show_qpu_add_mul(uint32_t i0, uint32_t i1)
+static char *fmt_add_mul(char *p, uint32_t i0, uint32_t i1)
 {
 	uint32_t mulop = (i0 >> 29) & 0x7;
 	uint32_t addop = (i0 >> 24) & 0x1f;
@@ -221,23 +522,13 @@ void show_qpu_add_mul(uint32_t i0, uint32_t i1)
 	uint32_t wa    = (i1 >> 6) & 0x3f;
 	uint32_t wb    = (i1 >> 0) & 0x3f;
 
-	if (showfields) {
-		printf("mulop=%d, addop=%d, ra=%d, rb=%d, adda=%d, addb=%d, mula=%d, mulb=%d, op=%d, unpacking=%d, packmul=%d, packing=%d, addcc=%d, mulcc=%d, F=%d, X=%d, wa=%d, wb=%d  ",
-			mulop, addop, ra, rb, adda, addb, mula, mulb, op, unpacking, packmul, packing, addcc, mulcc, F, X, wa, wb);
-	}
-
 	uint32_t addF  = (F==1) && (addop != 0) && (addcc != 0);
 	uint32_t mulF  = (F==1) && !addF;
 
 	// Instruction formats:
 	// op[cc][setf]
-	// op[cc][setf] rd[.pack]
 	// op[cc][setf] rd[.pack], ra[.unpack]
 	// op[cc][setf] rd[.pack], ra[.unpack], rb[.unpack]
-	const char *args[] = {
-		"", " %s%s", " %s%s, %s%s", " %s%s, %s%s, %s%s"
-	};
-
 	uint32_t arity = 3;
 	if (addop == 0) {
 		arity = 0;
@@ -249,39 +540,66 @@ void show_qpu_add_mul(uint32_t i0, uint32_t i1)
 	}
 
 	// add op always
-	printf("%s%s%s", addops[addop], cc[addcc], setf[addF]);
-	printf(args[arity], qpu_w_add(wa, X), qpu_pack_add(packmul, packing, wa, X), qpu_r(ra, rb, adda, op, 0), qpu_unpack_add(packmul, unpacking, adda), qpu_r(ra, rb, addb, op, 0), qpu_unpack_add(packmul, unpacking, addb));
+	p = put_name(p, &fmt_addops[addop]);
+	p = put_name(p, &fmt_cc[addcc]);
+	p = put_name(p, &fmt_setf[addF]);
+	if (arity) {
+		*p++ = ' ';
+		p = put_name(p, fmt_w_add(wa, X));
+		p = put_name(p, fmt_pack_add(packmul, packing, wa, X));
+		p = PUT_LIT(p, ", ");
+		p = fmt_r(p, ra, rb, adda, op, 0);
+		p = put_name(p, fmt_unpack_add(packmul, unpacking, adda));
+		if (arity == 3) {
+			p = PUT_LIT(p, ", ");
+			p = fmt_r(p, ra, rb, addb, op, 0);
+			p = put_name(p, fmt_unpack_add(packmul, unpacking, addb));
+		}
+	}
 
 	// show mul op if non nop or control op is non nop
-        if (mulop || (op != 1)) {
-
-		uint32_t arity = 3;
+	if (mulop || (op != 1)) {
+		arity = 3;
 		if (mulop == 0) {
 			arity = 0;
 			mulcc = 1;
 		}
 		else if ((mula == mulb) && (mulop == 4)) {
 			arity = 2;
-			if (mulop == 4) mulop = 8;
+			mulop = 8;
 		}
 
-		printf("; %s%s%s", mulops[mulop], cc[mulcc], setf[mulF]);
-		///* 000003a0: 36020037 18025841 */  xor r1, r0, r0; fmul ra1, ra0, unif
-		printf(args[arity], qpu_w_mul(wb, X), qpu_pack_mul(packmul, packing, wb, X), qpu_r(ra, rb, mula, op, 1), qpu_unpack_mul(packmul, unpacking, mula), qpu_r(ra, rb, mulb, op, 1), qpu_unpack_mul(packmul, unpacking, mulb));
+		p = PUT_LIT(p, "; ");
+		p = put_name(p, &fmt_mulops[mulop]);
+		p = put_name(p, &fmt_cc[mulcc]);
+		p = put_name(p, &fmt_setf[mulF]);
+		if (arity) {
+			*p++ = ' ';
+			p = put_name(p, fmt_w_mul(wb, X));
+			p = put_name(p, fmt_pack_mul(packmul, packing, wb, X));
+			p = PUT_LIT(p, ", ");
+			p = fmt_r(p, ra, rb, mula, op, 1);
+			p = put_name(p, fmt_unpack_mul(packmul, unpacking, mula));
+			if (arity == 3) {
+				p = PUT_LIT(p, ", ");
+				p = fmt_r(p, ra, rb, mulb, op, 1);
+				p = put_name(p, fmt_unpack_mul(packmul, unpacking, mulb));
+			}
+		}
 	}
 
 	// show control op if non nop
 	if ((op != 1) && (op != 13)) {
-		printf("; %s", ops[op]);
+		p = PUT_LIT(p, "; ");
+		p = put_name(p, &fmt_ops[op]);
 	}
-	printf("\n");
 
+	return p;
 }
 
-void show_qpu_branch(uint32_t i0, uint32_t i1)
+static char *fmt_branch(char *p, uint32_t i0, uint32_t i1, uint32_t base)
 {
 	uint32_t addr     = i0;
-	uint32_t unknown  = (i1 >> 24) & 0x0f;
 	uint32_t cond     = (i1 >> 20) & 0x0f;
 	uint32_t pcrel    = (i1 >> 19) & 0x01;
 	uint32_t addreg   = (i1 >> 18) & 0x01;
@@ -290,45 +608,55 @@ void show_qpu_branch(uint32_t i0, uint32_t i1)
 	uint32_t wa       = (i1 >>  6) & 0x3f;
 	uint32_t wb       = (i1 >>  0) & 0x3f;
 
-	if (showfields) {
-		printf("branch addr=0x%08x, unknown=%x, cond=%02d, pcrel=%x, addreg=%x, ra=%02d, X=%x, wa=%02d, wb=%02x\n",
-			addr, unknown, cond, pcrel, addreg, ra, X, wa, wb);
-	}
 	// branch: b[link][cc] [linkreg,] [basedreg,]
-	if (wa==39) 
-		printf("%s%s %s, %s%+d", pcrel ? "brr" : "bra", bcc[cond], qpu_w_mul(wb, X), addreg ? qpu_r(ra, ra, 6, (i1 >> 28)&0xf, 0) : "", addr);
-	else if (wb==39)
-		printf("%s%s %s, %s%+d", pcrel ? "brr" : "bra", bcc[cond], qpu_w_add(wa, X), addreg ? qpu_r(ra, ra, 6, (i1 >> 28)&0xf, 0) : "", addr);
-	else 
-		printf("%s%s %s, %s, %s%+d", pcrel ? "brr" : "bra", bcc[cond], qpu_w_add(wa, X), qpu_w_mul(wb, X), addreg ? qpu_r(ra, ra, 6, (i1 >> 28)&0xf, 0) : "", addr);
-	
-	if (!addreg) printf(" // 0x%08x", base+addr+8*4);
-	printf("\n");
+	p = put_name(p, pcrel ? &fmt_brr : &fmt_bra);
+	p = put_name(p, &fmt_bcc[cond]);
+	*p++ = ' ';
+	if (wa==39) {
+		p = put_name(p, fmt_w_mul(wb, X));
+	}
+	else if (wb==39) {
+		p = put_name(p, fmt_w_add(wa, X));
+	}
+	else {
+		p = put_name(p, fmt_w_add(wa, X));
+		p = PUT_LIT(p, ", ");
+		p = put_name(p, fmt_w_mul(wb, X));
+	}
+	p = PUT_LIT(p, ", ");
+	if (addreg)
+		p = put_name(p, &fmt_banka_r[ra]);
+	p = put_signed(p, (int32_t)addr);
+
+	if (!addreg) {
+		p = PUT_LIT(p, " // 0x");
+		p = put_hex32(p, base+addr+8*4);
+	}
 
+	return p;
 }
 
-const char *qpu_ldi_unpack(uint32_t unpack, uint32_t data)
+static char *fmt_ldi_unpack(char *p, uint32_t unpack, uint32_t data)
 {
-	char *tmp = tmpalloc(128);
 	// unpack = 1 (2 bit signed vectors), 3 = (2 bit unsigned vectors);
 	if ((unpack==1) || (unpack==3)) {
-		int d[16];
+		const qpu_name_t *elems = fmt_ldi_elem[unpack >> 1];
+		*p++ = '[';
 		for (int i=0; i<16; i++) {
-			d[i] = ((data >> (16+i-1))&0x2) | ((data >> i) & 0x1);
-			if ((unpack == 1) && d[i] &0x2)
-				d[i] |= 0xfffffffc;
+			uint32_t d = ((data >> (16+i-1))&0x2) | ((data >> i) & 0x1);
+			if (i) p = PUT_LIT(p, ", ");
+			p = put_name(p, &elems[d]);
 		}
-		sprintf(tmp, "[%d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d]",
-			d[0], d[1], d[2], d[3], d[4], d[5], d[6], d[7],
-			d[8], d[9], d[10], d[11], d[12], d[13], d[14], d[15]);
+		*p++ = ']';
 	}
 	else {
-		sprintf(tmp, "0x%08x", data);
+		p = PUT_LIT(p, "0x");
+		p = put_hex32(p, data);
 	}
-	return tmp;
+	return p;
 }
 
-void show_qpu_imm32(uint32_t i0, uint32_t i1)
+static char *fmt_imm32(char *p, uint32_t i0, uint32_t i1)
 {
 	uint32_t data = i0;
 	uint32_t packbits  = (i1 >> 20) & 0xff;
@@ -342,49 +670,133 @@ void show_qpu_imm32(uint32_t i0, uint32_t i1)
 	uint32_t wa      = (i1 >>  6) & 0x3f;
 	uint32_t wb      = (i1 >>  0) & 0x3f;
 
-	if (showfields) {
-		printf("imm32 data=0x%08x, unpacking=0x%d, packmul=%d, packing=%d, addcc=%x, mulcc=%x, F=%x, X=%x, wa=%02d, wb=%02d\n",
-			data, unpacking, packmul, packing, addcc, mulcc, F, X, wa, wb);
-	}
-
-	const char *inst = ops[(i1 >> 28) & 0xf];
+	const qpu_name_t *inst = &fmt_ops[(i1 >> 28) & 0xf];
 
 	if (unpacking & 0x4) {
-		inst = (data & 0x10) ? "sacq" : "srel";
+		inst = (data & 0x10) ? &fmt_sacq : &fmt_srel;
 		if (data <= 0x1f)
 			data = data & 0xffffffef;
 	}
 
 	// addop: op[cc][setf] rd[.pack?], immediate
-	if (packbits==0 && addcc==0 && wa==39)
-		printf("nop");
-	else
-		printf("%s%s%s %s%s, %s", inst, cc[addcc], setf[F], qpu_w_add(wa, X), qpu_pack_add(packmul, packing, wa, X), qpu_ldi_unpack(unpacking, data));
+	if (packbits==0 && addcc==0 && wa==39) {
+		p = put_name(p, &fmt_nop);
+	}
+	else {
+		p = put_name(p, inst);
+		p = put_name(p, &fmt_cc[addcc]);
+		p = put_name(p, &fmt_setf[F]);
+		*p++ = ' ';
+		p = put_name(p, fmt_w_add(wa, X));
+		p = put_name(p, fmt_pack_add(packmul, packing, wa, X));
+		p = PUT_LIT(p, ", ");
+		p = fmt_ldi_unpack(p, unpacking, data);
+	}
 
 	// mulop: [op[cc][setf] rd[.pack?], immediate
 	if (mulcc) {
-		printf("; %s%s%s %s%s, %s", inst, cc[mulcc], setf[F], qpu_w_mul(wb, X), qpu_pack_mul(packmul, packing, wa, X), qpu_ldi_unpack(unpacking, data));
+		p = PUT_LIT(p, "; ");
+		p = put_name(p, inst);
+		p = put_name(p, &fmt_cc[mulcc]);
+		p = put_name(p, &fmt_setf[F]);
+		*p++ = ' ';
+		p = put_name(p, fmt_w_mul(wb, X));
+		p = put_name(p, fmt_pack_mul(packmul, packing, wa, X));
+		p = PUT_LIT(p, ", ");
+		p = fmt_ldi_unpack(p, unpacking, data);
 	}
 
-	printf("\n");
+	return p;
 }
 
-void show_qpu_inst(uint32_t *inst) {
+int qpu_format_inst(char *buf, uint32_t *inst, uint32_t base) {
 	uint32_t i0 = inst[0];
 	uint32_t i1 = inst[1];
+	char *p = buf;
+
+	qpu_fmt_init();
 
 	int op = (i1 >> 28) & 0xf;
-	if (op<14) show_qpu_add_mul(i0, i1);
-	if (op==14) show_qpu_imm32(i0, i1);
-	if (op==15) show_qpu_branch(i0, i1);
+	if (op<14) p = fmt_add_mul(p, i0, i1);
+	if (op==14) p = fmt_imm32(p, i0, i1);
+	if (op==15) p = fmt_branch(p, i0, i1, base);
+	*p++ = '\n';
+	*p = 0;
+
+	return p - buf;
+}
+
+int qpu_format_line(char *buf, uint32_t *inst, uint32_t base) {
+	char *p = buf;
+
+	qpu_fmt_init();
+
+	p = PUT_LIT(p, "/* ");
+	p = put_hex32(p, base);
+	p = PUT_LIT(p, ": ");
+	p = put_hex32(p, inst[0]);
+	*p++ = ' ';
+	p = put_hex32(p, inst[1]);
+	p = PUT_LIT(p, " */  ");
+
+	return (p - buf) + qpu_format_inst(p, inst, base);
+}
+
+static void show_qpu_fields(uint32_t i0, uint32_t i1)
+{
+	int op = (i1 >> 28) & 0xf;
+
+	if (op<14) {
+		printf("mulop=%d, addop=%d, ra=%d, rb=%d, adda=%d, addb=%d, mula=%d, mulb=%d, op=%d, unpacking=%d, packmul=%d, packing=%d, addcc=%d, mulcc=%d, F=%d, X=%d, wa=%d, wb=%d  ",
+			(i0 >> 29) & 0x7, (i0 >> 24) & 0x1f, (i0 >> 18) & 0x3f, (i0 >> 12) & 0x3f, (i0 >> 9) & 0x7, (i0 >> 6) & 0x7, (i0 >> 3) & 0x7, i0 & 0x7,
+			op, (i1 >> 25) & 0x7, (i1 >> 24) & 0x1, (i1 >> 20) & 0xf, (i1 >> 17) & 0x7, (i1 >> 14) & 0x7, (i1 >> 13) & 0x1, (i1 >> 12) & 0x1, (i1 >> 6) & 0x3f, i1 & 0x3f);
+	}
+	if (op==14) {
+		printf("imm32 data=0x%08x, unpacking=0x%d, packmul=%d, packing=%d, addcc=%x, mulcc=%x, F=%x, X=%x, wa=%02d, wb=%02d\n",
+			i0, (i1 >> 25) & 0x7, (i1 >> 24) & 0x1, (i1 >> 20) & 0xf, (i1 >> 17) & 0x7, (i1 >> 14) & 0x7, (i1 >> 13) & 0x1, (i1 >> 12) & 0x1, (i1 >> 6) & 0x3f, i1 & 0x3f);
+	}
+	if (op==15) {
+		printf("branch addr=0x%08x, unknown=%x, cond=%02d, pcrel=%x, addreg=%x, ra=%02d, X=%x, wa=%02d, wb=%02x\n",
+			i0, (i1 >> 24) & 0xf, (i1 >> 20) & 0xf, (i1 >> 19) & 0x1, (i1 >> 18) & 0x1, (i1 >> 13) & 0x1f, (i1 >> 12) & 0x1, (i1 >> 6) & 0x3f, i1 & 0x3f);
+	}
+}
+
+void show_qpu_inst(uint32_t *inst) {
+	char line[QPU_FMT_LINE_MAX];
+
+	if (showfields)
+		show_qpu_fields(inst[0], inst[1]);
+
+	fwrite(line, 1, qpu_format_inst(line, inst, base), stdout);
 }
 
+#define QPU_FMT_CHUNK (64 * QPU_FMT_LINE_MAX)
+
 void show_qpu_fragment(uint32_t *inst, int length) {
+	char out[QPU_FMT_CHUNK];
+	char *p = out;
 	uint32_t i = 0;
+	STATS_BEGIN(STATS_QPU_FORMAT);
+
+	STATS_COUNT(STATS_QPU_INSTS, length / 2);
+
 	for(;i<length; i+=2) {
 		base = i*4;
-		printf("/* %08x: %08x %08x */  ", i*4, inst[i], inst[i+1]); show_qpu_inst(&inst[i]);
+		if (showfields) {
+			fwrite(out, 1, p - out, stdout);
+			p = out;
+			printf("/* %08x: %08x %08x */  ", i*4, inst[i], inst[i+1]);
+			show_qpu_inst(&inst[i]);
+			continue;
+		}
+
+		if (p + QPU_FMT_LINE_MAX > out + QPU_FMT_CHUNK) {
+			fwrite(out, 1, p - out, stdout);
+			p = out;
+		}
+		p += qpu_format_line(p, &inst[i], base);
 	}
-	printf("\n");
+	*p++ = '\n';
+	fwrite(out, 1, p - out, stdout);
+	STATS_END(STATS_QPU_FORMAT);
 }
-
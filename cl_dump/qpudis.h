@@ -1,5 +1,81 @@
 //QPU disassembly code from hermanhermitage: https://github.com/hermanhermitage/videocoreiv-qpu
 
+//Buffers passed to qpu_format_inst/qpu_format_line must be at least this big
+#define QPU_FMT_LINE_MAX 256
+
+// Register and signal (ops) name tables used by the disassembly
+extern const char *acc_names[];
+extern const char *banka_r[64], *bankb_r[64], *banka_w[64], *bankb_w[64];
+extern const char *ops[];
+
 void show_qpu_inst(uint32_t *inst);
 void show_qpu_fragment(uint32_t *inst, int length);
 
+//Formats one instruction as show_qpu_inst would print it (including the
+//newline), base is the instruction's byte offset used for branch targets.
+//Returns the length written, the buffer is also NUL terminated.
+int qpu_format_inst(char *buf, uint32_t *inst, uint32_t base);
+//As qpu_format_inst prefixed with the /* offset: words */ column of
+//show_qpu_fragment
+int qpu_format_line(char *buf, uint32_t *inst, uint32_t base);
+
+// Decoded fields of one instruction (see the unpacking notes in qpudis.c).
+// Fields that don't apply to the instruction's type are zeroed, raddrs not
+// read are 39 (nop).
+typedef struct {
+	uint32_t i0, i1;
+	uint32_t sig;
+	uint32_t addop, mulop;
+	uint32_t raddr_a, raddr_b;
+	uint32_t adda, addb, mula, mulb;
+	uint32_t packbits;
+	uint32_t addcc, mulcc;
+	uint32_t sf, ws;
+	uint32_t waddr_add, waddr_mul;
+	uint32_t cond, pcrel, addreg; // branches
+	uint32_t imm;                 // ldi data or branch offset
+} qpu_inst_t;
+
+#define QPU_SIG_BKPT      0
+#define QPU_SIG_NONE      1
+#define QPU_SIG_THRSW     2
+#define QPU_SIG_THREND    3
+#define QPU_SIG_SBWAIT    4
+#define QPU_SIG_SBDONE    5
+#define QPU_SIG_LTHRSW    6
+#define QPU_SIG_LDTMU0    10
+#define QPU_SIG_LDTMU1    11
+#define QPU_SIG_SMALL_IMM 13
+#define QPU_SIG_LDI       14
+#define QPU_SIG_BRANCH    15
+
+// Register and peripheral use of an instruction, regfile A/B as bitmasks of
+// locations 0-31, accumulators and flags in acc.
+typedef struct {
+	uint32_t ra;
+	uint32_t rb;
+	uint32_t acc;
+	uint32_t io;
+} qpu_regs_t;
+
+#define QPU_ACC(n) (1u << (n))
+#define QPU_FLAGS  (1u << 6)
+
+#define QPU_IO_UNIF   (1u << 0)
+#define QPU_IO_VARY   (1u << 1)
+#define QPU_IO_VPM    (1u << 2)
+#define QPU_IO_TMU0   (1u << 3)
+#define QPU_IO_TMU1   (1u << 4)
+#define QPU_IO_SFU    (1u << 5)
+#define QPU_IO_TLB    (1u << 6)
+#define QPU_IO_MUTEX  (1u << 7)
+#define QPU_IO_SEMA   (1u << 8)
+#define QPU_IO_THREAD (1u << 9)
+#define QPU_IO_BRANCH (1u << 10)
+#define QPU_IO_OTHER  (1u << 11)
+
+void qpu_decode(uint32_t *inst, qpu_inst_t *d);
+int qpu_is_nop(const qpu_inst_t *d);
+int qpu_add_active(const qpu_inst_t *d);
+int qpu_mul_active(const qpu_inst_t *d);
+void qpu_inst_regs(const qpu_inst_t *d, qpu_regs_t *reads, qpu_regs_t *writes);
@@ -0,0 +1,437 @@
+/*
+ * v3d_counters.c - Programming and sampling of the V3D performance counters
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+
+#include "cl_dump.h"
+
+//Physical address of the V3D register block on BCM2835 (Pi 1/Zero), Pi 2/3
+//need --regs 0x3fc00000
+#define V3D_REGS_BASE 0x20c00000
+#define V3D_REGS_SIZE 0x1000
+
+#define V3D_BFC   0x134 //Binning flush count
+#define V3D_RFC   0x138 //Rendering frame count
+#define V3D_PCTRC 0x670 //Performance counter clear
+#define V3D_PCTRE 0x674 //Performance counter enables
+#define V3D_PCTR(n)  (0x680 + (n) * 8) //Performance counter count
+#define V3D_PCTRS(n) (0x684 + (n) * 8) //Performance counter source select
+
+#define V3D_PCTRE_EN (1u << 31)
+
+#define V3D_NUM_PCTR 16
+
+//If no rendered frame completes in this time whilst sampling per frame give up
+#define FRAME_TIMEOUT_MS 5000
+
+#define FORMAT_CSV   0
+#define FORMAT_JSONL 1
+
+#define NUM_PCTR_SOURCES 30
+
+//Counter sources, indexed by the value written to PCTRS
+static const char* pctr_source_names[NUM_PCTR_SOURCES] = {
+   "fep_valid_prims_no_pixels",
+   "fep_valid_prims",
+   "fep_ez_nf_clipped_quads",
+   "fep_valid_quads",
+   "tlb_quads_no_stencil_pass",
+   "tlb_quads_no_z_stencil_pass",
+   "tlb_quads_z_stencil_pass",
+   "tlb_quads_zero_cvg",
+   "tlb_quads_nonzero_cvg",
+   "tlb_quads_written",
+   "ptb_prims_viewport_discard",
+   "ptb_prims_need_clip",
+   "pse_prims_reverse_discard",
+   "qpu_idle_cycles",
+   "qpu_vs_cycles",
+   "qpu_fs_cycles",
+   "qpu_valid_cycles",
+   "qpu_tmu_stall_cycles",
+   "qpu_sb_stall_cycles",
+   "qpu_vary_stall_cycles",
+   "qpu_icache_hits",
+   "qpu_icache_misses",
+   "qpu_ucache_hits",
+   "qpu_ucache_misses",
+   "tmu_quads",
+   "tmu_cache_misses",
+   "vpm_vdw_stall_cycles",
+   "vpm_vcd_stall_cycles",
+   "l2c_hits",
+   "l2c_misses"
+};
+
+#define PCTR_SRC_QPU_IDLE      13
+#define PCTR_SRC_QPU_VS        14
+#define PCTR_SRC_QPU_FS        15
+#define PCTR_SRC_QPU_VALID     16
+#define PCTR_SRC_QPU_TMU_STALL 17
+#define PCTR_SRC_TMU_QUADS     24
+#define PCTR_SRC_TMU_MISSES    25
+#define PCTR_SRC_L2C_HITS      28
+#define PCTR_SRC_L2C_MISSES    29
+
+//Used when --counters isn't given, covers everything the derived metrics need
+static const uint32_t default_sources[] = {
+   PCTR_SRC_QPU_IDLE, PCTR_SRC_QPU_VS, PCTR_SRC_QPU_FS, PCTR_SRC_QPU_VALID,
+   PCTR_SRC_QPU_TMU_STALL, 18, 19, 20, 21, 22, 23, PCTR_SRC_TMU_QUADS,
+   PCTR_SRC_TMU_MISSES, PCTR_SRC_L2C_HITS, PCTR_SRC_L2C_MISSES
+};
+
+typedef struct {
+   uint32_t num_counters;
+   uint32_t sources[V3D_NUM_PCTR];
+   uint32_t format;
+   int      per_frame;
+   uint32_t interval_ms;
+   uint32_t num_samples; //0 == until interrupted
+   uint32_t regs_base;
+} counters_cfg_t;
+
+static volatile sig_atomic_t stop_sampling = 0;
+
+static void handle_sigint(int sig) {
+   stop_sampling = 1;
+}
+
+static uint32_t read_reg(volatile void* regs, uint32_t offset) {
+   return *(volatile uint32_t*)((volatile uint8_t*)regs + offset);
+}
+
+static void write_reg(volatile void* regs, uint32_t offset, uint32_t val) {
+   *(volatile uint32_t*)((volatile uint8_t*)regs + offset) = val;
+}
+
+static double now_ms(void) {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void sleep_ms(uint32_t ms) {
+   struct timespec ts;
+
+   ts.tv_sec  = ms / 1000;
+   ts.tv_nsec = (ms % 1000) * 1000000;
+
+   nanosleep(&ts, 0);
+}
+
+static int parse_source(char* str, uint32_t* source) {
+   uint32_t i;
+
+   if(sscanf(str, "%u", source) == 1) {
+      return *source >= NUM_PCTR_SOURCES;
+   }
+
+   for(i = 0;i < NUM_PCTR_SOURCES; ++i) {
+      if(strcmp(str, pctr_source_names[i]) == 0) {
+         *source = i;
+         return 0;
+      }
+   }
+
+   return 1;
+}
+
+static int parse_sources(char* list, counters_cfg_t* cfg) {
+   char* tok;
+
+   cfg->num_counters = 0;
+
+   for(tok = strtok(list, ","); tok; tok = strtok(0, ",")) {
+      if(cfg->num_counters == V3D_NUM_PCTR) {
+         fprintf(stderr, "At most %d counters can be sampled at once\n", V3D_NUM_PCTR);
+         return 1;
+      }
+
+      if(parse_source(tok, &cfg->sources[cfg->num_counters])) {
+         fprintf(stderr, "Unknown counter source %s\n", tok);
+         return 1;
+      }
+
+      cfg->num_counters++;
+   }
+
+   return cfg->num_counters == 0;
+}
+
+//Returns index of the counter sampling the given source or -1 if not sampled
+static int find_source(counters_cfg_t* cfg, uint32_t source) {
+   uint32_t i;
+
+   for(i = 0;i < cfg->num_counters; ++i) {
+      if(cfg->sources[i] == source)
+         return i;
+   }
+
+   return -1;
+}
+
+static int have_sources(counters_cfg_t* cfg, uint32_t a, uint32_t b) {
+   return find_source(cfg, a) >= 0 && find_source(cfg, b) >= 0;
+}
+
+static double delta_of(counters_cfg_t* cfg, uint32_t* deltas, uint32_t source) {
+   return deltas[find_source(cfg, source)];
+}
+
+static double ratio(double num, double denom) {
+   return denom == 0.0 ? 0.0 : num / denom;
+}
+
+static void program_counters(volatile void* regs, counters_cfg_t* cfg) {
+   uint32_t i;
+   uint32_t enable_mask = 0;
+
+   write_reg(regs, V3D_PCTRE, 0);
+
+   for(i = 0;i < cfg->num_counters; ++i) {
+      write_reg(regs, V3D_PCTRS(i), cfg->sources[i]);
+      enable_mask |= 1 << i;
+   }
+
+   write_reg(regs, V3D_PCTRC, enable_mask);
+   write_reg(regs, V3D_PCTRE, enable_mask | V3D_PCTRE_EN);
+}
+
+static void read_counters(volatile void* regs, counters_cfg_t* cfg, uint32_t* values) {
+   uint32_t i;
+
+   for(i = 0;i < cfg->num_counters; ++i) {
+      values[i] = read_reg(regs, V3D_PCTR(i));
+   }
+}
+
+static void print_header(counters_cfg_t* cfg) {
+   uint32_t i;
+
+   if(cfg->format != FORMAT_CSV)
+      return;
+
+   printf("time_ms");
+   if(cfg->per_frame)
+      printf(",frame");
+
+   for(i = 0;i < cfg->num_counters; ++i) {
+      printf(",%s", pctr_source_names[cfg->sources[i]]);
+   }
+
+   if(have_sources(cfg, PCTR_SRC_QPU_IDLE, PCTR_SRC_QPU_VS) && find_source(cfg, PCTR_SRC_QPU_FS) >= 0)
+      printf(",qpu_util");
+   if(have_sources(cfg, PCTR_SRC_QPU_VALID, PCTR_SRC_QPU_TMU_STALL))
+      printf(",tmu_stall_ratio");
+   if(have_sources(cfg, PCTR_SRC_TMU_QUADS, PCTR_SRC_TMU_MISSES))
+      printf(",tmu_miss_ratio");
+   if(have_sources(cfg, PCTR_SRC_L2C_HITS, PCTR_SRC_L2C_MISSES))
+      printf(",l2c_hit_ratio");
+
+   printf("\n");
+}
+
+static void print_metric(counters_cfg_t* cfg, const char* name, double value) {
+   if(cfg->format == FORMAT_CSV) {
+      printf(",%.4f", value);
+   } else {
+      printf(", \"%s\": %.4f", name, value);
+   }
+}
+
+static void print_derived(counters_cfg_t* cfg, uint32_t* deltas) {
+   if(have_sources(cfg, PCTR_SRC_QPU_IDLE, PCTR_SRC_QPU_VS) && find_source(cfg, PCTR_SRC_QPU_FS) >= 0) {
+      double busy = delta_of(cfg, deltas, PCTR_SRC_QPU_VS) + delta_of(cfg, deltas, PCTR_SRC_QPU_FS);
+
+      print_metric(cfg, "qpu_util", ratio(busy, busy + delta_of(cfg, deltas, PCTR_SRC_QPU_IDLE)));
+   }
+
+   if(have_sources(cfg, PCTR_SRC_QPU_VALID, PCTR_SRC_QPU_TMU_STALL)) {
+      print_metric(cfg, "tmu_stall_ratio",
+         ratio(delta_of(cfg, deltas, PCTR_SRC_QPU_TMU_STALL), delta_of(cfg, deltas, PCTR_SRC_QPU_VALID)));
+   }
+
+   if(have_sources(cfg, PCTR_SRC_TMU_QUADS, PCTR_SRC_TMU_MISSES)) {
+      print_metric(cfg, "tmu_miss_ratio",
+         ratio(delta_of(cfg, deltas, PCTR_SRC_TMU_MISSES), delta_of(cfg, deltas, PCTR_SRC_TMU_QUADS)));
+   }
+
+   if(have_sources(cfg, PCTR_SRC_L2C_HITS, PCTR_SRC_L2C_MISSES)) {
+      double hits = delta_of(cfg, deltas, PCTR_SRC_L2C_HITS);
+
+      print_metric(cfg, "l2c_hit_ratio", ratio(hits, hits + delta_of(cfg, deltas, PCTR_SRC_L2C_MISSES)));
+   }
+}
+
+static void print_sample(counters_cfg_t* cfg, double time_ms, uint32_t frame, uint32_t* deltas) {
+   uint32_t i;
+
+   if(cfg->format == FORMAT_CSV) {
+      printf("%.3f", time_ms);
+      if(cfg->per_frame)
+         printf(",%u", frame);
+
+      for(i = 0;i < cfg->num_counters; ++i) {
+         printf(",%u", deltas[i]);
+      }
+
+      print_derived(cfg, deltas);
+      printf("\n");
+   } else {
+      printf("{\"time_ms\": %.3f", time_ms);
+      if(cfg->per_frame)
+         printf(", \"frame\": %u", frame);
+
+      for(i = 0;i < cfg->num_counters; ++i) {
+         printf(", \"%s\": %u", pctr_source_names[cfg->sources[i]], deltas[i]);
+      }
+
+      print_derived(cfg, deltas);
+      printf("}\n");
+   }
+
+   fflush(stdout);
+}
+
+//Waits for the rendering frame count to move on from last_frame.  Returns 1 on
+//timeout or interrupt.
+static int wait_for_frame(volatile void* regs, counters_cfg_t* cfg, uint32_t last_frame) {
+   double start = now_ms();
+
+   while(read_reg(regs, V3D_RFC) == last_frame) {
+      if(stop_sampling)
+         return 1;
+
+      if(now_ms() - start > FRAME_TIMEOUT_MS) {
+         fprintf(stderr, "No frame rendered within %d ms\n", FRAME_TIMEOUT_MS);
+         return 1;
+      }
+
+      sleep_ms(cfg->interval_ms);
+   }
+
+   return 0;
+}
+
+static int sample_counters(volatile void* regs, counters_cfg_t* cfg) {
+   uint32_t prev[V3D_NUM_PCTR];
+   uint32_t cur[V3D_NUM_PCTR];
+   uint32_t deltas[V3D_NUM_PCTR];
+   uint32_t sample;
+   uint32_t frame;
+   uint32_t i;
+   double   start_ms;
+
+   frame = read_reg(regs, V3D_RFC);
+   start_ms = now_ms();
+   read_counters(regs, cfg, prev);
+
+   for(sample = 0;!cfg->num_samples || sample < cfg->num_samples; ++sample) {
+      if(cfg->per_frame) {
+         if(wait_for_frame(regs, cfg, frame))
+            break;
+
+         frame = read_reg(regs, V3D_RFC);
+      } else {
+         sleep_ms(cfg->interval_ms);
+      }
+
+      if(stop_sampling)
+         break;
+
+      read_counters(regs, cfg, cur);
+
+      //Counters are free running 32-bit so unsigned subtraction deals with wrap
+      for(i = 0;i < cfg->num_counters; ++i) {
+         deltas[i] = cur[i] - prev[i];
+         prev[i]   = cur[i];
+      }
+
+      print_sample(cfg, now_ms() - start_ms, frame, deltas);
+   }
+
+   return 0;
+}
+
+int do_counters(int argc, char* argv[]) {
+   counters_cfg_t cfg;
+   volatile void* regs;
+   uint32_t old_enables;
+   int i;
+
+   memset(&cfg, 0, sizeof(counters_cfg_t));
+   cfg.regs_base = V3D_REGS_BASE;
+   cfg.format    = FORMAT_CSV;
+   cfg.num_counters = sizeof(default_sources) / sizeof(default_sources[0]);
+   memcpy(cfg.sources, default_sources, sizeof(default_sources));
+
+   if(argc < 2) {
+      fprintf(stderr, "counters needs interval_ms and num_samples\n");
+      return 1;
+   }
+
+   if(sscanf(argv[0], "%u", &cfg.interval_ms) != 1 || cfg.interval_ms == 0) {
+      fprintf(stderr, "interval_ms must be a non-zero decimal integer\n");
+      return 1;
+   }
+
+   if(sscanf(argv[1], "%u", &cfg.num_samples) != 1) {
+      fprintf(stderr, "num_samples must be a decimal integer\n");
+      return 1;
+   }
+
+   for(i = 2;i < argc; ++i) {
+      if(strcmp(argv[i], "--frame") == 0) {
+         cfg.per_frame = 1;
+      } else if(strcmp(argv[i], "--counters") == 0 && i + 1 < argc) {
+         if(parse_sources(argv[++i], &cfg))
+            return 1;
+      } else if(strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+         ++i;
+         if(strcmp(argv[i], "csv") == 0) {
+            cfg.format = FORMAT_CSV;
+         } else if(strcmp(argv[i], "jsonl") == 0) {
+            cfg.format = FORMAT_JSONL;
+         } else {
+            fprintf(stderr, "Format must be csv or jsonl\n");
+            return 1;
+         }
+      } else if(strcmp(argv[i], "--regs") == 0 && i + 1 < argc) {
+         if(sscanf(argv[++i], "0x%x", &cfg.regs_base) != 1) {
+            fprintf(stderr, "Register base must be of form 0x1234ABCD\n");
+            return 1;
+         }
+      } else {
+         fprintf(stderr, "Unknown counters option %s\n", argv[i]);
+         return 1;
+      }
+   }
+
+   regs = map_area(cfg.regs_base, V3D_REGS_SIZE);
+   if(!regs) {
+      fprintf(stderr, "Failed to map V3D registers\n");
+      return 1;
+   }
+
+   old_enables = read_reg(regs, V3D_PCTRE);
+   signal(SIGINT, handle_sigint);
+
+   program_counters(regs, &cfg);
+   print_header(&cfg);
+   sample_counters(regs, &cfg);
+
+   write_reg(regs, V3D_PCTRE, old_enables);
+   unmap_area((void*)regs, V3D_REGS_SIZE);
+
+   return 0;
+}
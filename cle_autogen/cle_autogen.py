@@ -292,44 +292,191 @@ def write_out_instr_emit_fun(instr, out_file):
 
 def write_out_calc_next_ins_fun(instrs, out_file):
     out_file.write('''void* calc_next_ins(void* cur_ins) {
-\tuint8_t* opcode = cur_ins;
+\tuint32_t size = v3d_instr_size(*(uint8_t*)cur_ins);
 \t
-\tswitch(*opcode) {
+\treturn size ? cur_ins + size : 0;
+}\n\n''')
+
+def write_out_instr_size_fun(instrs, out_file):
+    out_file.write('''//Size in bytes of the instruction with the given opcode, 0 if the opcode is invalid
+static inline uint32_t v3d_instr_size(uint8_t opcode) {
+\tswitch(opcode) {
 ''')
 
     for instr in instrs:
-        out_file.write('\t\tcase V3D_HW_INSTR_{0}: return cur_ins + sizeof(instr_{0}_t);\n'.format(instr.name))
+        out_file.write('\t\tcase V3D_HW_INSTR_{0}: return sizeof(instr_{0}_t);\n'.format(instr.name))
 
     out_file.write('''\t\tdefault: return 0;
 \t}
+}\n\n''')
+
+def write_out_instr_name_fun(instrs, out_file):
+    out_file.write('''//Name of the instruction with the given opcode, 0 if the opcode is invalid
+static inline const char* v3d_instr_name(uint8_t opcode) {
+\tswitch(opcode) {
+''')
+
+    for instr in instrs:
+        out_file.write('\t\tcase V3D_HW_INSTR_{0}: return "{0}";\n'.format(instr.name))
+
+    out_file.write('''\t\tdefault: return 0;
+\t}
+}\n\n''')
+
+def visit_params(instr):
+    params = 'instr_{0}_t* ins'.format(instr.name)
+    for a in instr.arguments:
+        params += ', {0} {1}'.format(choose_c_type(a), a[0])
+
+    return params
+
+def visit_args(instr):
+    args = 'ins'
+    for a in instr.arguments:
+        args += ', ins->{0}'.format(a[0])
+
+    return args
+
+def write_out_visitor_struct(instrs, out_file):
+    out_file.write('''//Per-opcode callbacks receiving the decoded fields of each instruction.  NULL
+//callbacks are skipped, a non-zero return stops the visit.
+typedef struct {
+''')
+
+    for instr in instrs:
+        out_file.write('\tint (*visit_{0})(void* ctx, {1});\n'.format(instr.name, visit_params(instr)))
+
+    out_file.write('''\t//Called on an invalid opcode, if NULL (or it returns non-zero) the visit stops
+\tint (*visit_invalid)(void* ctx, uint8_t* ins);
+} v3d_cl_visitor_t;\n\n''')
+
+def write_out_visit_instr_fun(instrs, out_file):
+    out_file.write('''//Dispatches the instruction at cur_ins to the matching visitor callback.
+//Returns the callback result (0 if there isn't one), -1 for an unhandled invalid
+//opcode.
+static inline int visit_instr(const v3d_cl_visitor_t* visitor, void* ctx, void* cur_ins) {
+\tswitch(*(uint8_t*)cur_ins) {
+''')
+
+    for instr in instrs:
+        out_file.write('''\t\tcase V3D_HW_INSTR_{0}: {{
+\t\t\tinstr_{0}_t* ins = (instr_{0}_t*)cur_ins;
+\t\t\treturn visitor->visit_{0} ? visitor->visit_{0}(ctx, {1}) : 0;
+\t\t}}
+'''.format(instr.name, visit_args(instr)))
+
+    out_file.write('''\t\tdefault: return visitor->visit_invalid ? visitor->visit_invalid(ctx, (uint8_t*)cur_ins) : -1;
+\t}
+}
+
+//Visits every instruction in [start, end).  Stops early when a callback
+//returns non-zero or an instruction would run past end, returning where it
+//stopped (end if the whole buffer was visited).  Invalid opcodes the visitor
+//accepts are skipped a byte at a time.
+static inline void* visit_cl(const v3d_cl_visitor_t* visitor, void* ctx, void* start, void* end) {
+\tuint8_t* cur_ins = (uint8_t*)start;
+\t
+\twhile(cur_ins < (uint8_t*)end) {
+\t\tuint32_t size = v3d_instr_size(*cur_ins);
+\t\t
+\t\tif(cur_ins + (size ? size : 1) > (uint8_t*)end)
+\t\t\tbreak;
+\t\t
+\t\tif(visit_instr(visitor, ctx, cur_ins))
+\t\t\tbreak;
+\t\t
+\t\tcur_ins += size ? size : 1;
+\t}
 \t
-\treturn 0; //Should never get here
+\treturn cur_ins;
 }\n\n''')
 
 def write_out_instr_disassemble_fun(instr, out_file):
-    out_file.write('''int disassemble_{0}(instr_{0}_t* ins, FILE* out) {{
+    out_file.write('''static int disassemble_visit_{0}(void* ctx, {1}) {{
+\tFILE* out = ctx;
+\t
 \tfprintf(out, "{0}\\n");
-'''.format(instr.name))
+'''.format(instr.name, visit_params(instr)))
 
     for a in instr.arguments:
-        out_file.write('\tfprintf(out, "\\t{0}: %x\\n", (uint32_t)ins->{0});\n'.format(a[0]))
+        out_file.write('\tfprintf(out, "\\t{0}: %x\\n", (uint32_t){0});\n'.format(a[0]))
 
-    out_file.write('}\n\n')
+    out_file.write('''\t
+\treturn 0;
+}}
+
+int disassemble_{0}(instr_{0}_t* ins, FILE* out) {{
+\treturn disassemble_visit_{0}(out, {1});
+}}\n\n'''.format(instr.name, visit_args(instr)))
 
 def write_out_disassemble_fun(instrs, out_file):
-    out_file.write('''int disassemble_instr(void* cur_ins, FILE* out) {
-\tuint8_t* opcode = cur_ins;
-\t
-\tswitch(*opcode) {
+    out_file.write('const v3d_cl_visitor_t disassemble_visitor = {\n')
+
+    for instr in instrs:
+        out_file.write('\t.visit_{0} = disassemble_visit_{0},\n'.format(instr.name))
+
+    out_file.write('''\t.visit_invalid = 0
+};
+
+int disassemble_instr(void* cur_ins, FILE* out) {
+\treturn visit_instr(&disassemble_visitor, out, cur_ins) != 0;
+}\n\n''')
+
+def write_out_cpp_visitor(instrs, out_file):
+    out_file.write('''namespace v3d_cl {
+
+//Derive from visitor_base and redeclare the visit_ functions for the opcodes of
+//interest.  visit_cl is instantiated per visitor type so the defaults inline
+//away leaving a tight scan over the opcodes that matter.  Returning true stops
+//the visit.
+struct visitor_base {
+''')
+
+    for instr in instrs:
+        params = 'instr_{0}_t*'.format(instr.name)
+        for a in instr.arguments:
+            params += ', {0}'.format(choose_c_type(a))
+        out_file.write('\tbool visit_{0}({1}) {{ return false; }}\n'.format(instr.name, params))
+
+    out_file.write('''\tbool visit_invalid(uint8_t*) { return true; }
+};
+
+template<typename Visitor>
+inline bool visit_instr(Visitor& visitor, uint8_t* cur_ins) {
+\tswitch(*cur_ins) {
 ''')
 
     for instr in instrs:
-        out_file.write('\t\tcase V3D_HW_INSTR_{0}: disassemble_{0}((instr_{0}_t*)cur_ins, out); return 0;\n'.format(instr.name))
+        out_file.write('''\t\tcase V3D_HW_INSTR_{0}: {{
+\t\t\tinstr_{0}_t* ins = reinterpret_cast<instr_{0}_t*>(cur_ins);
+\t\t\treturn visitor.visit_{0}({1});
+\t\t}}
+'''.format(instr.name, visit_args(instr)))
+
+    out_file.write('''\t\tdefault: return visitor.visit_invalid(cur_ins);
+\t}
+}
 
-    out_file.write('''\t\tdefault: return 1;
+//As the C visit_cl, visits [start, end) returning where the visit stopped
+template<typename Visitor>
+inline uint8_t* visit_cl(Visitor& visitor, uint8_t* start, uint8_t* end) {
+\tuint8_t* cur_ins = start;
+\t
+\twhile(cur_ins < end) {
+\t\tuint32_t size = v3d_instr_size(*cur_ins);
+\t\t
+\t\tif(cur_ins + (size ? size : 1) > end)
+\t\t\tbreak;
+\t\t
+\t\tif(visit_instr(visitor, cur_ins))
+\t\t\tbreak;
+\t\t
+\t\tcur_ins += size ? size : 1;
 \t}
 \t
-\treturn 1; //Should never get here
+\treturn cur_ins;
+}
+
 }\n\n''')
 
 def write_out_instr_fun_defs(instr, out_file):
@@ -351,15 +498,40 @@ h_header = '''//Auto-generated code for construction and disassembly of V3D CLE
 #include <stdio.h>
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {{
+#endif
+
 '''.format(datetime.now().strftime('%d/%m/%Y %H:%M'))
 
 h_footer = '''void* calc_next_ins(void* cur_ins);
 int disassemble_instr(void* cur_ins, FILE* out);
 
+extern const v3d_cl_visitor_t disassemble_visitor;
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
 
 '''
 
+hpp_header = '''//Auto-generated header-only C++ visitor interface for V3D CLE control lists
+//Generated on {0}
+
+#ifndef __V3D_CL_INSTR_AUTOGEN_HPP__
+#define __V3D_CL_INSTR_AUTOGEN_HPP__
+
+#include <stdint.h>
+#include "{{header_filename}}"
+
+'''.format(datetime.now().strftime('%d/%m/%Y %H:%M'))
+
+hpp_footer = '''#endif
+
+'''
+
 c_header = '''#include <stdio.h>
 #include "{header_filename}"
 
@@ -372,6 +544,9 @@ def main(out_filename):
    h_filename = out_filename + '.h'
    h_out_file = open(h_filename, 'w')
 
+   hpp_filename = out_filename + '.hpp'
+   hpp_out_file = open(hpp_filename, 'w')
+
    h_out_file.write(h_header)
    write_out_instr_defs(v3d_cl_instrs, h_out_file)
    
@@ -383,8 +558,17 @@ def main(out_filename):
    write_out_instr_fun_defs(shader_record, h_out_file)
    write_out_instr_struct(attr_array_record, h_out_file)
    write_out_instr_fun_defs(attr_array_record, h_out_file)
+
+   write_out_instr_size_fun(v3d_cl_instrs, h_out_file)
+   write_out_instr_name_fun(v3d_cl_instrs, h_out_file)
+   write_out_visitor_struct(v3d_cl_instrs, h_out_file)
+   write_out_visit_instr_fun(v3d_cl_instrs, h_out_file)
    
    h_out_file.write(h_footer)
+
+   hpp_out_file.write(hpp_header.format(header_filename=h_filename))
+   write_out_cpp_visitor(v3d_cl_instrs, hpp_out_file)
+   hpp_out_file.write(hpp_footer)
    
    c_out_file.write(c_header.format(header_filename=h_filename))
    for instr in v3d_cl_instrs:
@@ -401,6 +585,7 @@ def main(out_filename):
 
    c_out_file.close()
    h_out_file.close()
+   hpp_out_file.close()
 
 if __name__ == '__main__':
     if(len(sys.argv) != 2):